@@ -269,7 +269,10 @@ else
   BASIC_TESTS="basic-1 basic-2 basic-3 basic-4 basic-5 basic-6"
   MULTI_TESTS="multi-1 multi-2"
   CONC_TESTS="concurrent-1 concurrent-2 concurrent-3"
-  ALL_TESTS="${BASIC_TESTS} ${MULTI_TESTS} ${CONC_TESTS}"
+  SHARD_TESTS="shard-1"
+  IMPORT_TESTS="import-1 import-2"
+  EXPORT_TESTS="export-1 export-2 export-3"
+  ALL_TESTS="${BASIC_TESTS} ${MULTI_TESTS} ${CONC_TESTS} ${SHARD_TESTS} ${IMPORT_TESTS} ${EXPORT_TESTS}"
 fi
 
 # Timeout
@@ -0,0 +1,72 @@
+#include "admission.h"
+#include <netinet/in.h>
+#include <pthread.h>
+#include "metrics.h"
+
+/* Buckets are guarded by one of these locks, picked by slot. */
+#define ADMISSION_LOCKS 64
+
+typedef struct admission_bucket_t {
+  uint64_t key; /* 0 while the slot is unused */
+  double tokens;
+  uint64_t refilled_at;
+} admission_bucket_t;
+
+static admission_bucket_t BUCKETS[ADMISSION_BUCKETS];
+static pthread_mutex_t LOCKS[ADMISSION_LOCKS];
+static double RATE = 0, BURST = 0;
+
+void admission_set_rate(double rate, double burst) {
+  for (int idx = 0; idx < ADMISSION_LOCKS; idx++)
+    pthread_mutex_init(&LOCKS[idx], NULL);
+  RATE = rate > 0 ? rate : 0;
+  BURST = burst >= 1 ? burst : 1;
+}
+
+int admission_enabled(void) { return RATE > 0; }
+
+/* FNV-1a over `len` bytes, never 0. */
+static uint64_t hash_bytes(const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  return hash ? hash : 1;
+}
+
+uint64_t admission_client_key(const struct sockaddr_storage *addr) {
+  if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    return hash_bytes(&in6->sin6_addr, sizeof(in6->sin6_addr));
+  }
+  const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+  return hash_bytes(&in->sin_addr, sizeof(in->sin_addr));
+}
+
+int admission_take(uint64_t key) {
+  admission_bucket_t *bucket;
+  pthread_mutex_t *lock;
+  uint64_t now;
+  int allowed;
+
+  if (RATE <= 0)
+    return 1;
+  bucket = &BUCKETS[key & (ADMISSION_BUCKETS - 1)];
+  lock = &LOCKS[key & (ADMISSION_LOCKS - 1)];
+  now = metrics_now_ns();
+
+  pthread_mutex_lock(lock);
+  if (bucket->key != key) {
+    bucket->key = key;
+    bucket->tokens = BURST;
+  } else {
+    bucket->tokens += (double)(now - bucket->refilled_at) * RATE / 1e9;
+    if (bucket->tokens > BURST)
+      bucket->tokens = BURST;
+  }
+  bucket->refilled_at = now;
+  if ((allowed = bucket->tokens >= 1))
+    bucket->tokens -= 1;
+  pthread_mutex_unlock(lock);
+  return allowed;
+}
@@ -0,0 +1,39 @@
+#ifndef ADMISSION_HEADER
+#define ADMISSION_HEADER
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/** Per-client rate limiting for the controller.
+ *
+ *  Each client address has a token bucket, refilled at `rate` requests per
+ *  second up to `burst` tokens, and each request takes a token. A client
+ *  that has run out is turned away with `Error: Busy` until its bucket
+ *  refills, however many connections it spreads its requests across.
+ *
+ *  Buckets live in a direct-mapped table of `ADMISSION_BUCKETS` entries keyed
+ *  by address. An address that takes over the slot of another starts with a
+ *  full bucket, so a collision can only make the limit more lenient.
+ */
+
+#define ADMISSION_BUCKETS 4096 /* must be a power of two */
+
+/** @brief Limits each client address to `rate` requests per second, with
+ *         bursts of up to `burst` requests. A `rate` of 0 lifts the limit. */
+void admission_set_rate(double rate, double burst);
+
+/** @brief Returns 1 if requests are being rate limited. */
+int admission_enabled(void);
+
+/** @brief Returns the key of the bucket of the client at `addr`, which
+ *         ignores the client's port. */
+uint64_t admission_client_key(const struct sockaddr_storage *addr);
+
+/** @brief Takes a token from the bucket of the client `key`.
+ *
+ *  @returns 1 if the request may go ahead, or 0 if the client is over its
+ *           rate. Always 1 while rate limiting is off.
+ */
+int admission_take(uint64_t key);
+
+#endif
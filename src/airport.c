@@ -1,296 +1,512 @@
 #include "airport.h"
-
-/** This is the main file in which you should implement the airport server code.
- *  There are many functions here which are pre-written for you. You should read
- *  the comments in the corresponding `airport.h` header file to understand what
- *  each function does, the arguments they accept and how they are intended to
- *  be used.
- *
- *  You are encouraged to implement your own helper functions to handle requests
- *  in airport nodes in this file. You are also permitted to modify the
- *  functions you have been given if needed.
+#include "metrics.h"
+#include "persist.h"
+#include "trace.h"
+#include <sched.h>
+
+/** Core scheduling functions operating on the airport held by this process.
+ *  These have no dependency on the network, so they can be linked directly
+ *  into benchmarks and tools. The server loop of an airport node lives in
+ *  `airport_node.c`. See the comments in `airport.h` for what each function
+ *  does, the arguments they accept and how they are intended to be used.
  */
 
-/* This will be set by the `initialise_node` function. */
-static int AIRPORT_ID = -1;
-
 /* This will be set by the `initialise_node` function. */
 static airport_t *AIRPORT_DATA = NULL;
 
-/* thread pool def'ns */
-#define THREAD_POOL_SIZE 4
-#define QUEUE_SIZE 100
-
-// Data structure for connec'n queue and initialisation
-typedef struct conn_queue_t {
-    int connections[QUEUE_SIZE];
-    int front;
-    int rear;
-    int count;
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-} conn_queue_t;
-
-static conn_queue_t conn_queue;
-
-void init_queue(conn_queue_t *q) {
-    q->front = 0;
-    q->rear = 0;
-    q->count = 0;
-    pthread_mutex_init(&q->mutex, NULL);
-    pthread_cond_init(&q->not_empty, NULL);
-    pthread_cond_init(&q->not_full, NULL);
-}
-
-/* Enqueue a connection */
-void enqueue(conn_queue_t *q, int connfd) {
-    pthread_mutex_lock(&q->mutex);
-    while (q->count == QUEUE_SIZE) {
-        pthread_cond_wait(&q->not_full, &q->mutex);
+void use_airport(airport_t *airport) { AIRPORT_DATA = airport; }
+
+airport_t *get_airport(void) { return AIRPORT_DATA; }
+
+/* Whether `lock_gate` collects per-gate statistics. */
+static int LOCK_PROFILING = 0;
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+void set_lock_profiling(int enabled) {
+  if (enabled && !LOAD(&LOCK_PROFILING) && AIRPORT_DATA) {
+    /* Holders may still be updating their gate; the few racing updates only
+     * make the first sample slightly off. */
+    for (int i = 0; i < AIRPORT_DATA->num_gates; i++) {
+      gate_lock_stats_t *stats = &AIRPORT_DATA->gates[i].lock_stats;
+      STORE(&stats->acquisitions, 0);
+      STORE(&stats->contentions, 0);
+      STORE(&stats->wait_ns, 0);
+      STORE(&stats->hold_ns, 0);
+      STORE(&stats->cas_retries, 0);
+      STORE(&stats->fallbacks, 0);
     }
-    q->connections[q->rear] = connfd;
-    q->rear = (q->rear + 1) % QUEUE_SIZE;
-    q->count++;
-    pthread_cond_signal(&q->not_empty);
-    pthread_mutex_unlock(&q->mutex);
-}
-
-/* Dequeue a connection */
-int dequeue(conn_queue_t *q) {
-    pthread_mutex_lock(&q->mutex);
-    while (q->count == 0) {
-        pthread_cond_wait(&q->not_empty, &q->mutex);
+  }
+  STORE(&LOCK_PROFILING, enabled ? 1 : 0);
+}
+
+int lock_profiling_enabled(void) { return LOAD(&LOCK_PROFILING); }
+
+void lock_gate(gate_t *gate) {
+  gate_lock_stats_t *stats = &gate->lock_stats;
+  uint64_t begin, wait;
+  /* Only contended acquisitions pay for reading the clock. */
+  if (pthread_mutex_trylock(&gate->gate_lock) == 0) {
+    if (LOAD(&LOCK_PROFILING)) {
+      STORE(&stats->acquisitions, stats->acquisitions + 1);
+      stats->locked_at = metrics_now_ns();
     }
-    int connfd = q->connections[q->front];
-    q->front = (q->front + 1) % QUEUE_SIZE;
-    q->count--;
-    pthread_cond_signal(&q->not_full);
-    pthread_mutex_unlock(&q->mutex);
-    return connfd;
+    return;
+  }
+  begin = metrics_now_ns();
+  pthread_mutex_lock(&gate->gate_lock);
+  stats->locked_at = metrics_now_ns();
+  wait = stats->locked_at - begin;
+  metrics_record_lock_wait(wait);
+  trace_span("gate_lock_wait", begin, stats->locked_at);
+  if (LOAD(&LOCK_PROFILING)) {
+    STORE(&stats->acquisitions, stats->acquisitions + 1);
+    STORE(&stats->contentions, stats->contentions + 1);
+    STORE(&stats->wait_ns, stats->wait_ns + wait);
+  } else {
+    stats->locked_at = 0;
+  }
 }
 
-time_info_t schedule_plane(int plane_id, int start, int duration, int fuel) {
+void unlock_gate(gate_t *gate) {
+  gate_lock_stats_t *stats = &gate->lock_stats;
+  /* `locked_at` is 0 if profiling was off when this lock was taken. */
+  if (stats->locked_at && LOAD(&LOCK_PROFILING))
+    STORE(&stats->hold_ns, stats->hold_ns + (metrics_now_ns() - stats->locked_at));
+  stats->locked_at = 0;
+  pthread_mutex_unlock(&gate->gate_lock);
+}
+
+/* A gate's contention counters, copied so they cannot change while sorting. */
+typedef struct contention_t {
+  int gate_idx;
+  uint64_t contentions; // lock contentions and lost booking races
+  uint64_t wait_ns;
+} contention_t;
+
+/* Orders gates by contention count, then wait time, most contended first. */
+static int compare_contention(const void *a, const void *b) {
+  const contention_t *x = a, *y = b;
+  if (x->contentions != y->contentions)
+    return x->contentions < y->contentions ? 1 : -1;
+  if (x->wait_ns != y->wait_ns)
+    return x->wait_ns < y->wait_ns ? 1 : -1;
+  return x->gate_idx - y->gate_idx;
+}
+
+int top_contended_gates(int *gate_idxs, int max) {
+  contention_t *contended;
+  int count = 0;
+  if (max <= 0 ||
+      (contended = malloc(sizeof(contention_t) * (unsigned)AIRPORT_DATA->num_gates)) == NULL)
+    return 0;
+  for (int i = 0; i < AIRPORT_DATA->num_gates; i++) {
+    gate_lock_stats_t *stats = &AIRPORT_DATA->gates[i].lock_stats;
+    contention_t c = {i, LOAD(&stats->contentions) + LOAD(&stats->cas_retries),
+                      LOAD(&stats->wait_ns)};
+    if (c.contentions > 0)
+      contended[count++] = c;
+  }
+  qsort(contended, (size_t)count, sizeof(contention_t), compare_contention);
+  if (count > max)
+    count = max;
+  for (int i = 0; i < count; i++)
+    gate_idxs[i] = contended[i].gate_idx;
+  free(contended);
+  return count;
+}
+
+/* Optimistic attempts at booking a gate before falling back to its lock. */
+#define OPTIMISTIC_ATTEMPTS 4
+#define ASSIGN_CONFLICT (-2)
+
+/* Adds one to the lock profiling counter `field` of `gate`, if profiling. */
+#define COUNT_CONTENTION(gate, field)                                                   \
+  do {                                                                                  \
+    if (LOAD(&LOCK_PROFILING))                                                          \
+      __atomic_fetch_add(&(gate)->lock_stats.field, 1, __ATOMIC_RELAXED);               \
+  } while (0)
+
+/* The scheduling kernels below take the horizon's slot count as their last
+ * argument. They are only ever called with a constant, from the functions
+ * `DEFINE_HORIZON` instantiates for each horizon, so each instance has its
+ * bounds folded and keeps only one of the occupancy word or bitmap paths. */
+#define KERNEL static inline __attribute__((always_inline))
+
+/* Bits of slots `[start]..[start + duration]` in an occupancy word. */
+static inline uint64_t span_mask(int start, int duration) {
+  return ((2ull << duration) - 1) << start;
+}
+
+/* Bits of slots `[start]..[end]` that fall in word `word` of a bitmap. */
+static inline uint64_t word_mask(int word, int start, int end) {
+  int lo = start - word * 64, hi = end - word * 64;
+  uint64_t mask = hi >= 63 ? ~0ull : (2ull << hi) - 1;
+  return lo <= 0 ? mask : mask & (~0ull << lo);
+}
+
+/* Returns the last booked slot of `[start]..[end]` in `gate`, whose occupancy
+ * word read `occ`, or -1 if they are all free. */
+KERNEL int last_booked(const gate_t *gate, uint64_t occ, int start, int end, const int slots) {
+  if (slots < 64) {
+    uint64_t hit = occ & span_mask(start, end - start);
+    return hit ? 63 - __builtin_clzll(hit) : -1;
+  }
+  for (int word = end / 64; word >= start / 64; word--) {
+    uint64_t hit = LOAD(&gate->busy[word]) & word_mask(word, start, end);
+    if (hit)
+      return word * 64 + 63 - __builtin_clzll(hit);
+  }
+  return -1;
+}
+
+/* Returns the first booked slot of `gate` from `from` onwards, or -1. */
+KERNEL int next_booked(const gate_t *gate, uint64_t occ, int from, const int slots) {
+  if (from >= slots)
+    return -1;
+  if (slots < 64) {
+    uint64_t hit = occ & ~GATE_COMMITTING & (~0ull << from);
+    return hit ? __builtin_ctzll(hit) : -1;
+  }
+  for (int word = from / 64; word < BUSY_WORDS(slots); word++) {
+    uint64_t hit = LOAD(&gate->busy[word]) & word_mask(word, from, slots - 1);
+    if (hit)
+      return word * 64 + __builtin_ctzll(hit);
+  }
+  return -1;
+}
+
+/* Sets the bits of slots `[start]..[end]` in the bitmap of `gate`. */
+static void mark_busy(gate_t *gate, int start, int end) {
+  for (int word = start / 64; word <= end / 64; word++)
+    __atomic_fetch_or(&gate->busy[word], word_mask(word, start, end), __ATOMIC_RELAXED);
+}
+
+/* Finds where `assign_in_gate` would place a booking, given the occupancy
+ * `occ` of `gate`, or returns -1. */
+KERNEL int find_free_span(const gate_t *gate, uint64_t occ, int start, int duration, int fuel,
+                          const int slots) {
+  int idx = start, booked;
+  while (idx <= start + fuel && idx + duration < slots) {
+    if ((booked = last_booked(gate, occ, idx, idx + duration, slots)) < 0)
+      return idx;
+    // every span starting at or before the booked slot overlaps it
+    idx = booked + 1;
+  }
+  return -1;
+}
+
+/* Claims slots `[idx]..[idx + duration]`, which are free in `occ`, and writes
+ * the booking into them. Fails if the gate's occupancy is no longer `occ`. */
+KERNEL int commit_span(gate_t *gate, uint64_t occ, int plane_id, int idx, int duration,
+                       const int slots) {
+  uint64_t next = slots < 64 ? occ | span_mask(idx, duration) : occ + 1;
+  if (!__atomic_compare_exchange_n(&gate->occupancy, &occ, next | GATE_COMMITTING,
+                                   0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return -1;
+  if (slots >= 64)
+    mark_busy(gate, idx, idx + duration);
+  for (int slot = idx; slot <= idx + duration; slot++)
+    set_time_slot(&gate->time_slots[slot], plane_id, idx, idx + duration);
+  __atomic_store_n(&gate->occupancy, next, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* `assign_in_gate`, giving up with `ASSIGN_CONFLICT` after `attempts` lost
+ * races, or never if `attempts` is negative. */
+KERNEL int try_assign(gate_t *gate, int plane_id, int start, int duration, int fuel,
+                      int attempts, const int slots) {
+  uint64_t occ;
+  int idx;
+  for (; attempts != 0; attempts--) {
+    occ = __atomic_load_n(&gate->occupancy, __ATOMIC_ACQUIRE);
+    if (occ & GATE_COMMITTING) {
+      COUNT_CONTENTION(gate, cas_retries);
+      sched_yield();
+      continue;
+    }
+    if ((idx = find_free_span(gate, occ, start, duration, fuel, slots)) < 0)
+      return -1;
+    if (commit_span(gate, occ, plane_id, idx, duration, slots) == 0)
+      return idx;
+    COUNT_CONTENTION(gate, cas_retries);
+  }
+  return ASSIGN_CONFLICT;
+}
+
+KERNEL time_info_t schedule_plane_in(int plane_id, int start, int duration, int fuel,
+                                     const int slots) {
   time_info_t result = {-1, -1, -1};
   gate_t *gate;
   int gate_idx, slot;
   for (gate_idx = 0; gate_idx < AIRPORT_DATA->num_gates; gate_idx++) {
     gate = get_gate_by_idx(gate_idx);
-    // Lock the gate before attempting to assign -- Individual Gate Locking
-    pthread_mutex_lock(&gate->gate_lock);
-    if ((slot = assign_in_gate(gate, plane_id, start, duration, fuel)) >= 0) {
+    slot = try_assign(gate, plane_id, start, duration, fuel, OPTIMISTIC_ATTEMPTS, slots);
+    if (slot == ASSIGN_CONFLICT) {
+      // Kept losing races on this gate: queue up behind other such writers
+      COUNT_CONTENTION(gate, fallbacks);
+      lock_gate(gate);
+      slot = try_assign(gate, plane_id, start, duration, fuel, -1, slots);
+      unlock_gate(gate);
+    }
+    if (slot >= 0) {
       result.start_time = slot;
       result.gate_number = gate_idx;
       result.end_time = slot + duration;
-      pthread_mutex_unlock(&gate->gate_lock);
+      persist_log_schedule(plane_id, gate_idx, slot, slot + duration);
       break;
     }
-    pthread_mutex_unlock(&gate->gate_lock);
   }
   return result;
 }
 
-/* Worker thread function intended to handle client requests */
-void *worker_thread(void *arg) {
-    while (1) {
-        int connfd = dequeue(&conn_queue);
-        // Handle the connection
-        rio_t rio_client, rio_airport;
-        char buf[MAXLINE], response[MAXLINE];
-
-        rio_readinitb(&rio_client, connfd);//rio initialisation
-
-        while (1) {
-            ssize_t n = rio_readlineb(&rio_client, buf, MAXLINE); //reading a line
-            if (n <= 0) {
-                break; // No input
-            }
-
-            // Parsing logic
-            char request_type[MAXLINE];
-            int airport_num;
-            char rest_of_request[MAXLINE] = {0}; // empty string
-
-            int num_parsed = sscanf(buf, "%s %d %[^\n]", request_type, &airport_num, rest_of_request);
-
-            // Initial validation: queries without command and airport_num are pre-invalidated.
-            if (num_parsed < 2) {
-                sprintf(response, "Error: Invalid request provided\n");
-                rio_writen(connfd, response, strlen(response));
-                continue;
-            }
-
-            // Valid airport_num error handling
-            if (airport_num != AIRPORT_ID) {
-                sprintf(response, "Error: Airport %d does not exist\n", airport_num);
-                rio_writen(connfd, response, strlen(response));
-                continue;
-            }
-
-            //SCHEDULE command error handling
-            if (strcmp(request_type, "SCHEDULE") == 0) {
-                int plane_id, earliest_time, duration, fuel;
-                //not enough arguments 
-                if (sscanf(rest_of_request, "%d %d %d %d", &plane_id, &earliest_time, &duration, &fuel) != 4) {
-                    sprintf(response, "Error: Invalid request provided\n");
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-                // Invalid earliest time error
-                if (earliest_time < 0 || earliest_time >= NUM_TIME_SLOTS) {
-                    sprintf(response, "Error: Invalid 'earliest' time (%d)\n", earliest_time);
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-                // Invalid duration errors - 2
-                if (duration < 0) {
-                    sprintf(response, "Error: Invalid 'duration' value (%d)\n", duration);
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-                if (earliest_time + duration > NUM_TIME_SLOTS) {
-                    sprintf(response, "Error: Invalid 'duration' value (%d)\n", duration);
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-
-                // Schedule the plane
-                time_info_t result = schedule_plane(plane_id, earliest_time, duration, fuel);
-
-                //Successful SCHEDULED command response
-                if (result.gate_number >= 0) {
-                    int start_time = result.start_time;
-                    int end_time = result.end_time;
-                    int gate_num = result.gate_number;
-
-                    // time to string conversion code as given in assignment spec
-                    int start_hour = IDX_TO_HOUR(start_time);
-                    int start_mins = (int)IDX_TO_MINS(start_time);
-                    int end_hour = IDX_TO_HOUR(end_time);
-                    int end_mins = (int)IDX_TO_MINS(end_time);
-
-                    sprintf(response, "SCHEDULED %d at GATE %d: %02d:%02d-%02d:%02d\n",
-                            plane_id, gate_num,
-                            start_hour, start_mins,
-                            end_hour, end_mins);
-                } else {
-                  //Unsuccessful error
-                    sprintf(response, "Error: Cannot schedule %d\n", plane_id);
-                }
-                rio_writen(connfd, response, strlen(response));
-
-            } //PLANE_STATUS command validation
-            else if (strcmp(request_type, "PLANE_STATUS") == 0) {
-                int plane_id;
-                //not enough arguments 
-                if (sscanf(rest_of_request, "%d", &plane_id) != 1) {
-                    sprintf(response, "Error: Invalid request provided\n");
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-                //plane lookup
-                time_info_t result = lookup_plane_in_airport(plane_id);
-
-                //plane found
-                if (result.gate_number >= 0) {
-                    int start_time = result.start_time;
-                    int end_time = result.end_time;
-                    int gate_num = result.gate_number;
-
-                    // time to string conversion code as given in assignment spec
-                    int start_hour = IDX_TO_HOUR(start_time);
-                    int start_mins = (int)IDX_TO_MINS(start_time);
-                    int end_hour = IDX_TO_HOUR(end_time);
-                    int end_mins = (int)IDX_TO_MINS(end_time);
-
-                    sprintf(response, "PLANE %d scheduled at GATE %d: %02d:%02d-%02d:%02d\n",
-                            plane_id, gate_num,
-                            start_hour, start_mins,
-                            end_hour, end_mins);
-                } else {
-                  //plane not found
-                    sprintf(response, "PLANE %d not scheduled at airport %d\n", plane_id, AIRPORT_ID);
-                }
-                rio_writen(connfd, response, strlen(response));
-
-            } //TIME_STATUS command handling 
-            else if (strcmp(request_type, "TIME_STATUS") == 0) {
-                int gate_num, start_idx, duration;
-                //not enough arguments 
-                if (sscanf(rest_of_request, "%d %d %d", &gate_num, &start_idx, &duration) != 3) {
-                    sprintf(response, "Error: Invalid request provided\n");
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-
-                // Invalid gate_num error
-                if (gate_num < 0 || gate_num >= AIRPORT_DATA->num_gates) {
-                    sprintf(response, "Error: Invalid 'gate' value (%d)\n", gate_num);
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-                // Invalid start_idx error
-                if (start_idx < 0 || start_idx >= NUM_TIME_SLOTS) {
-                    sprintf(response, "Error: Invalid 'start' time (%d)\n", start_idx);
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-                // Invalid duration errors - 2
-                if (duration < 0) {
-                    sprintf(response, "Error: Invalid 'duration' value (%d)\n", duration);
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-                if (start_idx + duration >= NUM_TIME_SLOTS) {
-                    sprintf(response, "Error: Invalid 'duration' value (%d)\n", duration);
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-
-                //get gate
-                gate_t *gate = get_gate_by_idx(gate_num);
-                if (gate == NULL) {
-                  //wrong gate error
-                    sprintf(response, "Error: Invalid 'gate' value (%d)\n", gate_num);
-                    rio_writen(connfd, response, strlen(response));
-                    continue;
-                }
-
-                int end_idx = start_idx + duration;
-
-                // Locking the specific gate before accessing its schedule
-                pthread_mutex_lock(&gate->gate_lock);
-
-                for (int idx = start_idx; idx <= end_idx; idx++) {
-                    time_slot_t *ts = get_time_slot_by_idx(gate, idx);
-                    if (ts == NULL) {
-                        continue; // Skipping invalid time slots
-                    }
-                    char status = ts->status == 1 ? 'A' : 'F';
-                    int flight_id = ts->status == 1 ? ts->plane_id : 0;
-
-                    // Cast IDX_TO_HOUR and IDX_TO_MINS to int
-                    int current_hour = IDX_TO_HOUR(idx);
-                    int current_mins = (int)IDX_TO_MINS(idx);
-
-                    sprintf(response, "AIRPORT %d GATE %d %02d:%02d: %c - %d\n",
-                            AIRPORT_ID, gate_num,
-                            current_hour, current_mins,
-                            status, flight_id);
-                    rio_writen(connfd, response, strlen(response));
-                }
-
-                // Unlocking the gate after accessing its schedule
-                pthread_mutex_unlock(&gate->gate_lock);
-
-            } else {
-                sprintf(response, "Error: Invalid request provided\n");
-                rio_writen(connfd, response, strlen(response));
-            }
-        }
-        close(connfd);
+KERNEL time_info_t find_plane_slot_in(int start, int duration, int fuel, const int slots) {
+  time_info_t result = {-1, -1, -1};
+  gate_t *gate;
+  uint64_t occ;
+  int gate_idx, slot;
+  for (gate_idx = 0; gate_idx < AIRPORT_DATA->num_gates; gate_idx++) {
+    /* Slots of a booking being committed are already marked in the word;
+     * a bitmap may miss it, as if the probe had come just before it. */
+    gate = get_gate_by_idx(gate_idx);
+    occ = __atomic_load_n(&gate->occupancy, __ATOMIC_ACQUIRE);
+    if ((slot = find_free_span(gate, occ & ~GATE_COMMITTING, start, duration, fuel, slots)) >= 0) {
+      result.start_time = slot;
+      result.gate_number = gate_idx;
+      result.end_time = slot + duration;
+      break;
     }
-    return NULL;
+  }
+  return result;
+}
+
+KERNEL int search_gate_in(gate_t *gate, int plane_id, const int slots) {
+  uint64_t occ = LOAD(&gate->occupancy);
+  time_slot_t *ts;
+  int idx = 0;
+  // only booked slots are visited, a booking at a time
+  while ((idx = next_booked(gate, occ, idx, slots)) >= 0) {
+    ts = &gate->time_slots[idx];
+    if (ts->status == 1 && ts->plane_id == plane_id)
+      return idx;
+    /* A booking being written may not have its end time yet; the read is
+     * retried then, but must still move forward. */
+    idx = ts->end_time >= idx ? ts->end_time + 1 : idx + 1;
+  }
+  return -1;
+}
+
+KERNEL time_info_t lookup_plane_in(int plane_id, const int slots) {
+  time_info_t result = {-1, -1, -1};
+  int gate_idx, slot_idx, end_time = -1;
+  uint64_t seq;
+  gate_t *gate;
+  for (gate_idx = 0; gate_idx < AIRPORT_DATA->num_gates; gate_idx++) {
+    gate = get_gate_by_idx(gate_idx);
+    do {
+      seq = gate_read_begin(gate);
+      if ((slot_idx = search_gate_in(gate, plane_id, slots)) >= 0)
+        end_time = get_time_slot_by_idx(gate, slot_idx)->end_time;
+    } while (gate_read_retry(gate, seq));
+    if (slot_idx >= 0) {
+      result.start_time = slot_idx;
+      result.gate_number = gate_idx;
+      result.end_time = end_time;
+      break;
+    }
+  }
+  return result;
+}
+
+KERNEL time_info_t import_plane_in(airport_t *airport, int plane_id, int start, int duration,
+                                   int fuel, const int slots) {
+  time_info_t result = {-1, -1, -1};
+  gate_t *gate;
+  int gate_idx, idx;
+  for (gate_idx = 0; gate_idx < airport->num_gates; gate_idx++) {
+    gate = &airport->gates[gate_idx];
+    if ((idx = find_free_span(gate, gate->occupancy, start, duration, fuel, slots)) < 0)
+      continue;
+    for (int slot = idx; slot <= idx + duration; slot++)
+      set_time_slot(&gate->time_slots[slot], plane_id, idx, idx + duration);
+    if (slots < 64) {
+      gate->occupancy |= span_mask(idx, duration);
+    } else {
+      for (int word = idx / 64; word <= (idx + duration) / 64; word++)
+        gate->busy[word] |= word_mask(word, idx, idx + duration);
+      gate->occupancy++;
+    }
+    result.start_time = idx;
+    result.gate_number = gate_idx;
+    result.end_time = idx + duration;
+    break;
+  }
+  return result;
+}
+
+/* The kernels of one horizon, compiled for its slot count. */
+typedef struct horizon_t {
+  int slots;
+  int slot_minutes;
+  int (*try_assign)(gate_t *gate, int plane_id, int start, int duration, int fuel, int attempts);
+  time_info_t (*schedule_plane)(int plane_id, int start, int duration, int fuel);
+  time_info_t (*find_plane_slot)(int start, int duration, int fuel);
+  int (*search_gate)(gate_t *gate, int plane_id);
+  time_info_t (*lookup_plane)(int plane_id);
+  time_info_t (*import_plane)(airport_t *airport, int plane_id, int start, int duration,
+                              int fuel);
+} horizon_t;
+
+#define DEFINE_HORIZON(SLOTS)                                                              \
+  static int try_assign_##SLOTS(gate_t *gate, int plane_id, int start, int duration,      \
+                                int fuel, int attempts) {                                 \
+    return try_assign(gate, plane_id, start, duration, fuel, attempts, SLOTS);            \
+  }                                                                                        \
+  static time_info_t schedule_plane_##SLOTS(int plane_id, int start, int duration,        \
+                                            int fuel) {                                   \
+    return schedule_plane_in(plane_id, start, duration, fuel, SLOTS);                     \
+  }                                                                                        \
+  static time_info_t find_plane_slot_##SLOTS(int start, int duration, int fuel) {         \
+    return find_plane_slot_in(start, duration, fuel, SLOTS);                              \
+  }                                                                                        \
+  static int search_gate_##SLOTS(gate_t *gate, int plane_id) {                            \
+    return search_gate_in(gate, plane_id, SLOTS);                                         \
+  }                                                                                        \
+  static time_info_t lookup_plane_##SLOTS(int plane_id) {                                 \
+    return lookup_plane_in(plane_id, SLOTS);                                              \
+  }                                                                                        \
+  static time_info_t import_plane_##SLOTS(airport_t *airport, int plane_id, int start,    \
+                                          int duration, int fuel) {                       \
+    return import_plane_in(airport, plane_id, start, duration, fuel, SLOTS);              \
+  }
+
+DEFINE_HORIZON(48)
+DEFINE_HORIZON(96)
+DEFINE_HORIZON(288)
+DEFINE_HORIZON(2016)
+
+#define HORIZON(SLOTS, MINUTES)                                                            \
+  {SLOTS, MINUTES, try_assign_##SLOTS, schedule_plane_##SLOTS, find_plane_slot_##SLOTS,    \
+   search_gate_##SLOTS, lookup_plane_##SLOTS, import_plane_##SLOTS}
+
+static const horizon_t HORIZONS[] = {
+    HORIZON(48, 30), HORIZON(96, 15), HORIZON(288, 5), HORIZON(2016, 5),
+};
+static const horizon_t *HORIZON_IN_USE = &HORIZONS[0];
+
+int NUM_TIME_SLOTS = DEFAULT_TIME_SLOTS;
+int SLOT_MINUTES = 30;
+
+_Static_assert(DEFAULT_TIME_SLOTS == 48, "the default horizon must be the first one");
+
+int set_time_slots(int slots) {
+  for (size_t i = 0; i < sizeof(HORIZONS) / sizeof(HORIZONS[0]); i++) {
+    if (HORIZONS[i].slots == slots) {
+      HORIZON_IN_USE = &HORIZONS[i];
+      NUM_TIME_SLOTS = HORIZONS[i].slots;
+      SLOT_MINUTES = HORIZONS[i].slot_minutes;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+time_info_t schedule_plane(int plane_id, int start, int duration, int fuel) {
+  return HORIZON_IN_USE->schedule_plane(plane_id, start, duration, fuel);
+}
+
+time_info_t find_plane_slot(int start, int duration, int fuel) {
+  return HORIZON_IN_USE->find_plane_slot(start, duration, fuel);
+}
+
+time_info_t import_plane(airport_t *airport, int plane_id, int start, int duration,
+                         int fuel) {
+  return HORIZON_IN_USE->import_plane(airport, plane_id, start, duration, fuel);
+}
+
+int apply_booking(int plane_id, int gate_idx, int start, int end) {
+  gate_t *gate = get_gate_by_idx(gate_idx);
+  uint64_t occ;
+  if (gate == NULL || start < 0 || end >= NUM_TIME_SLOTS || start > end)
+    return -1;
+  while (1) {
+    occ = gate_read_begin(gate);
+    if (last_booked(gate, occ, start, end, NUM_TIME_SLOTS) >= 0) {
+      // only the very same booking may be there already
+      time_slot_t *ts = &gate->time_slots[start];
+      return ts->status == 1 && ts->plane_id == plane_id && ts->start_time == start &&
+                     ts->end_time == end
+                 ? 0
+                 : -1;
+    }
+    if (commit_span(gate, occ, plane_id, start, end - start, NUM_TIME_SLOTS) == 0)
+      break;
+  }
+  persist_log_schedule(plane_id, gate_idx, start, end);
+  return 0;
+}
+
+uint64_t gate_read_begin(gate_t *gate) {
+  uint64_t occ;
+  while ((occ = __atomic_load_n(&gate->occupancy, __ATOMIC_ACQUIRE)) & GATE_COMMITTING)
+    sched_yield();
+  return occ;
+}
+
+int gate_read_retry(gate_t *gate, uint64_t seq) {
+  /* Occupancy only grows, so any booking since `seq` changes the word. */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return LOAD(&gate->occupancy) != seq;
+}
+
+/* Waits out any booking being written on `gate`, then holds off others until
+ * its occupancy is stored back. Returns the occupancy to store. */
+static uint64_t pause_gate(gate_t *gate) {
+  uint64_t occ;
+  do {
+    occ = gate_read_begin(gate);
+  } while (!__atomic_compare_exchange_n(&gate->occupancy, &occ, occ | GATE_COMMITTING, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  return occ;
+}
+
+int snapshot_airport(time_slot_t *dst) {
+  int num_gates = AIRPORT_DATA->num_gates, gate_idx, attempt;
+  size_t gate_slots = (size_t)NUM_TIME_SLOTS;
+  uint64_t *seqs = malloc(sizeof(uint64_t) * (size_t)num_gates);
+  gate_t *gates = AIRPORT_DATA->gates;
+
+  if (seqs == NULL)
+    return -1;
+  /* If no gate changed between its first read and the check after every
+   * copy, each still was as copied once the last first read was made. */
+  for (attempt = 0; attempt < SNAPSHOT_ATTEMPTS; attempt++) {
+    for (gate_idx = 0; gate_idx < num_gates; gate_idx++)
+      seqs[gate_idx] = gate_read_begin(&gates[gate_idx]);
+    for (gate_idx = 0; gate_idx < num_gates; gate_idx++)
+      memcpy(&dst[(size_t)gate_idx * gate_slots], gates[gate_idx].time_slots,
+             sizeof(time_slot_t) * gate_slots);
+    for (gate_idx = 0; gate_idx < num_gates; gate_idx++) {
+      if (gate_read_retry(&gates[gate_idx], seqs[gate_idx]))
+        break;
+    }
+    if (gate_idx == num_gates) {
+      free(seqs);
+      return 0;
+    }
+  }
+
+  // Bookings keep landing: pause every gate, always in the same order
+  for (gate_idx = 0; gate_idx < num_gates; gate_idx++)
+    seqs[gate_idx] = pause_gate(&gates[gate_idx]);
+  for (gate_idx = 0; gate_idx < num_gates; gate_idx++)
+    memcpy(&dst[(size_t)gate_idx * gate_slots], gates[gate_idx].time_slots,
+           sizeof(time_slot_t) * gate_slots);
+  for (gate_idx = 0; gate_idx < num_gates; gate_idx++)
+    __atomic_store_n(&gates[gate_idx].occupancy, seqs[gate_idx], __ATOMIC_RELEASE);
+  free(seqs);
+  return 0;
 }
 
 gate_t *get_gate_by_idx(int gate_idx) {
@@ -308,14 +524,8 @@ time_slot_t *get_time_slot_by_idx(gate_t *gate, int slot_idx) {
 }
 
 int check_time_slots_free(gate_t *gate, int start_idx, int end_idx) {
-  time_slot_t *ts;
-  int idx;
-  for (idx = start_idx; idx <= end_idx; idx++) {
-    ts = get_time_slot_by_idx(gate, idx);
-    if (ts->status == 1)
-      return 0;
-  }
-  return 1;
+  uint64_t occ = __atomic_load_n(&gate->occupancy, __ATOMIC_ACQUIRE);
+  return last_booked(gate, occ, start_idx, end_idx, NUM_TIME_SLOTS) < 0;
 }
 
 int set_time_slot(time_slot_t *ts, int plane_id, int start_idx, int end_idx) {
@@ -328,6 +538,17 @@ int set_time_slot(time_slot_t *ts, int plane_id, int start_idx, int end_idx) {
   return 0;
 }
 
+/* Publishes slots `[start]..[end]` of `gate`, written outside `commit_span`,
+ * as booked. */
+static void mark_booked(gate_t *gate, int start, int end) {
+  if (NUM_TIME_SLOTS < 64) {
+    __atomic_fetch_or(&gate->occupancy, span_mask(start, end - start), __ATOMIC_RELEASE);
+  } else {
+    mark_busy(gate, start, end);
+    __atomic_fetch_add(&gate->occupancy, 1, __ATOMIC_RELEASE);
+  }
+}
+
 int add_plane_to_slots(gate_t *gate, int plane_id, int start, int count) {
   int ret = 0, end = start + count;
   time_slot_t *ts = NULL;
@@ -335,117 +556,201 @@ int add_plane_to_slots(gate_t *gate, int plane_id, int start, int count) {
     ts = get_time_slot_by_idx(gate, idx);
     ret = set_time_slot(ts, plane_id, start, end);
     if (ret < 0) break;
+    mark_booked(gate, idx, idx);
   }
   return ret;
 }
 
-int search_gate(gate_t *gate, int plane_id) {
-  int idx, next_idx;
-  time_slot_t *ts = NULL;
-  for (idx = 0; idx < NUM_TIME_SLOTS; idx = next_idx) {
+int restore_plane_in_gate(gate_t *gate, int plane_id, int start, int end) {
+  time_slot_t *ts;
+  int idx;
+  if (start < 0 || end >= NUM_TIME_SLOTS || start > end)
+    return -1;
+  for (idx = start; idx <= end; idx++) {
     ts = get_time_slot_by_idx(gate, idx);
-    if (ts->status == 0) {
-      next_idx = idx + 1;
-    } else if (ts->plane_id == plane_id) {
-      return idx;
-    } else {
-      next_idx = ts->end_time + 1;
-    }
+    if (ts->status == 1 && (ts->plane_id != plane_id ||
+                            ts->start_time != start || ts->end_time != end))
+      return -1;
   }
-  return -1;
+  for (idx = start; idx <= end; idx++)
+    set_time_slot(get_time_slot_by_idx(gate, idx), plane_id, start, end);
+  mark_booked(gate, start, end);
+  return 0;
+}
+
+int search_gate(gate_t *gate, int plane_id) {
+  return HORIZON_IN_USE->search_gate(gate, plane_id);
 }
 
 time_info_t lookup_plane_in_airport(int plane_id) {
-  time_info_t result = {-1, -1, -1};
-  int gate_idx, slot_idx;
-  gate_t *gate;
-  for (gate_idx = 0; gate_idx < AIRPORT_DATA->num_gates; gate_idx++) {
-    gate = get_gate_by_idx(gate_idx);
-    // Lock the gate before searching -- Gate wise locking
-    pthread_mutex_lock(&gate->gate_lock);
-    if ((slot_idx = search_gate(gate, plane_id)) >= 0) {
-      result.start_time = slot_idx;
-      result.gate_number = gate_idx;
-      result.end_time = get_time_slot_by_idx(gate, slot_idx)->end_time;
-      pthread_mutex_unlock(&gate->gate_lock);
-      break;
-    }
-    pthread_mutex_unlock(&gate->gate_lock);
-  }
-  return result;
+  return HORIZON_IN_USE->lookup_plane(plane_id);
 }
 
 int assign_in_gate(gate_t *gate, int plane_id, int start, int duration, int fuel) {
-  int idx, end = start + duration;
-  for (idx = start; idx <= (start + fuel) && (end < NUM_TIME_SLOTS); idx++) {
-    if (check_time_slots_free(gate, idx, end)) {
-      add_plane_to_slots(gate, plane_id, idx, duration);
-      return idx;
-    }
-    end++;
-  }
-  return -1;
+  return HORIZON_IN_USE->try_assign(gate, plane_id, start, duration, fuel, -1);
 }
 
 airport_t *create_airport(int num_gates) {
   airport_t *data = NULL;
-  size_t memsize = 0;
+  size_t memsize = 0, words = 0;
+  time_slot_t *slots = NULL;
+  uint64_t *busy = NULL;
   if (num_gates > 0) {
     memsize = sizeof(airport_t) + (sizeof(gate_t) * (unsigned)num_gates);
     data = calloc(1, memsize);
+    slots = calloc((unsigned)num_gates, sizeof(time_slot_t) * (unsigned)NUM_TIME_SLOTS);
+    if (NUM_TIME_SLOTS >= 64) {
+      words = (size_t)BUSY_WORDS(NUM_TIME_SLOTS);
+      busy = calloc((unsigned)num_gates, sizeof(uint64_t) * words);
+    }
   }
-  if (data) {
+  if (data && slots && (busy || words == 0)) {
     data->num_gates = num_gates;
+    data->busy = busy;
     // initialising each gate's mutex
     for (int i = 0; i < num_gates; i++) {
       pthread_mutex_init(&data->gates[i].gate_lock, NULL);
+      if (busy)
+        data->gates[i].busy = &busy[(size_t)i * words];
     }
+    attach_airport_slots(data, slots, 0);
+  } else {
+    free(data);
+    free(slots);
+    free(busy);
+    data = NULL;
   }
   return data;
 }
 
-void initialise_node(int airport_id, int num_gates, int listenfd) {
-  AIRPORT_ID = airport_id;
-  AIRPORT_DATA = create_airport(num_gates);
-  if (AIRPORT_DATA == NULL)
-    exit(1);
-
-  // initialising the connection queue
-  init_queue(&conn_queue);
+void attach_airport_slots(airport_t *airport, time_slot_t *slots, int mapped) {
+  if (airport->slots && !airport->slots_mapped)
+    free(airport->slots);
+  airport->slots = slots;
+  airport->slots_mapped = mapped;
+  for (int i = 0; i < airport->num_gates; i++) {
+    airport->gates[i].time_slots = &slots[(size_t)i * (unsigned)NUM_TIME_SLOTS];
+  }
+  rebuild_occupancy(airport);
+}
 
-  // Creating worker threads
-  pthread_t threads[THREAD_POOL_SIZE];
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-    if (pthread_create(&threads[i], NULL, worker_thread, NULL) != 0) {
-      perror("pthread_create");
-      exit(1);
+void rebuild_occupancy(airport_t *airport) {
+  for (int i = 0; i < airport->num_gates; i++) {
+    gate_t *gate = &airport->gates[i];
+    uint64_t occ = 0;
+    if (gate->busy) {
+      // the bitmap is rebuilt while nothing else reads it
+      memset(gate->busy, 0, sizeof(uint64_t) * (size_t)BUSY_WORDS(NUM_TIME_SLOTS));
+      for (int idx = 0; idx < NUM_TIME_SLOTS; idx++) {
+        if (gate->time_slots[idx].status == 1)
+          gate->busy[idx / 64] |= 1ull << (idx % 64);
+      }
+    } else {
+      for (int idx = 0; idx < NUM_TIME_SLOTS; idx++) {
+        if (gate->time_slots[idx].status == 1)
+          occ |= 1ull << idx;
+      }
     }
-    pthread_detach(threads[i]); // Detached mode implementation
+    STORE(&gate->occupancy, occ);
   }
+}
+
+/* "HH:MM" of every time slot, filled in by `init_slot_times`. Hours of
+ * week-long horizons take a third digit. */
+static char SLOT_TIMES[MAX_TIME_SLOTS][6];
+static unsigned char SLOT_TIMES_LEN[MAX_TIME_SLOTS];
+static pthread_once_t SLOT_TIMES_ONCE = PTHREAD_ONCE_INIT;
+
+/* Pairs of decimal digits "00".."99", for converting two digits at a time */
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void init_slot_times(void) {
+  for (int idx = 0; idx < NUM_TIME_SLOTS; idx++) {
+    int hour = IDX_TO_HOUR(idx), mins = (int)IDX_TO_MINS(idx), len = 0;
+    if (hour >= 100)
+      SLOT_TIMES[idx][len++] = (char)('0' + hour / 100);
+    memcpy(SLOT_TIMES[idx] + len, &DIGIT_PAIRS[(hour % 100) * 2], 2);
+    SLOT_TIMES[idx][len + 2] = ':';
+    memcpy(SLOT_TIMES[idx] + len + 3, &DIGIT_PAIRS[mins * 2], 2);
+    SLOT_TIMES_LEN[idx] = (unsigned char)(len + 5);
+  }
+}
 
-  airport_node_loop(listenfd);
+/* Writes `value` in decimal to `dst`, returning the number of bytes written. */
+static size_t format_int(char *dst, int value) {
+  char digits[12], *p = digits + sizeof(digits);
+  unsigned int n = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+  size_t len;
 
-  // destroying all gate mutexes
-  for (int i = 0; i < num_gates; i++) {
-    pthread_mutex_destroy(&AIRPORT_DATA->gates[i].gate_lock);
+  while (n >= 100) {
+    p -= 2;
+    memcpy(p, &DIGIT_PAIRS[(n % 100) * 2], 2);
+    n /= 100;
+  }
+  if (n >= 10) {
+    p -= 2;
+    memcpy(p, &DIGIT_PAIRS[n * 2], 2);
+  } else {
+    *--p = (char)('0' + n);
   }
+  if (value < 0)
+    *--p = '-';
+  len = (size_t)(digits + sizeof(digits) - p);
+  memcpy(dst, p, len);
+  return len;
+}
 
-  free(AIRPORT_DATA);
+size_t format_time_status(char *dst, int airport_id, int gate_num, const time_slot_t *slots,
+                          int start, int end) {
+  char prefix[TIME_STATUS_LINE_MAX];
+  size_t prefix_len, len = 0;
+
+  pthread_once(&SLOT_TIMES_ONCE, init_slot_times);
+  memcpy(prefix, "AIRPORT ", 8);
+  prefix_len = 8 + format_int(prefix + 8, airport_id);
+  memcpy(prefix + prefix_len, " GATE ", 6);
+  prefix_len += 6;
+  prefix_len += format_int(prefix + prefix_len, gate_num);
+  prefix[prefix_len++] = ' ';
+
+  for (int idx = start; idx <= end; idx++) {
+    int assigned = slots[idx].status == 1;
+    memcpy(dst + len, prefix, prefix_len);
+    len += prefix_len;
+    memcpy(dst + len, SLOT_TIMES[idx], 6);
+    len += SLOT_TIMES_LEN[idx];
+    memcpy(dst + len, assigned ? ": A - " : ": F - ", 6);
+    len += 6;
+    len += format_int(dst + len, assigned ? slots[idx].plane_id : 0);
+    dst[len++] = '\n';
+  }
+  return len;
 }
 
-void airport_node_loop(int listenfd) {
-  int connfd;
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr;
+size_t format_export(char *dst, int gate_num, const time_slot_t *slots) {
+  char prefix[16];
+  size_t prefix_len = format_int(prefix, gate_num), len = 0;
+  int idx = 0;
 
-  while (1) {
-    clientlen = sizeof(clientaddr);
-    connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
-    if (connfd < 0) {
-      perror("accept");
+  prefix[prefix_len++] = ' ';
+  while (idx < NUM_TIME_SLOTS) {
+    const time_slot_t *ts = &slots[idx];
+    if (ts->status != 1 || ts->start_time != idx || ts->end_time < idx) {
+      idx++;
       continue;
     }
-    // Enqueuing the connection for worker threads to handle
-    enqueue(&conn_queue, connfd);
+    memcpy(dst + len, prefix, prefix_len);
+    len += prefix_len;
+    len += format_int(dst + len, idx);
+    dst[len++] = ' ';
+    len += format_int(dst + len, ts->end_time);
+    dst[len++] = ' ';
+    len += format_int(dst + len, ts->plane_id);
+    dst[len++] = '\n';
+    idx = ts->end_time + 1;
   }
+  return len;
 }
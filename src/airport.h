@@ -4,27 +4,35 @@
 #include "network_utils.h"
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef ENABLE_LOG
-#define LOG(...)                                     \
-  do {                                               \
-    fprintf(stderr, "[" __FILE__ ":%d] ", __LINE__); \
-    fprintf(stderr, __VA_ARGS__);                    \
-  } while (0)
+#include "logger.h"
 
-#else
-#define LOG(...)
-#endif
+/* Each gate schedule is broken up into `NUM_TIME_SLOTS` time slots of
+ * `SLOT_MINUTES` each, set once at startup by `set_time_slots`. The default
+ * horizon is a day of 48 half-hour slots. */
+#define DEFAULT_TIME_SLOTS 48
+#define MAX_TIME_SLOTS 2016
+extern int NUM_TIME_SLOTS;
+extern int SLOT_MINUTES;
 
-/* Each gate schedules is broken up into 48 half-hour time slots. */
-#define NUM_TIME_SLOTS 48
+/** Macros to convert an index value to hour/minutes. Hours count from the
+ *  start of the horizon, so a week-long one goes up to 167. **/
+#define IDX_TO_HOUR(idx) ((idx) * SLOT_MINUTES / 60)
+#define IDX_TO_MINS(idx) ((unsigned long)((idx) * SLOT_MINUTES % 60))
+#define HOUR_MINS_TO_IDX(hour, mins) (((hour) * 60 + (mins)) / SLOT_MINUTES)
 
-/** Macros to convert an index value to hour/minutes. **/
-#define IDX_TO_HOUR(idx) (((idx) >> 1))
-#define IDX_TO_MINS(idx) ((idx) & 1 ? 30lu : 0lu)
+/** @brief Selects the horizon of every gate schedule: 48 half-hour, 96
+ *         quarter-hour or 288 five-minute slots of a day, or 2016 five-minute
+ *         slots of a week. Each has scheduling functions compiled for its
+ *         slot count. Must be called before any airport is created.
+ *
+ *  @returns 0, or -1 if `slots` is not a supported horizon.
+ */
+int set_time_slots(int slots);
 
 /** Struct Definitions for airports and their schedules. **/
 
@@ -45,10 +53,49 @@ struct time_slot_t {
 
 typedef struct time_slot_t time_slot_t;
 
-/** This `gate_t` structure now includes a mutex for fine-grained locking. */
+/** Contention statistics of a gate, collected while lock profiling is
+ *  enabled. Bookings first try to claim slots with a compare-and-swap and only
+ *  take the gate lock after losing `OPTIMISTIC_ATTEMPTS` races, so most
+ *  contention shows up in `cas_retries` rather than in the lock's counters.
+ *  Only the thread holding the lock updates the lock's counters; the other two
+ *  are added to atomically by any thread.
+ */
+typedef struct gate_lock_stats_t {
+  uint64_t acquisitions; // Times the lock was acquired
+  uint64_t contentions;  // Acquisitions that had to wait for another thread
+  uint64_t wait_ns;      // Total time spent waiting to acquire the lock
+  uint64_t hold_ns;      // Total time the lock was held
+  uint64_t locked_at;    // When the current holder acquired it, or 0
+  uint64_t cas_retries;  // Lock-free booking attempts that lost a race
+  uint64_t fallbacks;    // Bookings that gave up on them and took the lock
+} gate_lock_stats_t;
+
+/** With fewer than 64 slots, bit `i` of a gate's occupancy word is set while
+ *  slot `i` is booked. Longer horizons keep the booked slots in the gate's
+ *  `busy` bitmap instead, and the occupancy word counts bookings. Either way
+ *  `GATE_COMMITTING` is set while a booking is being written into the slots. */
+#define GATE_COMMITTING (1ull << 63)
+#define BUSY_WORDS(slots) (((slots) + 63) / 64)
+
+/** This `gate_t` structure now includes a mutex for fine-grained locking.
+ *  The schedule itself lives in the airport's contiguous slot storage, so it
+ *  can be backed directly by a mapped schedule image.
+ *
+ *  Bookings are made without the lock: a free range is found in a snapshot
+ *  of `occupancy` and claimed by a compare-and-swap on it, so concurrent
+ *  bookings on one gate only retry when they actually collide. The lock only
+ *  serialises writers that kept colliding. With a `busy` bitmap the word is
+ *  a count of bookings instead, and a booking retries if any other was made
+ *  on the gate meanwhile. Bookings are never removed, so the word changes
+ *  with every booking and also acts as a sequence lock for readers of the
+ *  slots; see `gate_read_begin`.
+ */
 struct gate_t {
   pthread_mutex_t gate_lock;         
-  time_slot_t time_slots[NUM_TIME_SLOTS];
+  time_slot_t *time_slots;  // NUM_TIME_SLOTS entries of `airport_t.slots`
+  uint64_t occupancy;       // Booked slots or bookings, plus `GATE_COMMITTING`
+  uint64_t *busy;           // Booked slots of horizons of 64 slots or more
+  gate_lock_stats_t lock_stats;
 };
 
 typedef struct gate_t gate_t;
@@ -59,6 +106,9 @@ typedef struct gate_t gate_t;
  */
 struct airport_t {
   int num_gates;          // Number of gates in this airport
+  time_slot_t *slots;     // Schedules of every gate, `NUM_TIME_SLOTS` each
+  int slots_mapped;       // 1 if `slots` points into a mapped image
+  uint64_t *busy;         // Bitmaps of every gate, if the horizon needs them
   gate_t gates[];         // Array of each gate.
 };
 
@@ -87,8 +137,25 @@ struct time_info_t {
  */
 airport_t *create_airport(int num_gates);
 
-/** @brief This function is called after forking a child process to instantiate
- *         and run an individual airport node.
+/** @brief Sets the airport that the functions below operate on. */
+void use_airport(airport_t *airport);
+
+/** @brief Returns the airport set by `use_airport`. */
+airport_t *get_airport(void);
+
+/** @brief Makes every gate of `airport` use the schedules stored contiguously
+ *         in `slots` (`num_gates * NUM_TIME_SLOTS` entries), such as those of
+ *         a mapped schedule image. Slot storage allocated by `create_airport`
+ *         is released.
+ */
+void attach_airport_slots(airport_t *airport, time_slot_t *slots, int mapped);
+
+/** @brief Recomputes the occupancy of every gate of `airport` from its
+ *         slots. Must be called after writing to the slots directly. */
+void rebuild_occupancy(airport_t *airport);
+
+/** @brief This function is called by `airport_server`, in a process of its
+ *         own, to instantiate and run an individual airport node.
  *
  *  @param airport_id The identifier of this airport node.
  *  @param num_gates  The number of gates associated with this airport
@@ -100,8 +167,99 @@ airport_t *create_airport(int num_gates);
  */
 void initialise_node(int airport_id, int num_gates, int listenfd);
 
+/** @brief Makes the node started next by `initialise_node` serve shard
+ *         `shard` of its airport, whose first gate is gate `gate_base` of the
+ *         whole airport. Gate numbers in requests and responses are those of
+ *         the whole airport, and the node persists to files of its own.
+ */
+void set_node_shard(int shard, int gate_base);
+
+/** @brief Makes the node started next by `initialise_node` accept on
+ *         `groups` listening sockets sharing its port, each with its own
+ *         queue and share of the workers, so connections are spread across
+ *         them by the kernel without a shared accept. Its `listenfd` must be
+ *         opened with `open_listenfd_reuseport` when `groups` is over 1.
+ */
+void set_node_accept_groups(int groups);
+
+/* Fuel at or below which a SCHEDULE is an emergency, dispatched ahead of
+ * every other request */
+#define LOW_FUEL 2
+
+/** Priority lanes requests are queued in, most urgent first. */
+typedef enum request_lane_t {
+  LANE_URGENT, /* SCHEDULE of a plane with `LOW_FUEL` or less */
+  LANE_NORMAL, /* other SCHEDULEs, PLANE_STATUS and the rest */
+  LANE_BULK,   /* TIME_STATUS and EXPORT scans */
+  NUM_LANES
+} request_lane_t;
+
+/* Dispatches from a more urgent lane after which a waiting, less urgent one
+ * is served anyway, so TIME_STATUS scans are delayed but never starved */
+#define LANE_PASS_LIMIT 8
+
+/** @brief Returns the lane of the request line `line`, which may carry the
+ *         `#<id> ` trace prefix the controller adds. */
+request_lane_t request_lane(const char *line);
+
 /** The following functions all require the airport to be instantiated  */
 
+/** @brief Acquires the lock of `gate`, recording the time spent waiting in
+ *         the metrics if it was held by another thread. */
+void lock_gate(gate_t *gate);
+
+/** @brief Releases the lock of `gate` acquired with `lock_gate`. */
+void unlock_gate(gate_t *gate);
+
+/** @brief Turns collection of per-gate lock statistics on or off. Enabling it
+ *         clears any statistics collected previously. While disabled,
+ *         `lock_gate` and `unlock_gate` only pay for checking this flag.
+ */
+void set_lock_profiling(int enabled);
+
+/** @brief Returns 1 if per-gate lock statistics are being collected. */
+int lock_profiling_enabled(void);
+
+/** @brief   Finds the most contended gates, ordered by the number of lock
+ *           contentions and lost booking races, then by total wait time.
+ *
+ *  @param gate_idxs Array receiving the indices of up to `max` gates.
+ *
+ *  @returns The number of gates stored, which excludes gates that were never
+ *           contended and never lost a race.
+ */
+int top_contended_gates(int *gate_idxs, int max);
+
+/** @brief   Starts reading the slots of `gate` without its lock, waiting out
+ *           any booking that is half written. Reads must be repeated for as
+ *           long as `gate_read_retry` says so:
+ *
+ *               do {
+ *                 seq = gate_read_begin(gate);
+ *                 ... read gate->time_slots ...
+ *               } while (gate_read_retry(gate, seq));
+ *
+ *  @returns The value to pass to `gate_read_retry`.
+ */
+uint64_t gate_read_begin(gate_t *gate);
+
+/** @brief Returns 1 if `gate` was booked since `gate_read_begin` returned
+ *         `seq`, so what was read may be inconsistent. */
+int gate_read_retry(gate_t *gate, uint64_t seq);
+
+/* Copies `snapshot_airport` makes while bookings land before holding them off */
+#define SNAPSHOT_ATTEMPTS 8
+
+/** @brief   Copies the slots of every gate of this airport into `dst`, laid
+ *           out as `airport_t.slots`, as they all were at one point in time.
+ *           Bookings are not held off: the copy is retried if any landed
+ *           while it was made. Only after `SNAPSHOT_ATTEMPTS` such copies
+ *           are bookings paused, for as long as one more copy takes.
+ *
+ *  @returns 0, or -1 if memory could not be allocated.
+ */
+int snapshot_airport(time_slot_t *dst);
+
 /** @brief Returns a pointer to the `gate_idx`th gate schedule of the "global"
  *         airport struct. Returns `NULL` if `gate_idx` out of range.
  */
@@ -136,11 +294,24 @@ int set_time_slot(time_slot_t *ts, int plane_id, int start_idx, int end_idx);
  *           slots was successful, but the `n+1`th was already occupied, this
  *           function will return -1 to indicate an error, but any successfully
  *           updated time slots will remain modified. It is a good idea to call
- *           `check_time_slots_free` prior to calling this function.
+ *           `check_time_slots_free` prior to calling this function. Unlike
+ *           `assign_in_gate`, this does not guard against concurrent bookings.
  */
 int add_plane_to_slots(gate_t *gate, int plane_id, int start, int count);
 
+/** @brief   Restores a booking of `plane_id` over slots `[start]..[end]`
+ *           (inclusive) of `gate`, as recorded by a previous successful
+ *           `assign_in_gate`. Slots already holding this booking are left
+ *           untouched, so restoring the same booking twice is harmless.
+ *
+ *  @returns `0` if the booking is present in the gate afterwards, `-1` if the
+ *           range is invalid or any slot is held by a different booking (in
+ *           which case the gate is not modified).
+ */
+int restore_plane_in_gate(gate_t *gate, int plane_id, int start, int end);
+
 /** @brief   Searches the given `gate` for a time slot assigned to `plane_id`.
+ *           The caller must make the read consistent, see `gate_read_begin`.
  *
  *  @returns The index in the gate schedule at which the given `plane_id` first
  *           appears, or -1 if the plane is not scheduled in this gate.
@@ -180,11 +351,79 @@ time_info_t lookup_plane_in_airport(int plane_id);
  *
  *           - `assigned + start <= fuel`
  *
+ *           Safe to call concurrently on the same gate without its lock.
+ *
  *  @returns The starting time index this plane was assigned to, or -1 if the
  *           plane could not be assigned any slot in this gate.
  */
 int assign_in_gate(gate_t *gate, int plane_id, int start, int duration, int fuel);
 
+/** @brief   Schedules a flight in the first gate (lowest index) of the
+ *           airport that can accommodate it, as described by
+ *           `assign_in_gate`. The booking is recorded in the write-ahead log
+ *           when persistence is enabled.
+ *
+ *  @returns A `time_info_t` with the gate, start and end time assigned, or
+ *           each value set to `-1` if no gate could fit the flight.
+ */
+time_info_t schedule_plane(int plane_id, int start, int duration, int fuel);
+
+/** @brief   Finds where `schedule_plane` would place a flight right now,
+ *           without booking it.
+ *
+ *  @returns A `time_info_t` as returned by `schedule_plane`.
+ */
+time_info_t find_plane_slot(int start, int duration, int fuel);
+
+/** @brief   Places a flight in `airport` exactly where `schedule_plane`
+ *           would, but with plain loads and stores and without logging it.
+ *           Only for filling an airport no other thread can see yet.
+ *
+ *  @returns A `time_info_t` as returned by `schedule_plane`.
+ */
+time_info_t import_plane(airport_t *airport, int plane_id, int start, int duration,
+                         int fuel);
+
+/** @brief   Books `plane_id` over slots `[start]..[end]` (inclusive) of gate
+ *           `gate_idx`, exactly where another node booked it, to keep a
+ *           replica in step with its primary. The booking is recorded in the
+ *           write-ahead log when persistence is enabled.
+ *
+ *  @returns `0` if the booking is in the gate afterwards, including if it
+ *           already was, or `-1` if the range is invalid or taken by another
+ *           booking.
+ */
+int apply_booking(int plane_id, int gate_idx, int start, int end);
+
+/* Longest line written by `format_time_status` */
+#define TIME_STATUS_LINE_MAX 64
+
+/** @brief Writes the TIME_STATUS response lines of `slots[start]..[end]`
+ *         of gate `gate_num` of airport `airport_id` to `dst`, each as
+ *         `AIRPORT <id> GATE <gate> HH:MM: <A|F> - <plane>`. The constant
+ *         prefix is formatted once, slot times come from a table and plane
+ *         ids are converted without `sprintf`.
+ *
+ *  @param dst Room for `end - start + 1` lines of `TIME_STATUS_LINE_MAX`.
+ *
+ *  @returns The number of bytes written, with no terminating NUL.
+ */
+size_t format_time_status(char *dst, int airport_id, int gate_num, const time_slot_t *slots,
+                          int start, int end);
+
+/* Longest line written by `format_export` */
+#define EXPORT_LINE_MAX 48
+
+/** @brief Writes an EXPORT line `<gate> <start> <end> <plane>` to `dst` for
+ *         each booking in `slots`, the `NUM_TIME_SLOTS` slots of gate
+ *         `gate_num`, with times as slot indexes.
+ *
+ *  @param dst Room for `NUM_TIME_SLOTS` lines of `EXPORT_LINE_MAX`.
+ *
+ *  @returns The number of bytes written, with no terminating NUL.
+ */
+size_t format_export(char *dst, int gate_num, const time_slot_t *slots);
+
 /** @brief  The main server loop for an individual airport node.
  *
  *  @todo  Implement this function!
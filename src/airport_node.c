@@ -0,0 +1,788 @@
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "airport.h"
+#include "arena.h"
+#include "broadcast.h"
+#include "import.h"
+#include "metrics.h"
+#include "trace.h"
+#include "uring_server.h"
+#include "persist.h"
+
+/** This is the main file of the airport server code: the connection queue,
+ *  worker threads parsing requests, and the node's accept loop. Requests are
+ *  served using the scheduling functions of `airport.c`; read the comments in
+ *  the corresponding `airport.h` header file to understand what each function
+ *  does, the arguments they accept and how they are intended to be used.
+ */
+
+/* This will be set by the `initialise_node` function. */
+static int AIRPORT_ID = -1;
+
+/* This will be set by the `initialise_node` function. */
+static airport_t *AIRPORT_DATA = NULL;
+
+/* Set by `set_node_shard` if this node serves one shard of its airport. The
+ * node's gates are numbered from `GATE_BASE` in requests and responses. */
+static int SHARD = -1;
+static int GATE_BASE = 0;
+
+/* thread pool def'ns */
+#define THREAD_POOL_SIZE 4
+#define QUEUE_SIZE 100
+
+/* Set by `set_node_accept_groups`: the number of listening sockets sharing
+ * the node's port, each with its own accept loop, queue and workers. */
+#define MAX_ACCEPT_GROUPS THREAD_POOL_SIZE
+static int ACCEPT_GROUPS = 1;
+
+/* Longest a connection may wait for its first request before it is accepted
+ * anyway, into the normal lane */
+#define DEFER_ACCEPT_SECS 1
+
+/* Gates listed by LOCKSTATS when no count is given */
+#define LOCKSTATS_DEFAULT_TOP 10
+
+/* Schedule changes read from the broadcast ring per write to a subscriber */
+#define SUBSCRIBE_BATCH 64
+
+// Data structure for connec'n queue and initialisation: one ring per lane,
+// holding up to QUEUE_SIZE connections between them
+typedef struct conn_queue_t {
+    int connections[NUM_LANES][QUEUE_SIZE];
+    uint64_t enqueued_at[NUM_LANES][QUEUE_SIZE]; // when each connection was queued
+    int front[NUM_LANES];
+    int lane_count[NUM_LANES];
+    int count;
+    int passed_over; // dispatches made while a less urgent lane waited
+    int high_water;  // largest count seen, for metrics
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+} conn_queue_t;
+
+static conn_queue_t conn_queues[MAX_ACCEPT_GROUPS];
+
+/* Gauges reporting the connection queues' depth in metrics */
+static long conn_queue_depth(void) {
+    long depth = 0;
+    for (int i = 0; i < ACCEPT_GROUPS; i++)
+        depth += __atomic_load_n(&conn_queues[i].count, __ATOMIC_RELAXED);
+    return depth;
+}
+
+static long conn_queue_high_water(void) {
+    long high_water = 0;
+    for (int i = 0; i < ACCEPT_GROUPS; i++) {
+        long group = __atomic_load_n(&conn_queues[i].high_water, __ATOMIC_RELAXED);
+        if (group > high_water)
+            high_water = group;
+    }
+    return high_water;
+}
+
+void init_queue(conn_queue_t *q) {
+    for (int lane = 0; lane < NUM_LANES; lane++)
+        q->front[lane] = q->lane_count[lane] = 0;
+    q->count = 0;
+    q->passed_over = 0;
+    q->high_water = 0;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+}
+
+/* Enqueue a connection in `lane`, returning -1 without queueing it if the
+ * queue is full */
+int enqueue(conn_queue_t *q, int connfd, request_lane_t lane) {
+    pthread_mutex_lock(&q->mutex);
+    if (q->count == QUEUE_SIZE) {
+        pthread_mutex_unlock(&q->mutex);
+        return -1;
+    }
+    int rear = (q->front[lane] + q->lane_count[lane]) % QUEUE_SIZE;
+    q->connections[lane][rear] = connfd;
+    q->enqueued_at[lane][rear] = metrics_now_ns();
+    q->lane_count[lane]++;
+    q->count++;
+    if (q->count > q->high_water)
+        q->high_water = q->count;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+/* Dequeue a connection from the most urgent lane, storing when it was
+ * queued in `enqueued_at` */
+int dequeue(conn_queue_t *q, uint64_t *enqueued_at) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+    int lane = 0, last = NUM_LANES - 1;
+    while (q->lane_count[lane] == 0)
+        lane++;
+    while (q->lane_count[last] == 0)
+        last--;
+    if (lane == last) {
+        q->passed_over = 0;
+    } else if (++q->passed_over > LANE_PASS_LIMIT) {
+        lane = last;
+        q->passed_over = 0;
+    }
+    int connfd = q->connections[lane][q->front[lane]];
+    *enqueued_at = q->enqueued_at[lane][q->front[lane]];
+    q->front[lane] = (q->front[lane] + 1) % QUEUE_SIZE;
+    q->lane_count[lane]--;
+    q->count--;
+    pthread_mutex_unlock(&q->mutex);
+    return connfd;
+}
+
+/* Parses a single request line and writes its response to `out`. The
+ * last line written is left in `response`, so the caller can tell whether
+ * the request failed. Returns the kind of request for metrics. */
+static metric_cmd_t handle_request(wbuf_t *out, char *buf, char *response) {
+    metric_cmd_t cmd = METRIC_OTHER;
+
+    // Parsing logic
+    char request_type[MAXLINE];
+    int airport_num;
+    char rest_of_request[MAXLINE];
+
+    rest_of_request[0] = 0; // empty unless given; the rest need not be cleared
+    int num_parsed = sscanf(buf, "%s %d %[^\n]", request_type, &airport_num, rest_of_request);
+    if (num_parsed >= 1)
+        cmd = metrics_command(request_type);
+
+    // SUBSCRIBE is taken over by worker_thread, which the io_uring backend lacks
+    if (num_parsed >= 1 && strcmp(request_type, "SUBSCRIBE") == 0) {
+        sprintf(response, "Error: SUBSCRIBE is not supported with -u\n");
+        wbuf_write(out, response, strlen(response));
+        return cmd;
+    }
+
+    // TRACE command: this node's trace spans, terminated by an END line. The
+    // controller sends it without an airport when gathering every node's.
+    if (num_parsed >= 1 && strcmp(request_type, "TRACE") == 0 &&
+        (num_parsed == 1 || airport_num == AIRPORT_ID)) {
+        size_t len;
+        char *events = trace_format_events(&len);
+        if (events != NULL) {
+            wbuf_write(out, events, len);
+            free(events);
+        }
+        sprintf(response, "END\n");
+        wbuf_write(out, response, strlen(response));
+        return cmd;
+    }
+
+    // Initial validation: queries without command and airport_num are pre-invalidated.
+    if (num_parsed < 2) {
+        sprintf(response, "Error: Invalid request provided\n");
+        wbuf_write(out, response, strlen(response));
+        return cmd;
+    }
+
+    // Valid airport_num error handling
+    if (airport_num != AIRPORT_ID) {
+        sprintf(response, "Error: Airport %d does not exist\n", airport_num);
+        wbuf_write(out, response, strlen(response));
+        return cmd;
+    }
+
+    // STATS command: this node's metrics, terminated by an END line
+    if (strcmp(request_type, "STATS") == 0) {
+        size_t len;
+        char *stats = metrics_format(&len);
+        if (stats != NULL) {
+            wbuf_write(out, stats, len);
+            free(stats);
+        }
+        sprintf(response, "END\n");
+        wbuf_write(out, response, strlen(response));
+        return cmd;
+    }
+
+    // LOGLEVEL command: shows or sets this node's log level
+    if (strcmp(request_type, "LOGLEVEL") == 0) {
+        int level = log_level();
+        if (rest_of_request[0] && (level = log_parse_level(rest_of_request)) < 0) {
+            sprintf(response, "Error: Invalid request provided\n");
+        } else {
+            log_set_level((log_level_t)level);
+            sprintf(response, "LOG LEVEL %s\n", log_level_name((log_level_t)level));
+        }
+        wbuf_write(out, response, strlen(response));
+        return cmd;
+    }
+
+    // EXPORT command: every booking of this node's gates as of one point in
+    // time, a line each, terminated by an END line
+    if (strcmp(request_type, "EXPORT") == 0) {
+        size_t gate_slots = (size_t)NUM_TIME_SLOTS;
+        time_slot_t *slots =
+            arena_alloc(sizeof(time_slot_t) * gate_slots * (size_t)AIRPORT_DATA->num_gates);
+        char *lines = arena_alloc(EXPORT_LINE_MAX * gate_slots);
+        if (slots == NULL || lines == NULL || snapshot_airport(slots) < 0) {
+            sprintf(response, "Error: Cannot export airport %d\n", AIRPORT_ID);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        sprintf(response, "# EXPORT %d SLOTS %d SLOT_MINUTES %d: gate start end plane\n",
+                AIRPORT_ID, NUM_TIME_SLOTS, SLOT_MINUTES);
+        wbuf_write(out, response, strlen(response));
+        for (int gate_idx = 0; gate_idx < AIRPORT_DATA->num_gates; gate_idx++)
+            wbuf_write(out, lines,
+                       format_export(lines, gate_idx + GATE_BASE,
+                                     &slots[(size_t)gate_idx * gate_slots]));
+        sprintf(response, "END\n");
+        wbuf_write(out, response, strlen(response));
+        return cmd;
+    }
+
+    // LOCKSTATS command: toggles lock profiling, or lists the N most
+    // contended gates, terminated by an END line
+    if (strcmp(request_type, "LOCKSTATS") == 0) {
+        int top_n = LOCKSTATS_DEFAULT_TOP;
+        if (strcmp(rest_of_request, "ON") == 0 || strcmp(rest_of_request, "OFF") == 0) {
+            set_lock_profiling(rest_of_request[1] == 'N');
+            sprintf(response, "LOCK PROFILING %s\n", rest_of_request);
+            wbuf_write(out, response, strlen(response));
+        } else if ((rest_of_request[0] && (sscanf(rest_of_request, "%d", &top_n) != 1 || top_n < 1))) {
+            sprintf(response, "Error: Invalid request provided\n");
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        } else if (!lock_profiling_enabled()) {
+            sprintf(response, "Error: Lock profiling is disabled\n");
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        } else {
+            int *gate_idxs = arena_alloc(sizeof(int) * (unsigned)top_n);
+            int count = gate_idxs ? top_contended_gates(gate_idxs, top_n) : 0;
+            for (int i = 0; i < count; i++) {
+                gate_lock_stats_t *stats = &get_gate_by_idx(gate_idxs[i])->lock_stats;
+                sprintf(response, "GATE %d ACQUIRED %lu CONTENDED %lu WAIT_US %lu HOLD_US %lu "
+                        "CAS_RETRIES %lu FALLBACKS %lu\n",
+                        gate_idxs[i] + GATE_BASE,
+                        (unsigned long)__atomic_load_n(&stats->acquisitions, __ATOMIC_RELAXED),
+                        (unsigned long)__atomic_load_n(&stats->contentions, __ATOMIC_RELAXED),
+                        (unsigned long)__atomic_load_n(&stats->wait_ns, __ATOMIC_RELAXED) / 1000,
+                        (unsigned long)__atomic_load_n(&stats->hold_ns, __ATOMIC_RELAXED) / 1000,
+                        (unsigned long)__atomic_load_n(&stats->cas_retries, __ATOMIC_RELAXED),
+                        (unsigned long)__atomic_load_n(&stats->fallbacks, __ATOMIC_RELAXED));
+                wbuf_write(out, response, strlen(response));
+            }
+        }
+        sprintf(response, "END\n");
+        wbuf_write(out, response, strlen(response));
+        return cmd;
+    }
+
+    //SCHEDULE command error handling; PROBE only says where SCHEDULE would go
+    if (strcmp(request_type, "SCHEDULE") == 0 || strcmp(request_type, "PROBE") == 0) {
+        int probe = request_type[0] == 'P';
+        int plane_id, earliest_time, duration, fuel;
+        //not enough arguments 
+        if (sscanf(rest_of_request, "%d %d %d %d", &plane_id, &earliest_time, &duration, &fuel) != 4) {
+            sprintf(response, "Error: Invalid request provided\n");
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        // Invalid earliest time error
+        if (earliest_time < 0 || earliest_time >= NUM_TIME_SLOTS) {
+            sprintf(response, "Error: Invalid 'earliest' time (%d)\n", earliest_time);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        // Invalid duration errors - 2
+        if (duration < 0) {
+            sprintf(response, "Error: Invalid 'duration' value (%d)\n", duration);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        if (earliest_time + duration > NUM_TIME_SLOTS) {
+            sprintf(response, "Error: Invalid 'duration' value (%d)\n", duration);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+
+        // Schedule the plane
+        time_info_t result = probe ? find_plane_slot(earliest_time, duration, fuel)
+                                   : schedule_plane(plane_id, earliest_time, duration, fuel);
+
+        //Successful SCHEDULED command response
+        if (result.gate_number >= 0) {
+            int start_time = result.start_time;
+            int end_time = result.end_time;
+            int gate_num = result.gate_number + GATE_BASE;
+
+            // telling subscribers, if there are any
+            if (!probe)
+                broadcast_publish(AIRPORT_ID, plane_id, gate_num, start_time, end_time);
+
+            // time to string conversion code as given in assignment spec
+            int start_hour = IDX_TO_HOUR(start_time);
+            int start_mins = (int)IDX_TO_MINS(start_time);
+            int end_hour = IDX_TO_HOUR(end_time);
+            int end_mins = (int)IDX_TO_MINS(end_time);
+
+            sprintf(response, "%s %d at GATE %d: %02d:%02d-%02d:%02d\n",
+                    probe ? "FITS" : "SCHEDULED", plane_id, gate_num,
+                    start_hour, start_mins,
+                    end_hour, end_mins);
+        } else {
+          //Unsuccessful error
+            sprintf(response, "Error: Cannot schedule %d\n", plane_id);
+        }
+        wbuf_write(out, response, strlen(response));
+
+    } //APPLY command: a booking made by the primary this replica follows
+    else if (strcmp(request_type, "APPLY") == 0) {
+        int plane_id, gate_num, start_time, end_time;
+        if (sscanf(rest_of_request, "%d %d %d %d", &plane_id, &gate_num, &start_time,
+                   &end_time) != 4) {
+            sprintf(response, "Error: Invalid request provided\n");
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        if (apply_booking(plane_id, gate_num - GATE_BASE, start_time, end_time) < 0) {
+            sprintf(response, "Error: Cannot apply %d\n", plane_id);
+        } else {
+            broadcast_publish(AIRPORT_ID, plane_id, gate_num, start_time, end_time);
+            sprintf(response, "APPLIED %d at GATE %d: %02d:%02d-%02d:%02d\n", plane_id,
+                    gate_num, IDX_TO_HOUR(start_time), (int)IDX_TO_MINS(start_time),
+                    IDX_TO_HOUR(end_time), (int)IDX_TO_MINS(end_time));
+        }
+        wbuf_write(out, response, strlen(response));
+
+    } //PLANE_STATUS command validation
+    else if (strcmp(request_type, "PLANE_STATUS") == 0) {
+        int plane_id;
+        //not enough arguments 
+        if (sscanf(rest_of_request, "%d", &plane_id) != 1) {
+            sprintf(response, "Error: Invalid request provided\n");
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        //plane lookup
+        time_info_t result = lookup_plane_in_airport(plane_id);
+
+        //plane found
+        if (result.gate_number >= 0) {
+            int start_time = result.start_time;
+            int end_time = result.end_time;
+            int gate_num = result.gate_number + GATE_BASE;
+
+            // time to string conversion code as given in assignment spec
+            int start_hour = IDX_TO_HOUR(start_time);
+            int start_mins = (int)IDX_TO_MINS(start_time);
+            int end_hour = IDX_TO_HOUR(end_time);
+            int end_mins = (int)IDX_TO_MINS(end_time);
+
+            sprintf(response, "PLANE %d scheduled at GATE %d: %02d:%02d-%02d:%02d\n",
+                    plane_id, gate_num,
+                    start_hour, start_mins,
+                    end_hour, end_mins);
+        } else {
+          //plane not found
+            sprintf(response, "PLANE %d not scheduled at airport %d\n", plane_id, AIRPORT_ID);
+        }
+        wbuf_write(out, response, strlen(response));
+
+    } //TIME_STATUS command handling 
+    else if (strcmp(request_type, "TIME_STATUS") == 0) {
+        int gate_num, start_idx, duration;
+        //not enough arguments 
+        if (sscanf(rest_of_request, "%d %d %d", &gate_num, &start_idx, &duration) != 3) {
+            sprintf(response, "Error: Invalid request provided\n");
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+
+        // Invalid gate_num error
+        if (gate_num < GATE_BASE || gate_num >= GATE_BASE + AIRPORT_DATA->num_gates) {
+            sprintf(response, "Error: Invalid 'gate' value (%d)\n", gate_num);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        // Invalid start_idx error
+        if (start_idx < 0 || start_idx >= NUM_TIME_SLOTS) {
+            sprintf(response, "Error: Invalid 'start' time (%d)\n", start_idx);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        // Invalid duration errors - 2
+        if (duration < 0) {
+            sprintf(response, "Error: Invalid 'duration' value (%d)\n", duration);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        if (start_idx + duration >= NUM_TIME_SLOTS) {
+            sprintf(response, "Error: Invalid 'duration' value (%d)\n", duration);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+
+        //get gate
+        gate_t *gate = get_gate_by_idx(gate_num - GATE_BASE);
+        if (gate == NULL) {
+          //wrong gate error
+            sprintf(response, "Error: Invalid 'gate' value (%d)\n", gate_num);
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+
+        int end_idx = start_idx + duration;
+
+        // Copy the range without the gate lock, retrying if it was booked meanwhile
+        time_slot_t slots[NUM_TIME_SLOTS];
+        uint64_t seq;
+        do {
+            seq = gate_read_begin(gate);
+            memcpy(&slots[start_idx], get_time_slot_by_idx(gate, start_idx),
+                   sizeof(time_slot_t) * (size_t)(end_idx - start_idx + 1));
+        } while (gate_read_retry(gate, seq));
+
+        // formatting every line into one buffer, written out at once
+        char *lines = arena_alloc((size_t)(duration + 1) * TIME_STATUS_LINE_MAX);
+        if (lines == NULL) {
+            sprintf(response, "Error: Out of memory\n");
+            wbuf_write(out, response, strlen(response));
+            return cmd;
+        }
+        size_t len = format_time_status(lines, AIRPORT_ID, gate_num, slots, start_idx, end_idx);
+        wbuf_write(out, lines, len);
+
+        // keeping the last line as the response, for the log and metrics
+        size_t last = len - 1;
+        while (last > 0 && lines[last - 1] != '\n')
+            last--;
+        memcpy(response, lines + last, len - last);
+        response[len - last] = 0;
+
+    } else {
+        sprintf(response, "Error: Invalid request provided\n");
+        wbuf_write(out, response, strlen(response));
+    }
+    return cmd;
+}
+
+/* Serves one request line of `n` bytes read from a connection, buffering its
+ * response in `out`. `enqueued_at` and `dequeued_at` are when the request
+ * waited for a worker, or 0 if it did not. The connection's id is unused. */
+static void serve_line(char *buf, ssize_t n, wbuf_t *out, uint64_t enqueued_at,
+                       uint64_t dequeued_at, uint64_t conn_id) {
+    char response[MAXLINE];
+    uint64_t begin = metrics_now_ns();
+    char *request = buf;
+    uint64_t request_id = 0;
+
+    // a traced request is prefixed with "#<id> " by the controller
+    if (buf[0] == '#') {
+        request_id = strtoull(buf + 1, &request, 10);
+        while (*request == ' ')
+            request++;
+    }
+    trace_set_request(request_id);
+    log_set_request_id(request_id);
+    if (enqueued_at) {
+        // the connection's queueing is attributed to its first request
+        trace_span("airport_queue", enqueued_at, dequeued_at);
+    }
+
+    LOG("request %s", request);
+    response[0] = 0;
+    metric_cmd_t cmd = handle_request(out, request, response);
+    uint64_t end = metrics_now_ns();
+    metrics_record_request(cmd, AIRPORT_ID, strncmp(response, "Error:", 6) == 0,
+                           end - begin);
+    trace_span("airport_request", begin, end);
+    LOG("response %.*s (%lu us)", (int)strcspn(response, "\n"), response,
+        (unsigned long)((end - begin) / 1000));
+    arena_reset();
+}
+
+/* Streams this node's schedule changes to the subscriber on `arg`, a
+ * connection descriptor, until it disconnects. Each change is sent as
+ * `EVENT <seq> <plane> <gate> <start> <end>` with slot indices, and changes
+ * the subscriber fell too far behind to receive as `LOST <count>`. */
+static void *subscription_thread(void *arg) {
+    int connfd = (int)(intptr_t)arg;
+    int wakefd = broadcast_listen();
+    schedule_event_t events[SUBSCRIBE_BATCH];
+    uint64_t cursor = broadcast_head(), lost;
+    char line[MAXLINE];
+    wbuf_t out;
+    int count, len;
+
+    wbuf_init(&out, connfd);
+    len = sprintf(line, wakefd < 0 ? "Error: Too many subscribers\n" : "SUBSCRIBED\n");
+    wbuf_write(&out, line, (size_t)len);
+    while (wakefd >= 0 && wbuf_flush(&out) >= 0) {
+        struct pollfd fds[2] = {{.fd = connfd, .events = POLLIN},
+                                {.fd = wakefd, .events = POLLIN}};
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        // anything from the subscriber, including its close, ends the stream
+        if (fds[0].revents)
+            break;
+        broadcast_ack(wakefd);
+        do {
+            count = broadcast_read(&cursor, events, SUBSCRIBE_BATCH, &lost);
+            if (lost > 0) {
+                len = sprintf(line, "LOST %lu\n", (unsigned long)lost);
+                wbuf_write(&out, line, (size_t)len);
+            }
+            for (int i = 0; i < count; i++) {
+                len = sprintf(line, "EVENT %lu %d %d %d %d\n", (unsigned long)events[i].seq,
+                              events[i].plane_id, events[i].gate, events[i].start,
+                              events[i].end);
+                wbuf_write(&out, line, (size_t)len);
+            }
+        } while (count == SUBSCRIBE_BATCH);
+    }
+    if (wakefd >= 0)
+        broadcast_unlisten(wakefd);
+    wbuf_flush(&out);
+    wbuf_free(&out);
+    close(connfd);
+    return NULL;
+}
+
+request_lane_t request_lane(const char *line) {
+    char request_type[16];
+    const char *space;
+    int airport_num, plane_id, earliest_time, duration, fuel;
+    // skipping the "#<id> " prefix of a traced request
+    if (line[0] == '#' && (space = strchr(line, ' ')) != NULL)
+        line = space;
+    if (sscanf(line, "%15s", request_type) != 1)
+        return LANE_NORMAL;
+    if (strcmp(request_type, "TIME_STATUS") == 0 || strcmp(request_type, "EXPORT") == 0)
+        return LANE_BULK;
+    // a sharded SCHEDULE PROBEs each shard first, with the same arguments
+    if ((strcmp(request_type, "SCHEDULE") == 0 || strcmp(request_type, "PROBE") == 0) &&
+        sscanf(line, "%*s %d %d %d %d %d", &airport_num, &plane_id, &earliest_time,
+               &duration, &fuel) == 5 &&
+        fuel <= LOW_FUEL)
+        return LANE_URGENT;
+    return LANE_NORMAL;
+}
+
+/* Worker thread function intended to handle client requests, taking
+ * connections from the queue `arg` */
+void *worker_thread(void *arg) {
+    conn_queue_t *queue = arg;
+    // the output buffer is kept from one connection to the next
+    wbuf_t out;
+    wbuf_init(&out, -1);
+    while (1) {
+        uint64_t enqueued_at;
+        int connfd = dequeue(queue, &enqueued_at);
+        uint64_t dequeued_at = metrics_now_ns();
+        // Handle the connection
+        rio_t rio_client;
+        char buf[MAXLINE];
+
+        rio_readinitb(&rio_client, connfd);//rio initialisation
+        out.wb_fd = connfd;
+
+        while (1) {
+            ssize_t n = rio_readlineb(&rio_client, buf, MAXLINE); //reading a line
+            if (n <= 0) {
+                break; // No input
+            }
+            // a subscription holds its connection open, so it gets its own thread
+            if (broadcast_is_subscribe(buf)) {
+                pthread_t subscriber;
+                if (pthread_create(&subscriber, NULL, subscription_thread,
+                                   (void *)(intptr_t)connfd) == 0) {
+                    pthread_detach(subscriber);
+                    connfd = -1;
+                }
+                break;
+            }
+            serve_line(buf, n, &out, enqueued_at, dequeued_at, 0);
+            enqueued_at = 0;
+            // sending the whole response with one write
+            wbuf_flush(&out);
+        }
+        out.wb_len = 0;
+        if (connfd >= 0)
+            close(connfd);
+    }
+    return NULL;
+}
+
+void set_node_accept_groups(int groups) {
+  ACCEPT_GROUPS = groups < 1 ? 1 : groups > MAX_ACCEPT_GROUPS ? MAX_ACCEPT_GROUPS : groups;
+}
+
+void set_node_shard(int shard, int gate_base) {
+  SHARD = shard;
+  GATE_BASE = gate_base;
+}
+
+void initialise_node(int airport_id, int num_gates, int listenfd) {
+  AIRPORT_ID = airport_id;
+
+  // starting this node's own log drain thread
+  char role[32];
+  if (SHARD < 0)
+    snprintf(role, sizeof(role), "airport-%d", airport_id);
+  else
+    snprintf(role, sizeof(role), "airport-%d-shard-%d", airport_id, SHARD);
+  log_init(role);
+  trace_init(role);
+  AIRPORT_DATA = create_airport(num_gates);
+  if (AIRPORT_DATA == NULL)
+    exit(1);
+  use_airport(AIRPORT_DATA);
+
+  // recovering bookings from the write-ahead log, if persistence is enabled
+  if (persist_enabled() && persist_open(airport_id, SHARD, AIRPORT_DATA) < 0)
+    exit(1);
+
+  // seeding an empty schedule from the import file, before serving anything
+  if (import_enabled() && import_flights(airport_id, GATE_BASE, AIRPORT_DATA) < 0)
+    exit(1);
+
+  // initialising the connection queues
+  for (int i = 0; i < MAX_ACCEPT_GROUPS; i++)
+    init_queue(&conn_queues[i]);
+
+  // initialising metrics, labelled with this airport's id and any shard
+  char labels[64];
+  if (SHARD < 0)
+    snprintf(labels, sizeof(labels), "role=\"airport\",airport=\"%d\"", airport_id);
+  else
+    snprintf(labels, sizeof(labels), "role=\"airport\",airport=\"%d\",shard=\"%d\"",
+             airport_id, SHARD);
+  metrics_init(labels, 0);
+  metrics_register_gauge("conn_queue_depth", "Connections waiting for a worker.",
+                         conn_queue_depth);
+  metrics_register_gauge("conn_queue_high_water",
+                         "Largest number of connections ever queued.",
+                         conn_queue_high_water);
+
+  airport_node_loop(listenfd);
+  persist_close();
+
+  // destroying all gate mutexes
+  for (int i = 0; i < num_gates; i++) {
+    pthread_mutex_destroy(&AIRPORT_DATA->gates[i].gate_lock);
+  }
+
+  if (!AIRPORT_DATA->slots_mapped)
+    free(AIRPORT_DATA->slots);
+  free(AIRPORT_DATA->busy);
+  free(AIRPORT_DATA);
+}
+
+/* Returns the lane of the first request waiting on `connfd`, or LANE_NORMAL
+ * if none has arrived yet. */
+static request_lane_t peek_lane(int connfd) {
+  char buf[MAXLINE];
+  ssize_t n = recv(connfd, buf, sizeof(buf) - 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n <= 0)
+    return LANE_NORMAL;
+  buf[n] = 0;
+  return request_lane(buf);
+}
+
+/* Accepts connections on `listenfd` into `queue` for its workers, forever.
+ * Each is queued in the lane of its first request. */
+static void accept_loop(int listenfd, conn_queue_t *queue) {
+  int connfd;
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+
+  while (1) {
+    clientlen = sizeof(clientaddr);
+    connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+    if (connfd < 0) {
+      perror("accept");
+      continue;
+    }
+    // Enqueuing the connection for worker threads to handle, or turning it
+    // away at once if they are this far behind
+    if (enqueue(queue, connfd, peek_lane(connfd)) < 0) {
+      metrics_record_rejection(METRIC_REJECT_OVERLOAD);
+      send(connfd, "Error: Busy\n", 12, MSG_NOSIGNAL);
+      close(connfd);
+    }
+  }
+}
+
+/* Has `listenfd` accept connections only once their first request has
+ * arrived, so `peek_lane` finds it. */
+static void defer_accept(int listenfd) {
+  int secs = DEFER_ACCEPT_SECS;
+  setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs));
+}
+
+/* Listening sockets of the accept groups after the first */
+static int GROUP_LISTENFDS[MAX_ACCEPT_GROUPS];
+
+/* Runs the accept loop of accept group `arg`. */
+static void *accept_thread(void *arg) {
+  int group = (int)(intptr_t)arg;
+  accept_loop(GROUP_LISTENFDS[group], &conn_queues[group]);
+  return NULL;
+}
+
+/* Opens a listening socket for each accept group after the first, on the
+ * port of `listenfd`, which must have SO_REUSEPORT set. Returns the number of
+ * groups that have a socket. */
+static int open_accept_groups(int listenfd) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  char port_str[8];
+  int group;
+
+  if (ACCEPT_GROUPS == 1 || getsockname(listenfd, (SA *)&addr, &addrlen) < 0)
+    return 1;
+  snprintf(port_str, sizeof(port_str), "%u",
+           ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&addr)->sin6_port
+                                            : ((struct sockaddr_in *)&addr)->sin_port));
+  for (group = 1; group < ACCEPT_GROUPS; group++) {
+    if ((GROUP_LISTENFDS[group] = open_listenfd_reuseport(port_str)) < 0) {
+      fprintf(stderr, "[Airport %d] Cannot share port %s, using %d accept groups\n",
+              AIRPORT_ID, port_str, group);
+      break;
+    }
+  }
+  return group;
+}
+
+void airport_node_loop(int listenfd) {
+  // serving every connection from one io_uring, if selected and available
+  if (uring_server_enabled())
+    uring_server_run(listenfd, THREAD_POOL_SIZE, serve_line);
+
+  // Each accept group has its own socket and queue, so accepts share no lock
+  ACCEPT_GROUPS = open_accept_groups(listenfd);
+  defer_accept(listenfd);
+  for (int group = 1; group < ACCEPT_GROUPS; group++)
+    defer_accept(GROUP_LISTENFDS[group]);
+
+  // Creating worker threads, spread across the groups
+  pthread_t threads[THREAD_POOL_SIZE];
+  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+    if (pthread_create(&threads[i], NULL, worker_thread,
+                       &conn_queues[i % ACCEPT_GROUPS]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    pthread_detach(threads[i]); // Detached mode implementation
+  }
+  for (int group = 1; group < ACCEPT_GROUPS; group++) {
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, accept_thread, (void *)(intptr_t)group) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    pthread_detach(acceptor);
+  }
+
+  accept_loop(listenfd, &conn_queues[0]);
+}
@@ -0,0 +1,138 @@
+/*
+ * airport_server.c - Standalone Air Traffic Control airport node
+ *
+ * Runs a single airport node, or one shard of an airport. A controller
+ * started with a topology file (`-t`) naming this node's host and port
+ * forwards requests to it, so nodes can be spread over several machines, and
+ * keeps any replicas of it in step by sending them each booking as an APPLY.
+ * Otherwise the controller runs one of these per node itself, handing it an
+ * already open listening socket with `-f`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "airport.h"
+#include "import.h"
+#include "network_utils.h"
+#include "persist.h"
+#include "uring_server.h"
+
+#define MIN_PORTNUM 1024
+#define MAX_PORTNUM 65535
+
+/** @brief Prints usage information for the program and then exits. */
+void print_usage(char *program_name) {
+  printf("Usage: %s -a ID -g GATES -p P [-f FD] [-k SHARD -b GATE] [-l L] [-d DIR] [-i FILE] "
+         "[-H SLOTS] [-u]\n",
+         program_name);
+  printf("  -a: Identifier of the airport served.\n");
+  printf("  -g: Number of gates served by this node.\n");
+  printf("  -p: Port number on which to accept connections.\n");
+  printf("  -f: Accept on this already open listening socket, bound to port P.\n");
+  printf("  -k: Shard of the airport served, if it is split across nodes.\n");
+  printf("  -b: First gate of the airport served by this shard.\n");
+  printf("  -l: Accept on L sockets sharing the port with SO_REUSEPORT, each with its\n"
+         "      own queue and workers (default 1).\n");
+  printf("  -d: Directory in which to persist the schedule.\n");
+  printf("  -i: CSV file of flights to seed an empty schedule from before serving.\n");
+  printf("  -H: Time slots per gate, as given to the controller (default %d).\n",
+         DEFAULT_TIME_SLOTS);
+  printf("  -u: Serve connections with io_uring where the kernel supports it.\n");
+  printf("  -h: Print this help message and exit.\n");
+  exit(0);
+}
+
+int main(int argc, char *argv[]) {
+  int c, ret = 0, airport_id = -1, num_gates = 0, portnum = 0, shard = -1, gate_base = 0;
+  int accept_groups = 1, num_slots = DEFAULT_TIME_SLOTS, listenfd = -1;
+  char port_str[8];
+
+  while ((c = getopt(argc, argv, "a:g:p:f:k:b:l:d:i:H:uh")) != -1) {
+    switch (c) {
+    case 'a':
+      sscanf(optarg, "%d", &airport_id);
+      break;
+    case 'g':
+      sscanf(optarg, "%d", &num_gates);
+      break;
+    case 'p':
+      sscanf(optarg, "%d", &portnum);
+      break;
+    case 'f':
+      sscanf(optarg, "%d", &listenfd);
+      break;
+    case 'k':
+      sscanf(optarg, "%d", &shard);
+      break;
+    case 'b':
+      sscanf(optarg, "%d", &gate_base);
+      break;
+    case 'l':
+      sscanf(optarg, "%d", &accept_groups);
+      break;
+    case 'd':
+      persist_set_dir(optarg);
+      break;
+    case 'i':
+      import_set_file(optarg);
+      break;
+    case 'H':
+      sscanf(optarg, "%d", &num_slots);
+      break;
+    case 'u':
+      uring_server_set_enabled(1);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      break;
+    default:
+      ret = -1;
+      break;
+    }
+  }
+
+  if (airport_id < 0) {
+    fprintf(stderr, "-a must be at least 0.\n");
+    ret = -1;
+  }
+  if (num_gates <= 0) {
+    fprintf(stderr, "-g must be greater than 0.\n");
+    ret = -1;
+  }
+  if (portnum < MIN_PORTNUM || portnum > MAX_PORTNUM) {
+    fprintf(stderr, "-p must be between %d-%d.\n", MIN_PORTNUM, MAX_PORTNUM);
+    ret = -1;
+  }
+  if (listenfd >= 0 && listenfd <= STDERR_FILENO) {
+    fprintf(stderr, "-f must be a descriptor other than stdin, stdout or stderr.\n");
+    ret = -1;
+  }
+  if (gate_base < 0 || (shard < 0 && gate_base > 0)) {
+    fprintf(stderr, "-b must be at least 0, and needs -k.\n");
+    ret = -1;
+  }
+  if (accept_groups < 1) {
+    fprintf(stderr, "-l must be at least 1.\n");
+    ret = -1;
+  }
+  if (set_time_slots(num_slots) < 0) {
+    fprintf(stderr, "-H must be 48, 96, 288 or 2016.\n");
+    ret = -1;
+  }
+  if (ret < 0)
+    return 1;
+
+  snprintf(port_str, sizeof(port_str), "%d", portnum);
+  if (listenfd < 0)
+    listenfd = accept_groups > 1 ? open_listenfd_reuseport(port_str) : open_listenfd(port_str);
+  if (listenfd < 0) {
+    perror("open_listenfd");
+    return 1;
+  }
+  if (shard >= 0)
+    set_node_shard(shard, gate_base);
+  set_node_accept_groups(accept_groups);
+  initialise_node(airport_id, num_gates, listenfd);
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGN 16
+
+/* Memory malloc'd for requests the arena could not hold. */
+typedef struct overflow_t {
+  struct overflow_t *next;
+  _Alignas(ARENA_ALIGN) char data[];
+} overflow_t;
+
+typedef struct arena_t {
+  char *base;
+  size_t used;
+  overflow_t *overflow;
+} arena_t;
+
+static __thread arena_t ARENA;
+
+void *arena_alloc(size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (ARENA.base == NULL && (ARENA.base = aligned_alloc(ARENA_ALIGN, ARENA_SIZE)) == NULL)
+    return NULL;
+  if (size <= ARENA_SIZE - ARENA.used) {
+    void *ptr = ARENA.base + ARENA.used;
+    ARENA.used += size;
+    return ptr;
+  }
+  overflow_t *block = malloc(sizeof(overflow_t) + size);
+  if (block == NULL)
+    return NULL;
+  block->next = ARENA.overflow;
+  ARENA.overflow = block;
+  return block->data;
+}
+
+void arena_reset(void) {
+  while (ARENA.overflow != NULL) {
+    overflow_t *block = ARENA.overflow;
+    ARENA.overflow = block->next;
+    free(block);
+  }
+  ARENA.used = 0;
+}
+
+void *slab_alloc(slab_t *slab) {
+  void *obj = slab->free_list;
+  if (obj == NULL)
+    return malloc(slab->size);
+  slab->free_list = *(void **)obj;
+  slab->cached--;
+  return obj;
+}
+
+void slab_free(slab_t *slab, void *obj) {
+  if (obj == NULL)
+    return;
+  if (slab->cached >= SLAB_MAX_CACHED) {
+    free(obj);
+    return;
+  }
+  *(void **)obj = slab->free_list;
+  slab->free_list = obj;
+  slab->cached++;
+}
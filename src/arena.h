@@ -0,0 +1,48 @@
+#ifndef ARENA_HEADER
+#define ARENA_HEADER
+
+#include <stddef.h>
+
+/** Allocation without malloc on the request path.
+ *
+ *  Every thread has an arena of `ARENA_SIZE` bytes, allocated on first use,
+ *  from which scratch memory for the request being handled is carved by
+ *  bumping an offset. `arena_reset` releases all of it at once when the
+ *  request ends, so the same few cache lines are reused request after
+ *  request. Requests that need more than the arena get the rest from malloc,
+ *  which is freed on the reset.
+ *
+ *  Slabs recycle fixed-size objects, such as connections, through a free
+ *  list instead of returning them to malloc. A slab belongs to one thread:
+ *  objects must be allocated and freed by the thread owning their slab.
+ */
+
+#define ARENA_SIZE (64 * 1024)
+#define SLAB_MAX_CACHED 1024 /* freed objects kept per slab, beyond which they go to free */
+
+/** @brief Returns `size` bytes of the calling thread's arena, aligned for any
+ *         type, valid until the thread's next `arena_reset`. NULL if memory
+ *         could not be allocated. */
+void *arena_alloc(size_t size);
+
+/** @brief Releases everything allocated from the calling thread's arena. */
+void arena_reset(void);
+
+/** A pool of objects of `size` bytes. */
+typedef struct slab_t {
+  size_t size;
+  void *free_list; /* freed objects, linked through their first word */
+  int cached;      /* objects on `free_list` */
+} slab_t;
+
+#define SLAB_INITIALIZER(type) {sizeof(type), NULL, 0}
+
+/** @brief Returns an object from `slab`, recycled if one has been freed, or
+ *         NULL if memory could not be allocated. Like malloc, its contents
+ *         are undefined. */
+void *slab_alloc(slab_t *slab);
+
+/** @brief Returns `obj` to `slab`. */
+void slab_free(slab_t *slab, void *obj);
+
+#endif
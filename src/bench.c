@@ -0,0 +1,341 @@
+/*
+ * bench.c - Load generator for the Air Traffic Control controller
+ *
+ * Drives a running controller with a configurable mix of SCHEDULE,
+ * PLANE_STATUS and TIME_STATUS requests from several client threads and
+ * reports throughput and latency percentiles for each command.
+ *
+ * In closed-loop mode (the default) each thread sends its next request as
+ * soon as the previous response arrives. With `-r`, requests are issued on a
+ * fixed schedule instead, and latency is measured from the time each request
+ * was due to be sent, so queueing delay is not hidden when the server falls
+ * behind.
+ *
+ * SCHEDULEs with fuel of `LOW_FUEL` or less, which the servers dispatch
+ * first, are also reported on a row of their own, and `-S` checks their
+ * latency against a target.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "airport.h"
+#include "histogram.h"
+#include "network_utils.h"
+#include "xorshift.h"
+
+#define MAX_THREADS 256
+
+enum { CMD_SCHEDULE, CMD_PLANE_STATUS, CMD_TIME_STATUS, NUM_COMMANDS };
+
+static const char *COMMAND_NAMES[NUM_COMMANDS] = {"SCHEDULE", "PLANE_STATUS",
+                                                  "TIME_STATUS"};
+
+/** Parameters shared by every client thread. */
+typedef struct bench_params_t {
+  char *host;
+  char *port;
+  int num_threads;
+  int num_airports;
+  int num_gates;
+  double duration_s;  /* length of the measured run */
+  double warmup_s;    /* requests in this period are sent but not recorded */
+  double rate;        /* total requests/sec across all threads, 0 = closed */
+  int mix[NUM_COMMANDS]; /* relative weight of each command */
+  int max_fuel;
+  double slo_us;      /* latency target of low-fuel SCHEDULEs, 0 = none */
+  int num_slots;      /* time slots per gate the airports were started with */
+} bench_params_t;
+
+/** Results gathered by each client thread. */
+typedef struct client_t {
+  pthread_t thread;
+  int idx;
+  uint64_t rng;
+  uint64_t completed[NUM_COMMANDS];
+  uint64_t errors[NUM_COMMANDS];
+  uint64_t unsent; /* open-loop requests still due when the run ended */
+  histogram_t latency[NUM_COMMANDS];
+  histogram_t urgent;   /* low-fuel SCHEDULEs, also counted in `latency` */
+  uint64_t urgent_errors;
+  uint64_t slo_met;     /* low-fuel SCHEDULEs answered within `slo_us` */
+} client_t;
+
+static bench_params_t PARAMS = {
+    .host = "localhost",
+    .port = "1024",
+    .num_threads = 4,
+    .num_airports = 1,
+    .num_gates = 1,
+    .duration_s = 10,
+    .warmup_s = 1,
+    .rate = 0,
+    .mix = {50, 30, 20},
+    .max_fuel = 10,
+    .num_slots = DEFAULT_TIME_SLOTS,
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int random_below(client_t *c, int bound) {
+  return bound > 0 ? (int)(xorshift_next(&c->rng) % (uint64_t)bound) : 0;
+}
+
+/* Writes a random request into `buf`, returning the command chosen, the
+ * number of response lines a successful reply has and whether it is a
+ * low-fuel SCHEDULE. */
+static int make_request(client_t *c, char *buf, uint64_t seq, int *lines, int *urgent) {
+  int total = PARAMS.mix[0] + PARAMS.mix[1] + PARAMS.mix[2];
+  int pick = random_below(c, total), cmd = 0;
+  int airport = random_below(c, PARAMS.num_airports);
+  int start = random_below(c, PARAMS.num_slots);
+  int duration = random_below(c, PARAMS.num_slots - start < 4 ? PARAMS.num_slots - start : 4);
+  /* Plane ids are unique per thread, so PLANE_STATUS can look up ones this
+   * thread has already scheduled. */
+  int plane = c->idx * 10000000 + (int)(seq % 10000000);
+  int fuel = random_below(c, PARAMS.max_fuel + 1);
+
+  while (pick >= PARAMS.mix[cmd])
+    pick -= PARAMS.mix[cmd++];
+  *lines = 1;
+  *urgent = cmd == CMD_SCHEDULE && fuel <= LOW_FUEL;
+  switch (cmd) {
+  case CMD_SCHEDULE:
+    sprintf(buf, "SCHEDULE %d %d %d %d %d\n", airport, plane, start, duration, fuel);
+    break;
+  case CMD_PLANE_STATUS:
+    sprintf(buf, "PLANE_STATUS %d %d\n", airport,
+            c->idx * 10000000 + random_below(c, (int)(seq % 10000000) + 1));
+    break;
+  default:
+    if (start + duration >= PARAMS.num_slots)
+      duration = PARAMS.num_slots - 1 - start;
+    sprintf(buf, "TIME_STATUS %d %d %d %d\n", airport,
+            random_below(c, PARAMS.num_gates), start, duration);
+    *lines = duration + 1;
+  }
+  return cmd;
+}
+
+static int connect_controller(void) {
+  int fd;
+  while ((fd = open_clientfd(PARAMS.host, PARAMS.port)) < 0) {
+    perror("[Bench] open_clientfd");
+    sleep(1);
+  }
+  return fd;
+}
+
+static void *client_thread(void *arg) {
+  client_t *c = arg;
+  char request[MAXLINE], line[MAXLINE];
+  rio_t rio;
+  uint64_t seq = 0, begin, end, sent, due, interval_ns = 0;
+  uint64_t warmup_end, run_end;
+  int fd, cmd, lines, urgent, is_error;
+  ssize_t n;
+
+  fd = connect_controller();
+  rio_readinitb(&rio, fd);
+  if (PARAMS.rate > 0)
+    interval_ns = (uint64_t)(1e9 * PARAMS.num_threads / PARAMS.rate);
+
+  begin = now_ns();
+  warmup_end = begin + (uint64_t)(PARAMS.warmup_s * 1e9);
+  run_end = warmup_end + (uint64_t)(PARAMS.duration_s * 1e9);
+  /* Stagger open-loop threads so their requests don't arrive in bursts. */
+  due = begin + interval_ns * (uint64_t)c->idx / (uint64_t)PARAMS.num_threads;
+
+  while ((sent = now_ns()) < run_end) {
+    if (interval_ns) {
+      while (sent < due) {
+        struct timespec ts = {0, (long)(due - sent)};
+        nanosleep(&ts, NULL);
+        sent = now_ns();
+      }
+      sent = due;
+      due += interval_ns;
+    }
+
+    cmd = make_request(c, request, seq++, &lines, &urgent);
+    if (rio_writen(fd, request, strlen(request)) < 0) {
+      close(fd);
+      fd = connect_controller();
+      rio_readinitb(&rio, fd);
+      continue;
+    }
+    is_error = 0;
+    for (int i = 0; i < lines; i++) {
+      if ((n = rio_readlineb(&rio, line, MAXLINE)) <= 0) {
+        is_error = -1;
+        break;
+      }
+      /* Errors are always a single line. */
+      if (i == 0 && strncmp(line, "Error:", 6) == 0) {
+        is_error = 1;
+        break;
+      }
+    }
+    end = now_ns();
+    if (is_error < 0) {
+      close(fd);
+      fd = connect_controller();
+      rio_readinitb(&rio, fd);
+    }
+    if (sent < warmup_end)
+      continue;
+    if (is_error)
+      c->errors[cmd]++;
+    c->completed[cmd]++;
+    hist_record(&c->latency[cmd], end - sent);
+    if (urgent) {
+      if (is_error)
+        c->urgent_errors++;
+      hist_record(&c->urgent, end - sent);
+      // a plane told there is no room has still been answered in time
+      if (is_error >= 0 && (double)(end - sent) <= PARAMS.slo_us * 1e3)
+        c->slo_met++;
+    }
+  }
+  if (interval_ns && due < run_end)
+    c->unsent = (run_end - due) / interval_ns;
+  close(fd);
+  return NULL;
+}
+
+static void print_row(const char *name, const histogram_t *h, uint64_t errors) {
+  printf("%-14s %10lu %8lu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+         (unsigned long)h->total, (unsigned long)errors,
+         (double)h->total / PARAMS.duration_s, hist_mean(h) / 1e3,
+         (double)hist_percentile(h, 50) / 1e3,
+         (double)hist_percentile(h, 99) / 1e3,
+         (double)hist_percentile(h, 99.9) / 1e3, (double)h->max / 1e3);
+}
+
+static void print_usage(char *program_name) {
+  printf("Usage: %s [options]\n", program_name);
+  printf("  -H: Controller host (default localhost).\n");
+  printf("  -p: Controller port (default 1024).\n");
+  printf("  -t: Number of client threads (default 4).\n");
+  printf("  -n: Number of airports requests are spread over (default 1).\n");
+  printf("  -g: Number of gates queried by TIME_STATUS (default 1).\n");
+  printf("  -d: Measured duration in seconds (default 10).\n");
+  printf("  -w: Warmup in seconds, not recorded (default 1).\n");
+  printf("  -r: Open-loop rate in requests/sec across all threads.\n");
+  printf("      Closed-loop when omitted.\n");
+  printf("  -m: Command mix as SCHEDULE,PLANE_STATUS,TIME_STATUS weights\n");
+  printf("      (default 50,30,20).\n");
+  printf("  -f: Largest fuel value used by SCHEDULE (default 10).\n");
+  printf("  -S: Latency target in microseconds for SCHEDULEs with fuel of %d or\n"
+         "      less; reports the share answered within it.\n",
+         LOW_FUEL);
+  printf("  -s: Time slots per gate the airports were started with (default %d).\n",
+         DEFAULT_TIME_SLOTS);
+  printf("  -h: Print this help message and exit.\n");
+  exit(0);
+}
+
+static int parse_args(int argc, char *argv[]) {
+  int c;
+  while ((c = getopt(argc, argv, "H:p:t:n:g:d:w:r:m:f:S:s:h")) != -1) {
+    switch (c) {
+    case 'H': PARAMS.host = optarg; break;
+    case 'p': PARAMS.port = optarg; break;
+    case 't': PARAMS.num_threads = atoi(optarg); break;
+    case 'n': PARAMS.num_airports = atoi(optarg); break;
+    case 'g': PARAMS.num_gates = atoi(optarg); break;
+    case 'd': PARAMS.duration_s = atof(optarg); break;
+    case 'w': PARAMS.warmup_s = atof(optarg); break;
+    case 'r': PARAMS.rate = atof(optarg); break;
+    case 'f': PARAMS.max_fuel = atoi(optarg); break;
+    case 'S': PARAMS.slo_us = atof(optarg); break;
+    case 's': PARAMS.num_slots = atoi(optarg); break;
+    case 'm':
+      if (sscanf(optarg, "%d,%d,%d", &PARAMS.mix[0], &PARAMS.mix[1],
+                 &PARAMS.mix[2]) != 3) {
+        fprintf(stderr, "-m expects three comma-separated weights.\n");
+        return -1;
+      }
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      break;
+    default:
+      return -1;
+    }
+  }
+  if (PARAMS.num_threads <= 0 || PARAMS.num_threads > MAX_THREADS) {
+    fprintf(stderr, "-t must be between 1-%d.\n", MAX_THREADS);
+    return -1;
+  }
+  if (PARAMS.mix[0] + PARAMS.mix[1] + PARAMS.mix[2] <= 0 || PARAMS.mix[0] < 0 ||
+      PARAMS.mix[1] < 0 || PARAMS.mix[2] < 0) {
+    fprintf(stderr, "-m weights must be non-negative and not all zero.\n");
+    return -1;
+  }
+  if (PARAMS.num_airports <= 0 || PARAMS.num_gates <= 0 ||
+      PARAMS.duration_s <= 0 || PARAMS.num_slots <= 0) {
+    fprintf(stderr, "-n, -g, -d and -s must be greater than 0.\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static client_t clients[MAX_THREADS];
+  static histogram_t merged[NUM_COMMANDS], all, urgent;
+  uint64_t errors[NUM_COMMANDS] = {0}, total_errors = 0, unsent = 0;
+  uint64_t urgent_errors = 0, slo_met = 0;
+  int idx, cmd;
+
+  if (parse_args(argc, argv) < 0)
+    return 1;
+
+  printf("Benchmarking %s:%s with %d threads, %s for %.1fs, mix %d/%d/%d\n",
+         PARAMS.host, PARAMS.port, PARAMS.num_threads,
+         PARAMS.rate > 0 ? "open loop" : "closed loop", PARAMS.duration_s,
+         PARAMS.mix[0], PARAMS.mix[1], PARAMS.mix[2]);
+
+  for (idx = 0; idx < PARAMS.num_threads; idx++) {
+    clients[idx].idx = idx;
+    clients[idx].rng = xorshift_seed(idx);
+    if (pthread_create(&clients[idx].thread, NULL, client_thread,
+                       &clients[idx]) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  for (idx = 0; idx < PARAMS.num_threads; idx++) {
+    pthread_join(clients[idx].thread, NULL);
+    for (cmd = 0; cmd < NUM_COMMANDS; cmd++) {
+      hist_merge(&merged[cmd], &clients[idx].latency[cmd]);
+      hist_merge(&all, &clients[idx].latency[cmd]);
+      errors[cmd] += clients[idx].errors[cmd];
+      total_errors += clients[idx].errors[cmd];
+    }
+    hist_merge(&urgent, &clients[idx].urgent);
+    urgent_errors += clients[idx].urgent_errors;
+    slo_met += clients[idx].slo_met;
+    unsent += clients[idx].unsent;
+  }
+
+  printf("%-14s %10s %8s %12s %9s %9s %9s %9s %9s\n", "command", "requests",
+         "errors", "req/s", "mean(us)", "p50(us)", "p99(us)", "p999(us)",
+         "max(us)");
+  for (cmd = 0; cmd < NUM_COMMANDS; cmd++)
+    print_row(COMMAND_NAMES[cmd], &merged[cmd], errors[cmd]);
+  print_row("low-fuel", &urgent, urgent_errors);
+  print_row("total", &all, total_errors);
+  if (PARAMS.slo_us > 0 && urgent.total > 0)
+    printf("Low-fuel SCHEDULEs within %.0fus: %.2f%%\n", PARAMS.slo_us,
+           100.0 * (double)slo_met / (double)urgent.total);
+  if (unsent > 0)
+    printf("Warning: server fell behind the requested rate, %lu requests "
+           "were never sent\n", (unsigned long)unsent);
+  return 0;
+}
@@ -0,0 +1,166 @@
+#include "broadcast.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+/* `stamp` is 2 * seq + 1 while event `seq` is being written into the slot
+ * and 2 * seq + 2 once it is complete, so a reader can tell a pending, a
+ * complete and an overwritten event apart. */
+typedef struct broadcast_slot_t {
+  uint64_t stamp;
+  schedule_event_t event;
+} broadcast_slot_t;
+
+static broadcast_slot_t RING[BROADCAST_RING_EVENTS];
+static uint64_t CLAIMED = 0; /* sequence number of the next event */
+
+/* A listener is only signalled while `armed`, which it sets again in
+ * `broadcast_ack` before reading the ring, so a burst of events costs it one
+ * wakeup rather than one per event. A slot whose listener has left has an
+ * `fd` of -1 until it is reused. `signalling` counts the publishers between
+ * disarming the listener and writing to its eventfd, which is not closed
+ * until they are done, so its number cannot be reused under them. */
+typedef struct broadcast_listener_t {
+  int fd;
+  int armed;
+  int signalling;
+} broadcast_listener_t;
+
+/* Only serialises listeners joining and leaving; publishers never take it. */
+static pthread_mutex_t LISTENERS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static broadcast_listener_t LISTENERS[BROADCAST_MAX_LISTENERS];
+static int NUM_LISTENERS = 0; /* listeners registered */
+static int NUM_SLOTS = 0;     /* slots ever used, which publishers scan */
+
+int broadcast_listen(void) {
+  int fd = -1, idx = 0;
+  pthread_mutex_lock(&LISTENERS_LOCK);
+  if (NUM_LISTENERS < BROADCAST_MAX_LISTENERS &&
+      (fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0) {
+    while (idx < NUM_SLOTS && LISTENERS[idx].fd >= 0)
+      idx++;
+    STORE(&LISTENERS[idx].fd, fd);
+    __atomic_store_n(&LISTENERS[idx].armed, 1, __ATOMIC_SEQ_CST);
+    if (idx == NUM_SLOTS)
+      __atomic_store_n(&NUM_SLOTS, idx + 1, __ATOMIC_RELEASE);
+    STORE(&NUM_LISTENERS, NUM_LISTENERS + 1);
+  }
+  pthread_mutex_unlock(&LISTENERS_LOCK);
+  return fd;
+}
+
+void broadcast_unlisten(int fd) {
+  pthread_mutex_lock(&LISTENERS_LOCK);
+  for (int idx = 0; idx < NUM_SLOTS; idx++) {
+    broadcast_listener_t *listener = &LISTENERS[idx];
+    if (listener->fd == fd) {
+      __atomic_store_n(&listener->fd, -1, __ATOMIC_SEQ_CST);
+      STORE(&listener->armed, 0);
+      /* A publisher that saw the old fd is about to write to it. */
+      while (__atomic_load_n(&listener->signalling, __ATOMIC_SEQ_CST) > 0)
+        sched_yield();
+      STORE(&NUM_LISTENERS, NUM_LISTENERS - 1);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&LISTENERS_LOCK);
+  close(fd);
+}
+
+void broadcast_ack(int fd) {
+  int num_slots = __atomic_load_n(&NUM_SLOTS, __ATOMIC_ACQUIRE);
+  uint64_t counter;
+  /* Clear before re-arming: a signal in between would otherwise be lost. */
+  if (read(fd, &counter, sizeof(counter)) < 0) {
+    /* Not signalled since the last acknowledgement. */
+  }
+  for (int idx = 0; idx < num_slots; idx++)
+    if (LOAD(&LISTENERS[idx].fd) == fd)
+      __atomic_store_n(&LISTENERS[idx].armed, 1, __ATOMIC_SEQ_CST);
+  /* Events published before a publisher saw the listener armed are read. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void broadcast_publish(int airport, int plane_id, int gate, int start, int end) {
+  static const uint64_t ONE = 1;
+  broadcast_slot_t *slot;
+  uint64_t seq;
+  int num_slots, fd;
+
+  if (LOAD(&NUM_LISTENERS) == 0)
+    return;
+  seq = __atomic_fetch_add(&CLAIMED, 1, __ATOMIC_RELAXED);
+  slot = &RING[seq & (BROADCAST_RING_EVENTS - 1)];
+  STORE(&slot->stamp, 2 * seq + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  STORE(&slot->event.seq, seq);
+  STORE(&slot->event.airport, airport);
+  STORE(&slot->event.plane_id, plane_id);
+  STORE(&slot->event.gate, gate);
+  STORE(&slot->event.start, start);
+  STORE(&slot->event.end, end);
+  __atomic_store_n(&slot->stamp, 2 * seq + 2, __ATOMIC_RELEASE);
+
+  num_slots = __atomic_load_n(&NUM_SLOTS, __ATOMIC_ACQUIRE);
+  for (int idx = 0; idx < num_slots; idx++) {
+    broadcast_listener_t *listener = &LISTENERS[idx];
+    if (!__atomic_exchange_n(&listener->armed, 0, __ATOMIC_SEQ_CST))
+      continue;
+    /* Announced before reading the fd, so a leaving listener either waits
+     * for this write or has already cleared its fd. */
+    __atomic_fetch_add(&listener->signalling, 1, __ATOMIC_SEQ_CST);
+    fd = __atomic_load_n(&listener->fd, __ATOMIC_SEQ_CST);
+    if (fd >= 0 && write(fd, &ONE, sizeof(ONE)) < 0) {
+      /* The counter is saturated, so the listener is already awake. */
+    }
+    __atomic_fetch_sub(&listener->signalling, 1, __ATOMIC_RELEASE);
+  }
+}
+
+uint64_t broadcast_head(void) { return __atomic_load_n(&CLAIMED, __ATOMIC_ACQUIRE); }
+
+int broadcast_read(uint64_t *cursor, schedule_event_t *events, int max, uint64_t *lost) {
+  uint64_t seq = *cursor, stamp, oldest;
+  int count = 0;
+
+  *lost = 0;
+  while (count < max) {
+    broadcast_slot_t *slot = &RING[seq & (BROADCAST_RING_EVENTS - 1)];
+    stamp = __atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE);
+    if (stamp < 2 * seq + 2)
+      break; /* not published yet */
+    if (stamp == 2 * seq + 2) {
+      schedule_event_t *event = &events[count];
+      event->seq = LOAD(&slot->event.seq);
+      event->airport = LOAD(&slot->event.airport);
+      event->plane_id = LOAD(&slot->event.plane_id);
+      event->gate = LOAD(&slot->event.gate);
+      event->start = LOAD(&slot->event.start);
+      event->end = LOAD(&slot->event.end);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (LOAD(&slot->stamp) == stamp) {
+        count++;
+        seq++;
+        continue;
+      }
+    }
+    /* Overwritten by a later lap: skip to the oldest event still held. */
+    oldest = broadcast_head() - BROADCAST_RING_EVENTS + 1;
+    if (oldest <= seq)
+      oldest = seq + 1;
+    *lost += oldest - seq;
+    seq = oldest;
+  }
+  *cursor = seq;
+  return count;
+}
+
+int broadcast_is_subscribe(const char *line) {
+  return strncmp(line, "SUBSCRIBE", 9) == 0 && (line[9] == '\0' || isspace(line[9]));
+}
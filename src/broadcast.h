@@ -0,0 +1,71 @@
+#ifndef BROADCAST_HEADER
+#define BROADCAST_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Broadcast ring of schedule changes, for SUBSCRIBE.
+ *
+ *  Every process has one ring of the last `BROADCAST_RING_EVENTS` events.
+ *  Publishers claim a sequence number with an atomic increment and fill in
+ *  its slot, so publishing takes no lock. Any number of readers follow the
+ *  ring independently, each with its own cursor. A reader that falls more
+ *  than a ring behind is told how many events it lost and skips ahead.
+ *
+ *  Readers sleep on an eventfd from `broadcast_listen`. A publish signals it
+ *  once, and not again until the reader calls `broadcast_ack` and goes back
+ *  to reading the ring. Signalling takes no lock either: a listener that
+ *  leaves waits for any publisher still writing to its eventfd before closing
+ *  it. While nobody listens, `broadcast_publish` returns at once, so a node
+ *  without subscribers pays a single load per SCHEDULE.
+ */
+
+#define BROADCAST_RING_EVENTS 4096 /* must be a power of two */
+#define BROADCAST_MAX_LISTENERS 64
+
+/** A plane placed at `gate` of `airport` for slots `[start]..[end]`. */
+typedef struct schedule_event_t {
+  uint64_t seq;
+  int32_t airport;
+  int32_t plane_id;
+  int32_t gate;
+  int32_t start;
+  int32_t end;
+} schedule_event_t;
+
+/** @brief Registers a listener.
+ *
+ *  @returns A non-blocking eventfd that becomes readable after each publish,
+ *           or -1 if there are too many listeners. Pass it to
+ *           `broadcast_unlisten` rather than closing it.
+ */
+int broadcast_listen(void);
+
+/** @brief Unregisters and closes a listener's eventfd. */
+void broadcast_unlisten(int fd);
+
+/** @brief Clears a listener's eventfd and re-arms it. Must be called after
+ *         each wakeup, before reading the ring, so no event goes unnoticed. */
+void broadcast_ack(int fd);
+
+/** @brief Appends an event to the ring and wakes every listener. Does nothing
+ *         if there are no listeners. */
+void broadcast_publish(int airport, int plane_id, int gate, int start, int end);
+
+/** @brief Returns the sequence number the next event will be published with,
+ *         which is where a new reader starts. */
+uint64_t broadcast_head(void);
+
+/** @brief Copies up to `max` events from `*cursor` onwards into `events`,
+ *         advancing the cursor past them. Stops at the first event that has
+ *         not been completely published yet.
+ *
+ *  @returns The number of events copied. The number of events that were
+ *           overwritten before they could be read is stored in `lost`.
+ */
+int broadcast_read(uint64_t *cursor, schedule_event_t *events, int max, uint64_t *lost);
+
+/** @brief Returns 1 if the request line `line` is a SUBSCRIBE. */
+int broadcast_is_subscribe(const char *line);
+
+#endif
@@ -4,16 +4,32 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "admission.h"
+#include "arena.h"
 #include "airport.h"
+#include "broadcast.h"
+#include "metrics.h"
+#include "trace.h"
+#include "uring_server.h"
 #include "network_utils.h" 
+#include "persist.h"
+#include "record.h"
+#include "response_cache.h"
 
 #define PORT_STRLEN 6
+#define HOST_LEN 64
 #define DEFAULT_PORTNUM 1024
 #define MIN_PORTNUM 1024
 #define MAX_PORTNUM 65535
@@ -21,8 +37,19 @@
 /** Struct that contains information associated with each airport node. */
 typedef struct airport_node_info {
   int id;    /* Airport identifier */
+  int shard; /* Shard of the airport served, or -1 if it is not sharded */
+  int gate_base; /* First gate of the airport served by this node */
+  int num_gates; /* Number of gates served by this node */
   int port;  /* Port num associated with this airport's listening socket */
+  char host[HOST_LEN];     /* Host the node runs on */
+  struct sockaddr_in addr; /* Address of the node's listening socket */
   pid_t pid; /* PID of the child process for this airport. */
+  volatile sig_atomic_t available; /* 0 while the node is down, or a replica out of sync */
+  int restarts;                    /* Number of times the node was respawned */
+  int replica;      /* Index among the replicas of its node, or -1 for the node itself */
+  int num_replicas; /* Replicas kept in step with this node, which also serve reads */
+  struct airport_node_info *replicas;
+  unsigned next_read; /* Rotates reads across the node and its replicas */
 } node_info_t;
 
 /** Struct that contains parameters for the controller node and ATC network as
@@ -32,178 +59,1552 @@ typedef struct controller_params_t {
   int portnum;                /* port number used to connect to the controller */
   int num_airports;           /* number of airports to create */
   int *gate_counts;           /* array containing the number of gates in each airport */
-  node_info_t *airport_nodes; /* array of info associated with each airport */
+  int num_shards;             /* most nodes an airport's gates are split across */
+  int num_nodes;              /* number of airport nodes, across every airport */
+  int *first_node;            /* each airport's first node, then `num_nodes` */
+  node_info_t *airport_nodes; /* array of info associated with each node */
+  char *topology;             /* file placing nodes on other hosts, or NULL to spawn them */
+  char *persist_dir;          /* directory nodes persist their schedules in, or NULL */
+  char *import_path;          /* CSV file nodes seed their schedules from, or NULL */
 } controller_params_t;
 
 controller_params_t ATC_INFO;
 
+/* Supervision of airport nodes: `sigchld_handler` marks a dead node as
+ * unavailable and writes its index to this pipe, waking the supervisor thread
+ * which respawns it on the same port. */
+#define RESPAWN_BACKOFF_MIN_MS 50
+#define RESPAWN_BACKOFF_MAX_MS 2000
+#define SUPERVISOR_POLL_MS 1000
+static int supervisor_pipe[2] = {-1, -1};
+
+/* The `airport_server` program each spawned node runs, found next to the
+ * controller's own executable. */
+static char NODE_PROGRAM[PATH_MAX];
+
+/* An airport is split into at most this many gate-range shards. */
+#define MAX_SHARDS 16
+/* Most replicas a node of a topology file may have. */
+#define MAX_REPLICAS 8
+
+/* Port serving metrics over HTTP, or 0 if disabled */
+static int METRICS_PORT = 0;
+
+/* Source of the ids attached to each request's log records */
+static uint64_t NEXT_REQUEST_ID = 0;
+/* Source of the ids client connections are recorded under */
+static uint64_t NEXT_CONN_ID = 0;
+
 /* thread pool def'ns */
 #define THREAD_POOL_SIZE 4
-#define QUEUE_SIZE 100
-
-typedef struct request_queue_t {
-    int connections[QUEUE_SIZE];
-    int front;
-    int rear;
-    int count;
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-} request_queue_t;
-
-static request_queue_t request_queue;
-
-/* initialising the request queue */
-void init_request_queue(request_queue_t *q) {
-    q->front = 0;
-    q->rear = 0;
-    q->count = 0;
-    pthread_mutex_init(&q->mutex, NULL);
-    pthread_cond_init(&q->not_empty, NULL);
-    pthread_cond_init(&q->not_full, NULL);
-}
-
-/* enqueuing a connection */
-void enqueue_request(request_queue_t *q, int connfd) {
-    pthread_mutex_lock(&q->mutex);
-    while (q->count == QUEUE_SIZE) {
-        pthread_cond_wait(&q->not_full, &q->mutex);
-    }
-    q->connections[q->rear] = connfd;
-    q->rear = (q->rear + 1) % QUEUE_SIZE;
-    q->count++;
-    pthread_cond_signal(&q->not_empty);
-    pthread_mutex_unlock(&q->mutex);
-}
-
-/* dequeuing a connection */
-int dequeue_request(request_queue_t *q) {
-    pthread_mutex_lock(&q->mutex);
-    while (q->count == 0) {
-        pthread_cond_wait(&q->not_empty, &q->mutex);
-    }
-    int connfd = q->connections[q->front];
-    q->front = (q->front + 1) % QUEUE_SIZE;
-    q->count--;
-    pthread_cond_signal(&q->not_full);
-    pthread_mutex_unlock(&q->mutex);
-    return connfd;
-}
-
-/* Worker thread function */
-void *controller_worker(void *arg) {
-    while (1) {
-        int connfd = dequeue_request(&request_queue);
-        rio_t rio_client, rio_airport;
-        char buf[MAXLINE], response[MAXLINE];
+#define EVENT_BATCH 64         // epoll events handled per wakeup
+#define CLIENT_INBUF (2 * MAXLINE)
+
+/* Listening sockets sharing the controller's port with SO_REUSEPORT, each
+ * accepted from by its own workers, and by each spawned node on its port. The
+ * first is `ATC_INFO.listenfd`. */
+#define MAX_ACCEPT_GROUPS THREAD_POOL_SIZE
+static int ACCEPT_GROUPS = 1;
+static int ACCEPT_FDS[MAX_ACCEPT_GROUPS] = {-1, -1, -1, -1};
+
+/* A request line to be forwarded to an airport node. */
+typedef struct forward_t {
+    metric_cmd_t cmd;
+    int airport_num;    // airport named by the request, or -1
+    int node;           // node to forward to, or -1 to fan out to every shard
+    int expected_lines; // lines in a successful response, or `LISTING_LINES`
+    int last_node;      // last node a listing is gathered from, from `node` on
+    int listing_flags;  // how the parts of a listing are joined, `LISTING_*`
+} forward_t;
+
+/* Expected lines of a listing, which ends with an END line */
+#define LISTING_LINES (-1)
+/* Only the END of each part after the first is read, as for the
+ * acknowledgement of LOCKSTATS ON or OFF */
+#define LISTING_FIRST_ONLY 1
+/* A TRACE of every node, skipping those that are down, inside the JSON
+ * object the controller's own spans start */
+#define LISTING_TRACE 2
+
+/* A request sent to every shard of an airport at once, as a SCHEDULE to the
+ * first shard and a PROBE of where it would fit to the others. Each shard
+ * answers with a single line. The legs also carry the APPLY of a booking to
+ * every replica of the node that made it. */
+typedef struct shard_leg_t {
+    struct client_conn_t *conn;
+    int fd;                 // socket to the shard's node, or -1 once ended
+    int connected;
+    size_t sent, reply_len;
+} shard_leg_t;
+
+typedef struct fanout_t {
+    int pending;                       // legs that have not ended yet
+    shard_leg_t legs[MAX_SHARDS];
+    char replies[MAX_SHARDS][MAXLINE]; // each shard's line, or "" if it failed
+    size_t probe_len;
+    char probe[MAXLINE + 32];          // sent to shards after the first
+    struct airport_node_info *apply_node; // node whose replicas `probe` is applied to
+} fanout_t;
+
+/* Each worker thread runs its own epoll loop, and every client connection is
+ * a state machine advanced by that loop as its sockets become ready: read a
+ * request line, connect to the airport node, write the request, read the
+ * response, write it to the client. A worker never blocks waiting on a node,
+ * so a few workers keep thousands of forwards in flight. Lines from one
+ * client are still handled one at a time, so its responses stay in order. */
+typedef enum {
+    CONN_IDLE,    // waiting for a complete request line
+    CONN_FANOUT,  // waiting on every shard of a sharded airport
+    CONN_CONNECT, // connecting to the airport node
+    CONN_FORWARD, // writing the request to the airport node
+    CONN_AWAIT,   // reading the airport node's response
+    CONN_REPLY,   // writing the response to the client
+    CONN_SUBSCRIBED, // streaming schedule changes to the client
+} conn_state_t;
+
+typedef struct client_conn_t {
+    int fd;                     // client socket
+    int airport_fd;             // socket to the airport node, or -1
+    conn_state_t state;
+    int eof;                    // the client has finished sending
+    int broken;                 // the client socket failed or was reset
+    int closed;                 // closed, and freed after the current events
+    uint32_t events;            // epoll events watched on `fd`
+    size_t in_len;
+    char in[CLIENT_INBUF];      // received bytes not yet handled
+    wbuf_t out;                 // response being built, then sent
+    size_t out_sent;
+    forward_t fwd;              // the request being handled
+    node_info_t *target;        // node the request is forwarded to
+    uint64_t client_key;        // the client's rate limiting bucket
+    uint64_t conn_id;           // the connection's id in the record file
+    uint64_t request_id;
+    uint64_t trace_id;          // `request_id` if traced, 0 otherwise
+    uint64_t begin;             // when the request was read
+    uint64_t forward_begin;     // when the forward started
+    uint64_t stage_at;          // when the current stage started
+    size_t request_len, request_sent;
+    char request[MAXLINE + 32]; // line sent to the node, with any trace id
+    size_t key_offset;          // where the client's line starts in `request`
+    uint64_t cache_version;     // the airport's schedule version before the forward
+    size_t out_start;           // where the node's response starts in `out`
+    int lines_left;             // response lines still expected from the node
+    fanout_t *fanout;           // allocated on the first fanned-out request
+    int commit_shard;           // shard a fanned-out SCHEDULE is committed to
+    int listing_shard;          // part of a listing being relayed, from 0
+    size_t reply_len;
+    char reply[MAXLINE];        // partial response line from the node
+    char response[MAXLINE];     // last line of the response, for metrics
+    int subscribed_airport;     // airport a subscriber follows, or -1 for all
+    uint64_t cursor;            // a subscriber's position in the broadcast ring
+    struct client_conn_t *prev_subscriber, *next_subscriber;
+    struct client_conn_t *next_closed;
+} client_conn_t;
+
+/* Low bit of an epoll event's data, marking the airport side of a connection */
+#define AIRPORT_TAG 1ull
+/* Second lowest bit of an epoll event's data, marking a `shard_leg_t` */
+#define SHARD_TAG 2ull
+
+/* Schedule changes read from the broadcast ring per write to a subscriber */
+#define SUBSCRIBE_BATCH 64
+/* Delay before a feed reconnects to its airport node */
+#define FEED_RETRY_MS 100
+
+static __thread int WORKER_EPOLL = -1;
+/* Connections closed while handling a batch of events, which later events in
+ * the batch may still refer to */
+static __thread client_conn_t *CLOSED_CONNS = NULL;
+/* Recycled connections and fanouts of this worker */
+static __thread slab_t CONN_SLAB = SLAB_INITIALIZER(client_conn_t);
+static __thread slab_t FANOUT_SLAB = SLAB_INITIALIZER(fanout_t);
+/* This worker's subscribers, and the eventfd waking it for broadcasts */
+static __thread client_conn_t *SUBSCRIBERS = NULL;
+static __thread int BROADCAST_FD = -1;
+/* Pointed to by the epoll event signalling new events in the broadcast ring.
+ * Being aligned, its address carries no tag bits. */
+static int BROADCAST_WAKE;
+
+/* Set once the feeds of schedule changes from the nodes have been started */
+static int FEEDS_STARTED = 0;
+
+/* Counts reported as gauges in metrics */
+static long CLIENT_CONNECTIONS = 0;
+static long FORWARDS_IN_FLIGHT = 0;
+/* Forwards in flight from which new requests are refused as busy, or 0 */
+static long MAX_IN_FLIGHT = 0;
+
+static long client_connections(void) {
+    return __atomic_load_n(&CLIENT_CONNECTIONS, __ATOMIC_RELAXED);
+}
+
+static long forwards_in_flight(void) {
+    return __atomic_load_n(&FORWARDS_IN_FLIGHT, __ATOMIC_RELAXED);
+}
+
+/* Answers a request with `Error: Busy`, turned away for `reason`. */
+static void reject_busy(wbuf_t *out, char *response, forward_t *fwd, metric_reject_t reason) {
+    if (reason == METRIC_REJECT_RATE) {
+        fwd->cmd = METRIC_OTHER;
+        fwd->airport_num = -1;
+    }
+    metrics_record_rejection(reason);
+    sprintf(response, "Error: Busy\n");
+    wbuf_write(out, response, strlen(response));
+}
+
+/* Returns the number of nodes airport `airport_num` is split across. */
+static int airport_shards(int airport_num) {
+    return ATC_INFO.first_node[airport_num + 1] - ATC_INFO.first_node[airport_num];
+}
+
+/* Returns the node serving shard `shard` of airport `airport_num`. */
+static node_info_t *shard_node(int airport_num, int shard) {
+    return &ATC_INFO.airport_nodes[ATC_INFO.first_node[airport_num] + shard];
+}
+
+/* Returns the shard of airport `airport_num` holding gate `gate_num`, or the
+ * first if no shard does. */
+static int gate_shard(int airport_num, int gate_num) {
+    for (int shard = 0; shard < airport_shards(airport_num); shard++) {
+        node_info_t *node = shard_node(airport_num, shard);
+        if (gate_num >= node->gate_base && gate_num < node->gate_base + node->num_gates)
+            return shard;
+    }
+    return 0;
+}
+
+/* Writes how `node` is named in messages into `buf`, of `size` bytes. */
+static char *node_name(node_info_t *node, char *buf, size_t size) {
+    int len = snprintf(buf, size, "Airport %d", node->id);
+    if (node->shard >= 0 && len >= 0 && (size_t)len < size)
+        len += snprintf(buf + len, size - (size_t)len, " shard %d (gates %d-%d)", node->shard,
+                        node->gate_base, node->gate_base + node->num_gates - 1);
+    if (node->replica >= 0 && len >= 0 && (size_t)len < size)
+        snprintf(buf + len, size - (size_t)len, " replica %d", node->replica + 1);
+    return buf;
+}
+
+/* Picks the node to serve a read forwarded to `node`: the node itself or one
+ * of its replicas still in sync, in turn. */
+static node_info_t *read_node(node_info_t *node) {
+    unsigned count = (unsigned)node->num_replicas + 1;
+    unsigned start = __atomic_fetch_add(&node->next_read, 1, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < count; i++) {
+        unsigned pick = (start + i) % count;
+        node_info_t *candidate = pick == 0 ? node : &node->replicas[pick - 1];
+        if (candidate->available)
+            return candidate;
+    }
+    return node;
+}
+
+/* Returns the node to forward the request in `fwd` to: reads are spread
+ * across replicas, while anything else goes to the node itself. */
+static node_info_t *forward_target(forward_t *fwd) {
+    node_info_t *node = &ATC_INFO.airport_nodes[fwd->node];
+    if (fwd->cmd == METRIC_PLANE_STATUS || fwd->cmd == METRIC_TIME_STATUS)
+        return read_node(node);
+    return node;
+}
+
+/* Stops using `replica`, which failed to answer or to apply a booking and so
+ * may no longer hold the schedule of its node. */
+static void drop_replica(node_info_t *replica) {
+    char name[96];
+    if (__atomic_exchange_n(&replica->available, 0, __ATOMIC_RELAXED))
+        fprintf(stderr, "[Controller] %s at %s:%d is out of sync, no longer using it\n",
+                node_name(replica, name, sizeof(name)), replica->host, replica->port);
+}
+
+/* Sends `request` to an airport node and relays its response to `out`, up
+ * to the END line that terminates listings such as STATS. The last line read,
+ * END or an error, is left in `response` rather than relayed. Comment lines
+ * are dropped when `strip_comments` is set, so several nodes' metrics can be
+ * concatenated without repeating HELP and TYPE lines.
+ * Returns 0 if the listing was complete, -1 otherwise. */
+static int relay_node_listing(node_info_t *node, char *request, wbuf_t *out,
+                              int strip_comments, char *response) {
+    rio_t rio_airport;
+    int airport_fd;
+    ssize_t m;
+
+    response[0] = 0;
+    if ((airport_fd = open_clientfd_addr(&node->addr)) < 0)
+        return -1;
+
+    rio_writen(airport_fd, request, strlen(request));
+    rio_readinitb(&rio_airport, airport_fd);
+    while ((m = rio_readlineb(&rio_airport, response, MAXLINE)) > 0) {
+        if (strcmp(response, "END\n") == 0 || strncmp(response, "Error:", 6) == 0)
+            break;
+        if (strip_comments && response[0] == '#')
+            continue;
+        wbuf_write(out, response, (size_t)m);
+    }
+    close(airport_fd);
+    if (m <= 0)
+        response[0] = 0;
+    return strcmp(response, "END\n") == 0 ? 0 : -1;
+}
+
+/* Writes this controller's metrics to `out`. */
+static void write_controller_stats(wbuf_t *out) {
+    size_t len;
+    char *stats = metrics_format(&len);
+    if (stats != NULL) {
+        wbuf_write(out, stats, len);
+        free(stats);
+    }
+}
+
+/* Closes the Chrome trace JSON object opened by `write_trace_head`. */
+static const char TRACE_TAIL[] = "]}\n";
+
+/* Opens a Chrome trace JSON object in `out` with the controller's own spans,
+ * which every airport node's are to follow. */
+static void write_trace_head(wbuf_t *out) {
+    static const char OPEN[] = "{\"traceEvents\":[\n";
+    size_t len;
+    char *events = trace_format_events(&len);
+
+    wbuf_write(out, OPEN, sizeof(OPEN) - 1);
+    if (events != NULL) {
+        // the first event must not be preceded by a comma
+        wbuf_write(out, events + 1, len - 1);
+        free(events);
+    }
+}
+
+/* Writes the trace spans of the controller and every airport node that is up
+ * to `out`, as a Chrome trace JSON object. */
+static void write_trace(wbuf_t *out) {
+    char request[MAXLINE], line[MAXLINE];
+
+    write_trace_head(out);
+    for (int idx = 0; idx < ATC_INFO.num_nodes; idx++) {
+        node_info_t *node = &ATC_INFO.airport_nodes[idx];
+        if (node->available) {
+            snprintf(request, MAXLINE, "TRACE %d\n", node->id);
+            relay_node_listing(node, request, out, 0, line);
+        }
+    }
+    wbuf_write(out, TRACE_TAIL, sizeof(TRACE_TAIL) - 1);
+}
 
-        rio_readinitb(&rio_client, connfd);
+/* Returns the first node from `idx` on that is up, or -1 if there is none. */
+static int next_available_node(int idx) {
+    while (idx < ATC_INFO.num_nodes && !ATC_INFO.airport_nodes[idx].available)
+        idx++;
+    return idx < ATC_INFO.num_nodes ? idx : -1;
+}
+
+/* Parses a request line and stores the kind of request and the airport it
+ * named, or -1, in `fwd`. Requests the controller answers itself, and invalid
+ * ones, have their response written to `out` and its last line left in
+ * `response`. Returns 1 if the request must instead be forwarded to the
+ * airport node, 0 otherwise. Listings, which are gathered from the nodes
+ * `fwd->node` to `fwd->last_node` in turn, include a TRACE of every node. */
+static int route_client_request(wbuf_t *out, char *buf, char *response, forward_t *fwd) {
+    metric_cmd_t cmd = METRIC_OTHER;
+
+    // Parsing logic
+    char request_type[MAXLINE];
+    int airport_num;
+    char rest_of_request[MAXLINE];
+
+    rest_of_request[0] = 0; // empty unless given; the rest need not be cleared
+    int num_parsed = sscanf(buf, "%s %d %[^\n]", request_type, &airport_num, rest_of_request);
+    if (num_parsed >= 1)
+        cmd = metrics_command(request_type);
+    fwd->cmd = cmd;
+    fwd->airport_num = -1;
+    fwd->listing_flags = 0;
 
-        while (1) {
-            ssize_t n = rio_readlineb(&rio_client, buf, MAXLINE);
-            if (n <= 0) {
-                break; // no input
+    // STATS with no airport: the controller's own metrics
+    if (num_parsed == 1 && strcmp(request_type, "STATS") == 0) {
+        write_controller_stats(out);
+        sprintf(response, "END\n");
+        wbuf_write(out, response, strlen(response));
+        return 0;
+    }
+
+    // TRACE with no airport: turns tracing on or off, or dumps every span
+    if (num_parsed == 1 && strcmp(request_type, "TRACE") == 0) {
+        char setting[MAXLINE];
+        if (sscanf(buf, "%*s %s", setting) != 1) {
+            // the controller's spans, then those of every node that is up
+            if ((fwd->node = next_available_node(0)) >= 0) {
+                fwd->last_node = ATC_INFO.num_nodes - 1;
+                fwd->listing_flags = LISTING_TRACE;
+                fwd->expected_lines = LISTING_LINES;
+                return 1;
             }
+            write_trace(out);
+            sprintf(response, "END\n");
+        } else if (strcmp(setting, "ON") == 0 || strcmp(setting, "OFF") == 0) {
+            trace_set_enabled(setting[1] == 'N');
+            sprintf(response, "TRACE %s\n", setting);
+        } else {
+            sprintf(response, "Error: Invalid request provided\n");
+        }
+        wbuf_write(out, response, strlen(response));
+        return 0;
+    }
 
-            // Parsing logic
-            char request_type[MAXLINE];
-            int airport_num;
-            char rest_of_request[MAXLINE] = {0}; // empty string
+    // LOGLEVEL with no airport: shows or sets the controller's log level
+    if (num_parsed == 1 && strcmp(request_type, "LOGLEVEL") == 0) {
+        char level_name[MAXLINE];
+        int level = log_level();
+        if (sscanf(buf, "%*s %s", level_name) == 1 &&
+            (level = log_parse_level(level_name)) < 0) {
+            sprintf(response, "Error: Invalid request provided\n");
+        } else {
+            log_set_level((log_level_t)level);
+            sprintf(response, "LOG LEVEL %s\n", log_level_name((log_level_t)level));
+        }
+        wbuf_write(out, response, strlen(response));
+        return 0;
+    }
 
-            int num_parsed = sscanf(buf, "%s %d %[^\n]", request_type, &airport_num, rest_of_request);
+    if (num_parsed < 2) {
+        sprintf(response, "Error: Invalid request provided\n");
+        wbuf_write(out, response, strlen(response));
+        return 0;
+    }
 
-            if (num_parsed < 2) {
-                sprintf(response, "Error: Invalid request provided\n");
-                rio_writen(connfd, response, strlen(response));
-                continue;
+    // Validation based on appropriate number of arguments
+    int valid_request = 1; // Flag for valid request
+    int expected_response_lines = 1; // Default
+    int gate_num = -1;
+
+    if (strcmp(request_type, "SCHEDULE") == 0) {
+        int plane_id, earliest_time, duration, fuel;
+        if (sscanf(rest_of_request, "%d %d %d %d", &plane_id, &earliest_time, &duration, &fuel) != 4) {
+            valid_request = 0;
+        }
+    } else if (strcmp(request_type, "TIME_STATUS") == 0) {
+        int start_idx, duration;
+        if (sscanf(rest_of_request, "%d %d %d", &gate_num, &start_idx, &duration) != 3) {
+            valid_request = 0;
+        } else {
+            expected_response_lines = duration + 1; 
+        }
+    } else if (strcmp(request_type, "PLANE_STATUS") == 0) {
+        int plane_id;
+        if (sscanf(rest_of_request, "%d", &plane_id) != 1) {
+            valid_request = 0;
+        }
+    } else if (strcmp(request_type, "STATS") != 0 && strcmp(request_type, "LOCKSTATS") != 0 &&
+               strcmp(request_type, "LOGLEVEL") != 0 && strcmp(request_type, "TRACE") != 0 &&
+               strcmp(request_type, "EXPORT") != 0) {
+        // Unknown command
+        valid_request = 0;
+    }
+
+    if (!valid_request) {
+        sprintf(response, "Error: Invalid request provided\n");
+        wbuf_write(out, response, strlen(response));
+        return 0;
+    }
+
+    // If airport_num doesn't exist
+    if (airport_num < 0 || airport_num >= ATC_INFO.num_airports) {
+        sprintf(response, "Error: Airport %d does not exist\n", airport_num);
+        wbuf_write(out, response, strlen(response));
+        return 0;
+    }
+    fwd->airport_num = airport_num;
+
+    // Fail fast while any node of the airport is being respawned
+    for (int shard = 0; shard < airport_shards(airport_num); shard++) {
+        if (!shard_node(airport_num, shard)->available) {
+            sprintf(response, "Error: Cannot connect to airport %d\n", airport_num);
+            wbuf_write(out, response, strlen(response));
+            return 0;
+        }
+    }
+
+    // A sharded airport's TIME_STATUS goes to the shard holding the gate, a
+    // listing to each shard in turn, and anything else to every shard at once.
+    // A gate outside the airport is left for the first shard to reject.
+    fwd->node = ATC_INFO.first_node[airport_num];
+    if (strcmp(request_type, "STATS") == 0 || strcmp(request_type, "LOCKSTATS") == 0 ||
+        strcmp(request_type, "TRACE") == 0 || strcmp(request_type, "EXPORT") == 0) {
+        fwd->last_node = ATC_INFO.first_node[airport_num + 1] - 1;
+        if (strcmp(request_type, "LOCKSTATS") == 0 &&
+            (strcmp(rest_of_request, "ON") == 0 || strcmp(rest_of_request, "OFF") == 0))
+            fwd->listing_flags = LISTING_FIRST_ONLY;
+        fwd->expected_lines = LISTING_LINES;
+        return 1;
+    }
+    if (airport_shards(airport_num) > 1) {
+        if (strcmp(request_type, "TIME_STATUS") != 0)
+            fwd->node = -1;
+        else
+            fwd->node += gate_shard(airport_num, gate_num);
+    }
+    fwd->expected_lines = expected_response_lines;
+    return 1;
+}
+
+/* Writes the line of `n` bytes sent to an airport node for `buf` into `dst`,
+ * which holds MAXLINE + 32 bytes: the request itself, prefixed with its trace
+ * id if the request is traced. Returns its length. */
+static size_t format_forward(char *dst, char *buf, ssize_t n) {
+    if (trace_request()) {
+        return (size_t)snprintf(dst, MAXLINE + 32, "#%lu %s",
+                                (unsigned long)trace_request(), buf);
+    }
+    memcpy(dst, buf, (size_t)n);
+    dst[n] = 0;
+    return (size_t)n;
+}
+
+/* Writes the PROBE asking a shard where the SCHEDULE in `request`, whose
+ * client line starts at `key_offset`, would fit into `dst`, which holds
+ * MAXLINE + 32 bytes. Returns its length. */
+static size_t format_probe(char *dst, const char *request, size_t key_offset) {
+    const char *cmd = strstr(request + key_offset, "SCHEDULE");
+    size_t prefix = (size_t)(cmd - request);
+    memcpy(dst, request, prefix);
+    return prefix + (size_t)snprintf(dst + prefix, MAXLINE + 32 - prefix, "PROBE%s",
+                                     cmd + strlen("SCHEDULE"));
+}
+
+/* Returns 1 if `line` says a node has no room for a flight. */
+static int cannot_schedule(const char *line) {
+    return strncmp(line, "Error: Cannot schedule", 22) == 0;
+}
+
+/* Chooses the answer to a request fanned out to every shard of airport
+ * `fwd->airport_num`, from each shard's response line in `replies`, which is
+ * empty for a shard that could not be reached. The answer of the lowest shard
+ * that has one wins, as gates are searched in order by an unsharded airport.
+ * A SCHEDULE booked by the first shard is done; otherwise it is to be
+ * committed to the first shard from `first` whose PROBE found room. Shards
+ * only fill up, so those that had none still have none.
+ * Returns that shard, or -1 once the answer has been left in `response`. */
+static int resolve_fanout(forward_t *fwd, char (*replies)[MAXLINE], int first,
+                          char *response) {
+    char *answer = replies[0];
+    for (int shard = first; shard < airport_shards(fwd->airport_num); shard++) {
+        char *reply = replies[shard];
+        if (!reply[0]) {
+            sprintf(response, "Error: Cannot connect to airport %d\n", fwd->airport_num);
+            return -1;
+        }
+        if (fwd->cmd == METRIC_SCHEDULE) {
+            if (shard > 0 && strncmp(reply, "FITS ", 5) == 0)
+                return shard;
+            if (shard == 0 && !cannot_schedule(reply))
+                break;
+        } else if (fwd->cmd == METRIC_PLANE_STATUS) {
+            if (strncmp(reply, "PLANE ", 6) == 0 && strstr(reply, " not scheduled ") == NULL) {
+                answer = reply;
+                break;
             }
+        } else if (strncmp(reply, "Error:", 6) == 0) {
+            answer = reply;
+            break;
+        }
+    }
+    strcpy(response, answer);
+    return -1;
+}
 
-            // Validation based on appropriate number of arguments
-            int valid_request = 1; // Flag for valid request
-            int expected_response_lines = 1; // Default
+/* Writes the APPLY copying the booking of a SCHEDULED `response` from
+ * airport `airport_num` into `dst`, which holds MAXLINE + 32 bytes, prefixed
+ * with the trace id like the request. Returns the node holding the booking if
+ * it has replicas to copy it to, or NULL. */
+static node_info_t *format_apply(char *dst, size_t *len, int airport_num,
+                                 const char *response) {
+    int plane_id, gate_num, start_hour, start_mins, end_hour, end_mins;
+    char apply[MAXLINE];
+    node_info_t *node;
 
-            if (strcmp(request_type, "SCHEDULE") == 0) {
-                int plane_id, earliest_time, duration, fuel;
-                if (sscanf(rest_of_request, "%d %d %d %d", &plane_id, &earliest_time, &duration, &fuel) != 4) {
-                    valid_request = 0;
-                }
-            } else if (strcmp(request_type, "TIME_STATUS") == 0) {
-                int gate_num, start_idx, duration;
-                if (sscanf(rest_of_request, "%d %d %d", &gate_num, &start_idx, &duration) != 3) {
-                    valid_request = 0;
-                } else {
-                    expected_response_lines = duration + 1; 
-                }
-            } else if (strcmp(request_type, "PLANE_STATUS") == 0) {
-                int plane_id;
-                if (sscanf(rest_of_request, "%d", &plane_id) != 1) {
-                    valid_request = 0;
+    if (sscanf(response, "SCHEDULED %d at GATE %d: %d:%d-%d:%d", &plane_id, &gate_num,
+               &start_hour, &start_mins, &end_hour, &end_mins) != 6)
+        return NULL;
+    node = shard_node(airport_num, gate_shard(airport_num, gate_num));
+    if (node->num_replicas == 0)
+        return NULL;
+    int n = snprintf(apply, MAXLINE, "APPLY %d %d %d %d %d\n", airport_num, plane_id, gate_num,
+                     HOUR_MINS_TO_IDX(start_hour, start_mins),
+                     HOUR_MINS_TO_IDX(end_hour, end_mins));
+    *len = format_forward(dst, apply, n);
+    return node;
+}
+
+/* Answers a read from the response cache, if it holds a current response for
+ * the request line `buf`. Returns 1 if it did. */
+static int serve_from_cache(wbuf_t *out, char *buf, char *response, forward_t *fwd) {
+    if (fwd->cmd != METRIC_PLANE_STATUS && fwd->cmd != METRIC_TIME_STATUS)
+        return 0;
+    uint64_t begin = metrics_now_ns();
+    int hit = cache_lookup(fwd->airport_num, buf, out, response);
+    metrics_record_cache(hit);
+    if (hit)
+        trace_span("cache_hit", begin, metrics_now_ns());
+    return hit;
+}
+
+/* Updates the response cache after forwarding the request line `buf`: a
+ * SCHEDULE invalidates the airport's responses, while the response to a read,
+ * which starts at `start` in `out`, is cached if it is complete. `version` is
+ * the airport's schedule version from before the forward. */
+static void update_cache(forward_t *fwd, char *buf, uint64_t version, wbuf_t *out,
+                         size_t start, int complete) {
+    if (fwd->cmd == METRIC_SCHEDULE) {
+        cache_invalidate(fwd->airport_num);
+    } else if (complete && (fwd->cmd == METRIC_PLANE_STATUS || fwd->cmd == METRIC_TIME_STATUS)) {
+        cache_store(fwd->airport_num, buf, version, out->wb_buf + start, out->wb_len - start);
+    }
+}
+
+/* Gives a request line read from a client its id, which the calling thread's
+ * log records and trace spans carry until `end_client_request`. Returns its
+ * trace id, or 0 if it is not traced. */
+static uint64_t begin_client_request(char *buf, uint64_t *request_id) {
+    *request_id = __atomic_add_fetch(&NEXT_REQUEST_ID, 1, __ATOMIC_RELAXED);
+    uint64_t trace_id = trace_enabled() ? *request_id : 0;
+    log_set_request_id(*request_id);
+    trace_set_request(trace_id);
+    LOG("request %s", buf);
+    return trace_id;
+}
+
+/* Records the metrics, span and log record of a request that began at
+ * `begin`, whose response ended with `response`. */
+static void end_client_request(forward_t *fwd, char *response, uint64_t begin) {
+    uint64_t end = metrics_now_ns();
+    metrics_record_request(fwd->cmd, fwd->airport_num, strncmp(response, "Error:", 6) == 0,
+                           end - begin);
+    trace_span("request", begin, end);
+    LOG("response %.*s (%lu us)", (int)strcspn(response, "\n"), response,
+        (unsigned long)((end - begin) / 1000));
+    log_set_request_id(0);
+    trace_set_request(0);
+}
+
+/* Sets the epoll events watched on the client side of `conn` to `events`. */
+static void watch_client(client_conn_t *conn, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.ptr = conn};
+    if (conn->events != events) {
+        epoll_ctl(WORKER_EPOLL, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+}
+
+/* Watches the airport side of `conn` for `events`, adding it if `op` is
+ * EPOLL_CTL_ADD. */
+static void watch_airport(client_conn_t *conn, int op, uint32_t events) {
+    struct epoll_event ev = {.events = events};
+    ev.data.u64 = (uint64_t)(uintptr_t)conn | AIRPORT_TAG;
+    epoll_ctl(WORKER_EPOLL, op, conn->airport_fd, &ev);
+}
+
+static void close_conn(client_conn_t *conn) {
+    if (conn->state == CONN_SUBSCRIBED) {
+        if (conn->prev_subscriber)
+            conn->prev_subscriber->next_subscriber = conn->next_subscriber;
+        else
+            SUBSCRIBERS = conn->next_subscriber;
+        if (conn->next_subscriber)
+            conn->next_subscriber->prev_subscriber = conn->prev_subscriber;
+    }
+    if (conn->airport_fd >= 0) {
+        close(conn->airport_fd);
+        __atomic_sub_fetch(&FORWARDS_IN_FLIGHT, 1, __ATOMIC_RELAXED);
+    }
+    for (int shard = 0; conn->fanout && shard < MAX_SHARDS; shard++) {
+        if (conn->fanout->legs[shard].fd >= 0) {
+            close(conn->fanout->legs[shard].fd);
+            conn->fanout->legs[shard].fd = -1;
+            __atomic_sub_fetch(&FORWARDS_IN_FLIGHT, 1, __ATOMIC_RELAXED);
+        }
+    }
+    close(conn->fd);
+    wbuf_free(&conn->out);
+    conn->closed = 1;
+    conn->next_closed = CLOSED_CONNS;
+    CLOSED_CONNS = conn;
+    __atomic_sub_fetch(&CLIENT_CONNECTIONS, 1, __ATOMIC_RELAXED);
+}
+
+/* Makes the calling thread's log records and spans belong to the request of
+ * `conn`, as several requests take turns on each worker. */
+static void resume_request(client_conn_t *conn) {
+    log_set_request_id(conn->request_id);
+    trace_set_request(conn->trace_id);
+}
+
+/* Sends as much of the response of `conn` as the socket takes, waiting for
+ * it to become writable if needed. Returns 1 once it has all been sent. */
+static int send_response(client_conn_t *conn) {
+    while (!conn->broken && conn->out_sent < conn->out.wb_len) {
+        ssize_t n = send(conn->fd, conn->out.wb_buf + conn->out_sent,
+                         conn->out.wb_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EAGAIN) {
+            watch_client(conn, EPOLLOUT);
+            return 0;
+        } else if (n < 0 && errno != EINTR) {
+            conn->broken = 1;
+        } else if (n > 0) {
+            conn->out_sent += (size_t)n;
+        }
+    }
+    conn->out.wb_len = 0;
+    conn->out_sent = 0;
+    return 1;
+}
+
+/* Finishes the request of `conn`, sending its response with one write. */
+static void finish_request(client_conn_t *conn) {
+    end_client_request(&conn->fwd, conn->response, conn->begin);
+    if (record_enabled())
+        record_request(conn->conn_id, conn->begin, conn->request + conn->key_offset,
+                       conn->request_len - conn->key_offset, conn->out.wb_buf,
+                       conn->out.wb_len);
+    conn->state = CONN_REPLY;
+    if (send_response(conn))
+        conn->state = CONN_IDLE;
+}
+
+static void start_forward(client_conn_t *conn);
+static int start_apply(client_conn_t *conn);
+
+/* Returns the node whose part of the listing of `conn` follows the current
+ * node's, or -1 if that was the last. */
+static int next_listing_node(client_conn_t *conn) {
+    int idx = conn->fwd.node + 1;
+    if (conn->fwd.listing_flags & LISTING_TRACE)
+        idx = next_available_node(idx);
+    return idx >= 0 && idx <= conn->fwd.last_node ? idx : -1;
+}
+
+/* Returns 1 if the listing of `conn` has reached the END of a node's part
+ * and the next node's is to follow. */
+static int listing_continues(client_conn_t *conn) {
+    return conn->fwd.expected_lines == LISTING_LINES && strcmp(conn->response, "END\n") == 0 &&
+           next_listing_node(conn) >= 0;
+}
+
+/* Ends the forward of `conn`, whose response is `complete` or was cut short. */
+static void finish_forward(client_conn_t *conn, int complete) {
+    close(conn->airport_fd);
+    conn->airport_fd = -1;
+    __atomic_sub_fetch(&FORWARDS_IN_FLIGHT, 1, __ATOMIC_RELAXED);
+    if (complete && listing_continues(conn)) {
+        conn->listing_shard++;
+        conn->fwd.node = next_listing_node(conn);
+        start_forward(conn);
+        return;
+    }
+    if (conn->commit_shard > 0 && cannot_schedule(conn->response)) {
+        // another booking took the room the shard's PROBE found first
+        int shard = resolve_fanout(&conn->fwd, conn->fanout->replies,
+                                   conn->commit_shard + 1, conn->response);
+        conn->out.wb_len = conn->out_start;
+        if (shard >= 0) {
+            conn->commit_shard = shard;
+            conn->fwd.node = ATC_INFO.first_node[conn->fwd.airport_num] + shard;
+            start_forward(conn);
+            return;
+        }
+        wbuf_write(&conn->out, conn->response, strlen(conn->response));
+        complete = strncmp(conn->response, "Error: Cannot connect", 21) != 0;
+    }
+    if (complete && start_apply(conn))
+        return;
+    update_cache(&conn->fwd, conn->request + conn->key_offset, conn->cache_version,
+                 &conn->out, conn->out_start, complete);
+    finish_request(conn);
+}
+
+/* Reads what the client has sent into the input buffer of `conn`. */
+static void read_client(client_conn_t *conn) {
+    while (!conn->eof && conn->in_len < sizeof(conn->in)) {
+        ssize_t n = read(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+        if (n > 0) {
+            conn->in_len += (size_t)n;
+        } else if (n == 0) {
+            conn->eof = 1;
+        } else if (errno == EAGAIN) {
+            return;
+        } else if (errno != EINTR) {
+            conn->broken = conn->eof = 1;
+        }
+    }
+}
+
+/* Follows node `arg`'s schedule changes for as long as the controller
+ * runs, republishing each to the controller's broadcast ring. Reconnects
+ * after the node restarts; changes made in between are not seen. */
+static void *feed_thread(void *arg) {
+    node_info_t *node = &ATC_INFO.airport_nodes[(intptr_t)arg];
+    int idx = node->id;
+    char line[MAXLINE];
+    int fd, plane_id, gate, start, end;
+    unsigned long lost;
+    rio_t rio;
+
+    while (1) {
+        if (node->available && (fd = open_clientfd_addr(&node->addr)) >= 0) {
+            rio_writen(fd, "SUBSCRIBE\n", 10);
+            rio_readinitb(&rio, fd);
+            while (rio_readlineb(&rio, line, MAXLINE) > 0) {
+                if (sscanf(line, "EVENT %*u %d %d %d %d", &plane_id, &gate, &start, &end) == 4) {
+                    broadcast_publish(idx, plane_id, gate, start, end);
+                } else if (sscanf(line, "LOST %lu", &lost) == 1) {
+                    LOG_WARN("Feed of airport %d lost %lu schedule changes", idx, lost);
+                } else if (strncmp(line, "Error:", 6) == 0) {
+                    LOG_WARN("Airport %d refused the feed: %.*s", idx,
+                             (int)strcspn(line, "\n"), line);
+                    break;
                 }
-            } else {
-                // Unknown command
-                valid_request = 0;
             }
+            close(fd);
+        }
+        usleep(FEED_RETRY_MS * 1000);
+    }
+    return NULL;
+}
 
-            if (!valid_request) {
-                sprintf(response, "Error: Invalid request provided\n");
-                rio_writen(connfd, response, strlen(response));
-                continue;
-            }
+/* Starts a feed from every airport node, on the first subscription. */
+static void start_feeds(void) {
+    if (__atomic_exchange_n(&FEEDS_STARTED, 1, __ATOMIC_ACQ_REL))
+        return;
+    for (int idx = 0; idx < ATC_INFO.num_nodes; idx++) {
+        pthread_t feed;
+        if (pthread_create(&feed, NULL, feed_thread, (void *)(intptr_t)idx) == 0)
+            pthread_detach(feed);
+    }
+}
 
-            // If airport_num doesn't exist
-            if (airport_num < 0 || airport_num >= ATC_INFO.num_airports) {
-                sprintf(response, "Error: Airport %d does not exist\n", airport_num);
-                rio_writen(connfd, response, strlen(response));
+/* Writes the schedule changes `conn` has not seen yet and sends them, as
+ * `EVENT <seq> AIRPORT <a> PLANE <p> GATE <g>: <start>-<end>` lines. A
+ * subscriber too slow to keep up with the ring is sent `LOST <count>`. */
+static void push_events(client_conn_t *conn) {
+    schedule_event_t events[SUBSCRIBE_BATCH];
+    char line[MAXLINE];
+    uint64_t lost;
+    int count, len;
+
+    do {
+        if (!send_response(conn))
+            return; // until the socket is writable again
+        count = broadcast_read(&conn->cursor, events, SUBSCRIBE_BATCH, &lost);
+        if (lost > 0) {
+            len = sprintf(line, "LOST %lu\n", (unsigned long)lost);
+            wbuf_write(&conn->out, line, (size_t)len);
+        }
+        for (int i = 0; i < count; i++) {
+            schedule_event_t *event = &events[i];
+            if (conn->subscribed_airport >= 0 && event->airport != conn->subscribed_airport)
                 continue;
+            len = sprintf(line, "EVENT %lu AIRPORT %d PLANE %d GATE %d: %02d:%02d-%02d:%02d\n",
+                          (unsigned long)event->seq, event->airport, event->plane_id,
+                          event->gate, IDX_TO_HOUR(event->start),
+                          (int)IDX_TO_MINS(event->start), IDX_TO_HOUR(event->end),
+                          (int)IDX_TO_MINS(event->end));
+            wbuf_write(&conn->out, line, (size_t)len);
+        }
+    } while (count > 0 || conn->out.wb_len > 0);
+
+    if (conn->broken)
+        close_conn(conn);
+    else
+        watch_client(conn, EPOLLIN);
+}
+
+/* Handles SUBSCRIBE [airport]: acknowledges it with SUBSCRIBED, then keeps
+ * the connection open to stream schedule changes to it. */
+static void start_subscription(client_conn_t *conn, char *buf) {
+    int airport_num = -1;
+
+    conn->fwd.cmd = METRIC_OTHER;
+    conn->fwd.airport_num = -1;
+    // nodes served with io_uring cannot stream their changes to the feeds
+    if (uring_server_enabled()) {
+        sprintf(conn->response, "Error: SUBSCRIBE is not supported with -u\n");
+        wbuf_write(&conn->out, conn->response, strlen(conn->response));
+        finish_request(conn);
+        return;
+    }
+    if (sscanf(buf, "%*s %d", &airport_num) == 1 &&
+        (airport_num < 0 || airport_num >= ATC_INFO.num_airports)) {
+        sprintf(conn->response, "Error: Airport %d does not exist\n", airport_num);
+        wbuf_write(&conn->out, conn->response, strlen(conn->response));
+        finish_request(conn);
+        return;
+    }
+    start_feeds();
+    conn->subscribed_airport = airport_num;
+    conn->cursor = broadcast_head();
+    sprintf(conn->response, "SUBSCRIBED\n");
+    wbuf_write(&conn->out, conn->response, strlen(conn->response));
+    end_client_request(&conn->fwd, conn->response, conn->begin);
+
+    conn->state = CONN_SUBSCRIBED;
+    conn->prev_subscriber = NULL;
+    conn->next_subscriber = SUBSCRIBERS;
+    if (SUBSCRIBERS)
+        SUBSCRIBERS->prev_subscriber = conn;
+    SUBSCRIBERS = conn;
+    push_events(conn);
+}
+
+/* Handles an event on a subscriber's socket: anything it sends is ignored,
+ * and its close ends the subscription. */
+static void serve_subscriber(client_conn_t *conn, uint32_t events) {
+    if (events & EPOLLIN) {
+        read_client(conn);
+        conn->in_len = 0;
+        if (conn->eof) {
+            close_conn(conn);
+            return;
+        }
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        close_conn(conn);
+        return;
+    }
+    push_events(conn);
+}
+
+/* Starts connecting to the node `conn->fwd.node`, or a replica of it, to
+ * forward the request. */
+static void start_forward(client_conn_t *conn) {
+    node_info_t *node = conn->target = forward_target(&conn->fwd);
+    conn->stage_at = metrics_now_ns();
+    conn->request_sent = 0;
+    conn->reply_len = 0;
+    conn->lines_left = -1; // until the first line says how many follow
+    while ((conn->airport_fd = open_clientfd_nb(&node->addr)) < 0 && node->replica >= 0) {
+        drop_replica(node);
+        node = conn->target = forward_target(&conn->fwd);
+    }
+    if (conn->airport_fd < 0) {
+        // named by the node, as a TRACE of every node names no airport
+        LOG_WARN("Cannot connect to airport %d on %s:%d", node->id, node->host, node->port);
+        sprintf(conn->response, "Error: Cannot connect to airport %d\n", node->id);
+        wbuf_write(&conn->out, conn->response, strlen(conn->response));
+        finish_request(conn);
+        return;
+    }
+    __atomic_add_fetch(&FORWARDS_IN_FLIGHT, 1, __ATOMIC_RELAXED);
+    conn->state = CONN_CONNECT;
+    watch_airport(conn, EPOLL_CTL_ADD, EPOLLOUT);
+    // only failures of the client socket are of interest until the response
+    watch_client(conn, 0);
+}
+
+/* Finishes a SCHEDULE once every replica it was applied to has answered,
+ * dropping those that did not apply it. */
+static void finish_apply(client_conn_t *conn) {
+    fanout_t *fanout = conn->fanout;
+    node_info_t *node = fanout->apply_node;
+
+    trace_span("replicate", conn->stage_at, metrics_now_ns());
+    for (int idx = 0; idx < node->num_replicas; idx++) {
+        if (node->replicas[idx].available && strncmp(fanout->replies[idx], "APPLIED ", 8) != 0)
+            drop_replica(&node->replicas[idx]);
+    }
+    fanout->apply_node = NULL;
+    update_cache(&conn->fwd, conn->request + conn->key_offset, conn->cache_version,
+                 &conn->out, conn->out_start, 1);
+    finish_request(conn);
+}
+
+/* Answers a fanned-out request once every shard has, or starts committing a
+ * SCHEDULE to the shard chosen by `resolve_fanout`. */
+static void finish_fanout(client_conn_t *conn) {
+    uint64_t now = metrics_now_ns();
+    int shard;
+
+    if (conn->fanout->apply_node != NULL) {
+        finish_apply(conn);
+        return;
+    }
+    trace_span("fanout", conn->stage_at, now);
+    if ((shard = resolve_fanout(&conn->fwd, conn->fanout->replies, 0, conn->response)) >= 0) {
+        conn->commit_shard = shard;
+        conn->fwd.node = ATC_INFO.first_node[conn->fwd.airport_num] + shard;
+        start_forward(conn);
+        return;
+    }
+    wbuf_write(&conn->out, conn->response, strlen(conn->response));
+    metrics_record_forward(conn->fwd.airport_num, now - conn->forward_begin);
+    if (start_apply(conn))
+        return;
+    update_cache(&conn->fwd, conn->request + conn->key_offset, conn->cache_version,
+                 &conn->out, conn->out_start,
+                 strncmp(conn->response, "Error: Cannot connect", 21) != 0);
+    finish_request(conn);
+}
+
+/* Ends a leg of the fanned-out request of `conn`, with its response line if
+ * it was `answered`, finishing the request once it was the last. */
+static void end_leg(shard_leg_t *leg, int answered) {
+    fanout_t *fanout = leg->conn->fanout;
+    char *reply = fanout->replies[leg - fanout->legs];
+
+    close(leg->fd);
+    leg->fd = -1;
+    __atomic_sub_fetch(&FORWARDS_IN_FLIGHT, 1, __ATOMIC_RELAXED);
+    if (!answered) {
+        LOG_WARN("%s %d of airport %d did not respond",
+                 fanout->apply_node ? "Replica" : "Shard", (int)(leg - fanout->legs),
+                 leg->conn->fwd.airport_num);
+        reply[0] = 0;
+    }
+    if (--fanout->pending == 0)
+        finish_fanout(leg->conn);
+}
+
+/* Advances a leg of a fanned-out request once its socket is ready. */
+static void advance_leg(shard_leg_t *leg) {
+    client_conn_t *conn = leg->conn;
+    fanout_t *fanout = conn->fanout;
+    int shard = (int)(leg - fanout->legs);
+    char *reply = fanout->replies[shard];
+    int probe = fanout->apply_node != NULL || (shard > 0 && conn->fwd.cmd == METRIC_SCHEDULE);
+    char *request = probe ? fanout->probe : conn->request;
+    size_t len = probe ? fanout->probe_len : conn->request_len;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    ssize_t n;
+
+    if (leg->fd < 0 || conn->state != CONN_FANOUT)
+        return; // left over from a leg that has ended
+    resume_request(conn);
+    if (!leg->connected) {
+        struct sockaddr_storage peer;
+        socklen_t peerlen = sizeof(peer);
+        getsockopt(leg->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err == 0 && getpeername(leg->fd, (SA *)&peer, &peerlen) < 0)
+            return; // a stale event: still connecting
+        if (err != 0) {
+            end_leg(leg, 0);
+            return;
+        }
+        leg->connected = 1;
+    }
+
+    if (leg->sent < len) {
+        while (leg->sent < len) {
+            n = send(leg->fd, request + leg->sent, len - leg->sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EAGAIN) {
+                return;
+            } else if (n < 0 && errno != EINTR) {
+                end_leg(leg, 0);
+                return;
+            } else if (n > 0) {
+                leg->sent += (size_t)n;
             }
+        }
+        struct epoll_event ev = {.events = EPOLLIN};
+        ev.data.u64 = (uint64_t)(uintptr_t)leg | SHARD_TAG;
+        epoll_ctl(WORKER_EPOLL, EPOLL_CTL_MOD, leg->fd, &ev);
+    }
 
-            // Get the port number of the airport node
-            int airport_port = ATC_INFO.airport_nodes[airport_num].port;
-            char port_str[PORT_STRLEN];
-            int airport_fd;
+    while (1) {
+        n = read(leg->fd, reply + leg->reply_len, MAXLINE - 1 - leg->reply_len);
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            end_leg(leg, 0);
+            return;
+        }
+        leg->reply_len += (size_t)n;
+        reply[leg->reply_len] = 0;
+        char *newline = memchr(reply, '\n', leg->reply_len);
+        if (newline != NULL || leg->reply_len == MAXLINE - 1) {
+            if (newline != NULL)
+                newline[1] = 0;
+            end_leg(leg, 1);
+            return;
+        }
+    }
+}
+
+/* Readies the fanout of `conn` for `count` legs, allocating it on first use,
+ * and waits on them. Returns NULL if it could not be allocated. */
+static fanout_t *begin_fanout(client_conn_t *conn, int count) {
+    fanout_t *fanout = conn->fanout;
+
+    if (fanout == NULL && (fanout = conn->fanout = slab_alloc(&FANOUT_SLAB)) == NULL)
+        return NULL;
+    conn->stage_at = metrics_now_ns();
+    conn->state = CONN_FANOUT;
+    // only failures of the client socket are of interest until the response
+    watch_client(conn, 0);
+    fanout->pending = count;
+    fanout->apply_node = NULL;
+    for (int idx = 0; idx < MAX_SHARDS; idx++) {
+        fanout->legs[idx] = (shard_leg_t){.conn = conn, .fd = -1};
+        fanout->replies[idx][0] = 0;
+    }
+    return fanout;
+}
+
+/* Starts leg `idx` of the fanout of `conn`, connecting to `node`. A leg that
+ * fails at once is not waited on. */
+static void start_leg(client_conn_t *conn, int idx, node_info_t *node) {
+    shard_leg_t *leg = &conn->fanout->legs[idx];
+    struct epoll_event ev = {.events = EPOLLOUT};
 
-            snprintf(port_str, PORT_STRLEN, "%d", airport_port);
+    if ((leg->fd = open_clientfd_nb(&node->addr)) < 0) {
+        conn->fanout->pending--;
+        return;
+    }
+    __atomic_add_fetch(&FORWARDS_IN_FLIGHT, 1, __ATOMIC_RELAXED);
+    ev.data.u64 = (uint64_t)(uintptr_t)leg | SHARD_TAG;
+    epoll_ctl(WORKER_EPOLL, EPOLL_CTL_ADD, leg->fd, &ev);
+}
+
+/* Starts sending the request of `conn` to every shard of its airport at once. */
+static void start_fanout(client_conn_t *conn) {
+    int num_shards = airport_shards(conn->fwd.airport_num);
+    fanout_t *fanout;
+
+    if ((fanout = begin_fanout(conn, num_shards)) == NULL) {
+        sprintf(conn->response, "Error: Cannot connect to airport %d\n", conn->fwd.airport_num);
+        wbuf_write(&conn->out, conn->response, strlen(conn->response));
+        finish_request(conn);
+        return;
+    }
+    if (conn->fwd.cmd == METRIC_SCHEDULE)
+        fanout->probe_len = format_probe(fanout->probe, conn->request, conn->key_offset);
+    for (int shard = 0; shard < num_shards; shard++)
+        start_leg(conn, shard, shard_node(conn->fwd.airport_num, shard));
+    if (fanout->pending == 0)
+        finish_fanout(conn);
+}
 
-            if ((airport_fd = open_clientfd("localhost", port_str)) < 0) {
-                sprintf(response, "Error: Cannot connect to airport %d\n", airport_num);
-                rio_writen(connfd, response, strlen(response));
+/* Starts applying the booking a SCHEDULE of `conn` has just made to every
+ * replica of the node that made it, which are still in sync. Returns 1 if it
+ * did, in which case the request is finished by `finish_apply`. */
+static int start_apply(client_conn_t *conn) {
+    char apply[MAXLINE + 32];
+    node_info_t *node;
+    fanout_t *fanout;
+    size_t len;
+
+    if (conn->fwd.cmd != METRIC_SCHEDULE ||
+        (node = format_apply(apply, &len, conn->fwd.airport_num, conn->response)) == NULL)
+        return 0;
+    if ((fanout = begin_fanout(conn, node->num_replicas)) == NULL) {
+        // the replicas miss this booking
+        for (int idx = 0; idx < node->num_replicas; idx++)
+            drop_replica(&node->replicas[idx]);
+        return 0;
+    }
+    memcpy(fanout->probe, apply, len + 1);
+    fanout->probe_len = len;
+    fanout->apply_node = node;
+    for (int idx = 0; idx < node->num_replicas; idx++) {
+        if (node->replicas[idx].available)
+            start_leg(conn, idx, &node->replicas[idx]);
+        else
+            fanout->pending--;
+    }
+    if (fanout->pending == 0)
+        finish_apply(conn);
+    return 1;
+}
+
+/* Starts handling the request line `buf` of `n` bytes. Requests the
+ * controller answers itself are finished at once; others start connecting to
+ * their airport node. */
+static void start_request(client_conn_t *conn, char *buf, ssize_t n) {
+    conn->begin = metrics_now_ns();
+    conn->trace_id = begin_client_request(buf, &conn->request_id);
+    conn->response[0] = 0;
+    if (record_enabled()) {
+        // kept for the record file, as `buf` is gone by the time a
+        // forwarded request finishes; a forward rewrites it with its prefix
+        memcpy(conn->request, buf, (size_t)n + 1);
+        conn->request_len = (size_t)n;
+        conn->key_offset = 0;
+    }
+    if (!admission_take(conn->client_key)) {
+        reject_busy(&conn->out, conn->response, &conn->fwd, METRIC_REJECT_RATE);
+        finish_request(conn);
+        return;
+    }
+    if (broadcast_is_subscribe(buf)) {
+        start_subscription(conn, buf);
+        return;
+    }
+    if (!route_client_request(&conn->out, buf, conn->response, &conn->fwd) ||
+        serve_from_cache(&conn->out, buf, conn->response, &conn->fwd)) {
+        finish_request(conn);
+        return;
+    }
+    if (MAX_IN_FLIGHT > 0 && forwards_in_flight() >= MAX_IN_FLIGHT &&
+        request_lane(buf) != LANE_URGENT) {
+        // shed load while the nodes catch up, rather than queueing behind
+        // them; a low-fuel plane is still let through
+        reject_busy(&conn->out, conn->response, &conn->fwd, METRIC_REJECT_OVERLOAD);
+        finish_request(conn);
+        return;
+    }
+
+    if (conn->fwd.listing_flags & LISTING_TRACE)
+        write_trace_head(&conn->out);
+    conn->forward_begin = metrics_now_ns();
+    conn->cache_version = cache_version(conn->fwd.airport_num);
+    conn->out_start = conn->out.wb_len;
+    conn->request_len = format_forward(conn->request, buf, n);
+    conn->key_offset = conn->request_len - (size_t)n;
+    conn->commit_shard = -1;
+    conn->listing_shard = 0;
+    if (conn->fwd.node >= 0)
+        start_forward(conn);
+    else
+        start_fanout(conn);
+}
+
+/* Handles every complete request line the client has sent, until one has to
+ * wait on an airport node or the client's socket. */
+static void advance_client(client_conn_t *conn) {
+    char buf[MAXLINE];
+    size_t n;
+
+    while (conn->state == CONN_IDLE) {
+        char *newline = memchr(conn->in, '\n', conn->in_len);
+        if (newline != NULL) {
+            n = (size_t)(newline - conn->in) + 1;
+        } else if (conn->in_len >= MAXLINE - 1 || (conn->eof && conn->in_len > 0)) {
+            n = conn->in_len < MAXLINE - 1 ? conn->in_len : MAXLINE - 1;
+        } else if (conn->eof || conn->broken) {
+            close_conn(conn);
+            return;
+        } else {
+            watch_client(conn, EPOLLIN);
+            return;
+        }
+        // longer lines are split, as by rio_readlineb
+        if (n > MAXLINE - 1)
+            n = MAXLINE - 1;
+        memcpy(buf, conn->in, n);
+        buf[n] = 0;
+        conn->in_len -= n;
+        memmove(conn->in, conn->in + n, conn->in_len);
+        start_request(conn, buf, (ssize_t)n);
+    }
+}
+
+/* Relays the complete lines of the airport node's response that have been
+ * received, returning 1 once the whole response has been. */
+static int relay_reply(client_conn_t *conn) {
+    char *line = conn->reply;
+    size_t left = conn->reply_len, n;
+    int done = 0;
+
+    while (!done && left > 0) {
+        char *newline = memchr(line, '\n', left);
+        if (newline != NULL) {
+            n = (size_t)(newline - line) + 1;
+        } else if (left >= MAXLINE - 1) {
+            n = left;
+        } else {
+            break;
+        }
+        memcpy(conn->response, line, n);
+        conn->response[n] = 0;
+        line += n;
+        left -= n;
+
+        if (conn->fwd.expected_lines == LISTING_LINES) {
+            // a node's part runs up to END, which is only relayed after the
+            // last node's; later parts add their lines without comments
+            if (strcmp(conn->response, "END\n") != 0 &&
+                strncmp(conn->response, "Error:", 6) != 0) {
+                if (conn->listing_shard == 0 ||
+                    (conn->response[0] != '#' &&
+                     !(conn->fwd.listing_flags & LISTING_FIRST_ONLY)))
+                    wbuf_write(&conn->out, conn->response, n);
+                continue;
+            }
+            if (!listing_continues(conn)) {
+                if ((conn->fwd.listing_flags & LISTING_TRACE) &&
+                    strcmp(conn->response, "END\n") == 0)
+                    wbuf_write(&conn->out, TRACE_TAIL, sizeof(TRACE_TAIL) - 1);
+                wbuf_write(&conn->out, conn->response, n);
+            }
+        } else {
+            wbuf_write(&conn->out, conn->response, n);
+            if (conn->lines_left < 0) {
+                // the first line: an error, or the first of the expected lines
+                uint64_t now = metrics_now_ns();
+                trace_span("airport_wait", conn->stage_at, now);
+                conn->stage_at = now;
+                conn->lines_left = strncmp(conn->response, "Error:", 6) == 0
+                                       ? 0
+                                       : conn->fwd.expected_lines - 1;
+                if (conn->lines_left > 0)
+                    continue;
+            } else if (--conn->lines_left > 0) {
                 continue;
             }
+        }
+        uint64_t relayed_at = metrics_now_ns();
+        if (strncmp(conn->response, "Error:", 6) != 0)
+            trace_span("relay", conn->stage_at, relayed_at);
+        metrics_record_forward(conn->fwd.airport_num, relayed_at - conn->forward_begin);
+        done = 1;
+    }
+    memmove(conn->reply, line, left);
+    conn->reply_len = left;
+    return done;
+}
 
-            // forwarding the request to the airport node
-            rio_writen(airport_fd, buf, n);
+/* Advances the forward of `conn` once its airport socket is ready. */
+static void advance_airport(client_conn_t *conn) {
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    ssize_t n;
 
-            // initialising Rio for airport_fd
-            rio_readinitb(&rio_airport, airport_fd);
+    if (conn->state != CONN_CONNECT && conn->state != CONN_FORWARD &&
+        conn->state != CONN_AWAIT)
+        return; // left over from a forward that has ended
+    resume_request(conn);
+    if (conn->state == CONN_CONNECT) {
+        struct sockaddr_storage peer;
+        socklen_t peerlen = sizeof(peer);
+        getsockopt(conn->airport_fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err == 0 && getpeername(conn->airport_fd, (SA *)&peer, &peerlen) < 0)
+            return; // a stale event: still connecting
+        if (err != 0 && conn->target->replica >= 0) {
+            // try another replica, or the node itself
+            drop_replica(conn->target);
+            close(conn->airport_fd);
+            conn->airport_fd = -1;
+            __atomic_sub_fetch(&FORWARDS_IN_FLIGHT, 1, __ATOMIC_RELAXED);
+            start_forward(conn);
+            return;
+        }
+        if (err != 0) {
+            LOG_WARN("Cannot connect to airport %d on %s:%d", conn->target->id,
+                     conn->target->host, conn->target->port);
+            sprintf(conn->response, "Error: Cannot connect to airport %d\n",
+                    conn->target->id);
+            wbuf_write(&conn->out, conn->response, strlen(conn->response));
+            finish_forward(conn, 0);
+            return;
+        }
+        uint64_t now = metrics_now_ns();
+        trace_span("connect", conn->stage_at, now);
+        conn->stage_at = now;
+        conn->state = CONN_FORWARD;
+    }
 
-            // reading the first response line from the airport node
-            ssize_t m = rio_readlineb(&rio_airport, response, MAXLINE);
+    if (conn->state == CONN_FORWARD) {
+        while (conn->request_sent < conn->request_len) {
+            n = send(conn->airport_fd, conn->request + conn->request_sent,
+                     conn->request_len - conn->request_sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EAGAIN) {
+                return;
+            } else if (n < 0 && errno != EINTR) {
+                LOG_WARN("Airport %d closed the connection without responding",
+                         conn->fwd.airport_num);
+                finish_forward(conn, 0);
+                return;
+            } else if (n > 0) {
+                conn->request_sent += (size_t)n;
+            }
+        }
+        uint64_t now = metrics_now_ns();
+        trace_span("forward_write", conn->stage_at, now);
+        conn->stage_at = now;
+        conn->state = CONN_AWAIT;
+        watch_airport(conn, EPOLL_CTL_MOD, EPOLLIN);
+        return;
+    }
 
-            if (m <= 0) {
-                close(airport_fd);
-                continue;
+    // CONN_AWAIT
+    while (1) {
+        n = read(conn->airport_fd, conn->reply + conn->reply_len,
+                 sizeof(conn->reply) - 1 - conn->reply_len);
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (conn->lines_left < 0) {
+                LOG_WARN("Airport %d closed the connection without responding",
+                         conn->fwd.airport_num);
+                conn->response[0] = 0;
             }
+            finish_forward(conn, 0);
+            return;
+        }
+        conn->reply_len += (size_t)n;
+        if (relay_reply(conn)) {
+            finish_forward(conn, 1);
+            return;
+        }
+    }
+}
+
+/* Accepts every pending connection on `listenfd` into this worker. */
+static void accept_clients(int listenfd) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int connfd;
+    while ((connfd = accept(listenfd, (SA *)&addr, &addrlen)) >= 0) {
+        client_conn_t *conn = slab_alloc(&CONN_SLAB);
+        struct epoll_event ev = {.events = EPOLLIN};
+        uint64_t client_key = admission_client_key(&addr);
+        addrlen = sizeof(addr);
+        fcntl(connfd, F_SETFL, O_NONBLOCK);
+        if (conn == NULL) {
+            close(connfd);
+            continue;
+        }
+        memset(conn, 0, sizeof(*conn));
+        conn->fd = connfd;
+        conn->airport_fd = -1;
+        conn->client_key = client_key;
+        conn->conn_id = __atomic_add_fetch(&NEXT_CONN_ID, 1, __ATOMIC_RELAXED);
+        conn->state = CONN_IDLE;
+        conn->events = EPOLLIN;
+        wbuf_init(&conn->out, -1);
+        ev.data.ptr = conn;
+        if (epoll_ctl(WORKER_EPOLL, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(connfd);
+            slab_free(&CONN_SLAB, conn);
+            continue;
+        }
+        __atomic_add_fetch(&CLIENT_CONNECTIONS, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Worker thread function: runs an event loop over its share of the clients */
+void *controller_worker(void *arg) {
+    int listenfd = *(int *)arg;
+    struct epoll_event events[EVENT_BATCH];
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL};
+
+    struct epoll_event wake = {.events = EPOLLIN, .data.ptr = &BROADCAST_WAKE};
+
+    if ((WORKER_EPOLL = epoll_create1(0)) < 0 ||
+        epoll_ctl(WORKER_EPOLL, EPOLL_CTL_ADD, listenfd, &ev) < 0 ||
+        (BROADCAST_FD = broadcast_listen()) < 0 ||
+        epoll_ctl(WORKER_EPOLL, EPOLL_CTL_ADD, BROADCAST_FD, &wake) < 0) {
+        perror("epoll");
+        exit(1);
+    }
 
-            // Check if error message
-            if (strncmp(response, "Error:", 6) == 0) {
-                // Send error to client
-                rio_writen(connfd, response, m);
-                close(airport_fd);
+    while (1) {
+        int num_events = epoll_wait(WORKER_EPOLL, events, EVENT_BATCH, -1);
+        for (int i = 0; i < num_events; i++) {
+            uint64_t data = events[i].data.u64;
+            client_conn_t *conn = (client_conn_t *)(uintptr_t)(data & ~AIRPORT_TAG);
+
+            if (conn == NULL) {
+                accept_clients(listenfd);
+            } else if (data == (uintptr_t)&BROADCAST_WAKE) {
+                broadcast_ack(BROADCAST_FD);
+                for (client_conn_t *sub = SUBSCRIBERS, *next; sub; sub = next) {
+                    next = sub->next_subscriber;
+                    push_events(sub);
+                }
+            } else if (data & SHARD_TAG) {
+                shard_leg_t *leg = (shard_leg_t *)(uintptr_t)(data & ~SHARD_TAG);
+                if (leg->conn->closed)
+                    continue;
+                advance_leg(leg);
+                advance_client(leg->conn);
+            } else if (conn->closed) {
                 continue;
+            } else if (data & AIRPORT_TAG) {
+                advance_airport(conn);
+                advance_client(conn);
+            } else if (conn->state == CONN_SUBSCRIBED) {
+                serve_subscriber(conn, events[i].events);
+            } else if (conn->state == CONN_REPLY) {
+                if (send_response(conn)) {
+                    conn->state = CONN_IDLE;
+                    advance_client(conn);
+                }
+            } else if (conn->state == CONN_IDLE) {
+                read_client(conn);
+                advance_client(conn);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                // the client went away mid-forward; clean up once it ends
+                conn->broken = conn->eof = 1;
+                epoll_ctl(WORKER_EPOLL, EPOLL_CTL_DEL, conn->fd, NULL);
             }
+        }
+        while (CLOSED_CONNS != NULL) {
+            client_conn_t *conn = CLOSED_CONNS;
+            CLOSED_CONNS = conn->next_closed;
+            slab_free(&FANOUT_SLAB, conn->fanout);
+            slab_free(&CONN_SLAB, conn);
+        }
+        // requests take turns on the worker, so its arena only holds
+        // scratch memory that does not outlive the handling of an event
+        arena_reset();
+    }
+    return NULL;
+}
 
-            // If not an error
-            rio_writen(connfd, response, m);
+/** @brief Serves every metric over HTTP on `METRICS_PORT`, for scraping by
+ *         Prometheus. Each response holds the controller's metrics followed by
+ *         those of every airport node that is up. `GET /trace` instead returns
+ *         the recorded trace spans as Chrome trace JSON.
+ */
+void *metrics_http_thread(void *arg) {
+    static const char HEADER[] = "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Connection: close\r\n\r\n";
+    static const char JSON_HEADER[] = "HTTP/1.0 200 OK\r\n"
+                                      "Content-Type: application/json\r\n"
+                                      "Connection: close\r\n\r\n";
+    char port_str[PORT_STRLEN], line[MAXLINE], request[MAXLINE];
+    int listenfd, connfd, want_trace;
+    wbuf_t out;
+    rio_t rio;
+    ssize_t n;
 
-            // Calculate remaining lines to read
-            int remaining_lines = expected_response_lines - 1;
-            for (int i = 0; i < remaining_lines; i++) {
-                ssize_t m_next = rio_readlineb(&rio_airport, response, MAXLINE);
-                rio_writen(connfd, response, m_next);
+    snprintf(port_str, PORT_STRLEN, "%d", METRICS_PORT);
+    if ((listenfd = open_listenfd(port_str)) < 0) {
+        perror("[Controller] metrics open_listenfd");
+        return NULL;
+    }
+    while (1) {
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+        // only the path matters; every other path gets the metrics
+        rio_readinitb(&rio, connfd);
+        n = rio_readlineb(&rio, line, MAXLINE);
+        want_trace = n > 0 && strncmp(line, "GET /trace", 10) == 0;
+        while (n > 0 && strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0)
+            n = rio_readlineb(&rio, line, MAXLINE);
+        wbuf_init(&out, connfd);
+        if (n > 0 && want_trace) {
+            wbuf_write(&out, JSON_HEADER, sizeof(JSON_HEADER) - 1);
+            write_trace(&out);
+        } else if (n > 0) {
+            wbuf_write(&out, HEADER, sizeof(HEADER) - 1);
+            write_controller_stats(&out);
+            for (int idx = 0; idx < ATC_INFO.num_nodes; idx++) {
+                node_info_t *node = &ATC_INFO.airport_nodes[idx];
+                if (node->available) {
+                    snprintf(request, MAXLINE, "STATS %d\n", node->id);
+                    relay_node_listing(node, request, &out, 1, line);
+                }
             }
-            close(airport_fd);
         }
-
+        wbuf_flush(&out);
+        wbuf_free(&out);
         close(connfd);
     }
     return NULL;
@@ -216,32 +1617,47 @@ void *controller_worker(void *arg) {
  */
 void controller_server_loop(void) {
     int listenfd = ATC_INFO.listenfd;
-    int connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
 
-    // initialising the request queue
-    init_request_queue(&request_queue);
-
-    // Creating worker threads
-    pthread_t threads[THREAD_POOL_SIZE];
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        if (pthread_create(&threads[i], NULL, controller_worker, NULL) != 0) {
+    // initialising metrics before any worker can record them
+    metrics_init("role=\"controller\"", ATC_INFO.num_airports);
+    metrics_register_gauge("client_connections", "Open client connections.",
+                           client_connections);
+    metrics_register_gauge("forwards_in_flight",
+                           "Requests waiting on an airport node.", forwards_in_flight);
+    if (METRICS_PORT > 0) {
+        pthread_t metrics_thread;
+        if (pthread_create(&metrics_thread, NULL, metrics_http_thread, NULL) != 0) {
             perror("pthread_create");
             exit(1);
         }
-        pthread_detach(threads[i]); 
+        pthread_detach(metrics_thread);
     }
 
-    while (1) {
-        clientlen = sizeof(clientaddr);
-        if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
-            perror("accept");
-            continue;
+    // Opening a socket for each further accept group on the same port
+    char port_str[PORT_STRLEN];
+    snprintf(port_str, PORT_STRLEN, "%d", ATC_INFO.portnum);
+    ACCEPT_FDS[0] = listenfd;
+    for (int group = 1; group < ACCEPT_GROUPS; group++) {
+        if ((ACCEPT_FDS[group] = open_listenfd_reuseport(port_str)) < 0) {
+            fprintf(stderr, "[Controller] Cannot share port %s, using %d accept groups\n",
+                    port_str, group);
+            ACCEPT_GROUPS = group;
         }
+    }
 
-        // Enqueuing the connection for worker threads to handle
-        enqueue_request(&request_queue, connfd);
+    // Creating worker threads, each group's workers sharing its socket
+    pthread_t threads[THREAD_POOL_SIZE];
+    for (int group = 0; group < ACCEPT_GROUPS; group++)
+        fcntl(ACCEPT_FDS[group], F_SETFL, fcntl(ACCEPT_FDS[group], F_GETFL) | O_NONBLOCK);
+    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+        if (pthread_create(&threads[i], NULL, controller_worker,
+                           &ACCEPT_FDS[i % ACCEPT_GROUPS]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+        pthread_join(threads[i], NULL);
     }
 }
 
@@ -250,64 +1666,412 @@ void controller_server_loop(void) {
  *         issues that cause your airport nodes to crash.
  */
 void sigchld_handler(int sig) {
-  while (waitpid(-1, 0, WNOHANG) > 0)
-    ;
-  return;
+  int saved_errno = errno;
+  pid_t pid;
+  while ((pid = waitpid(-1, 0, WNOHANG)) > 0) {
+    for (int idx = 0; idx < ATC_INFO.num_nodes; idx++) {
+      node_info_t *node = &ATC_INFO.airport_nodes[idx];
+      if (node->pid == pid) {
+        node->available = 0;
+        if (write(supervisor_pipe[1], &idx, sizeof(idx)) < 0) {
+          /* The supervisor also rescans every node after each wakeup. */
+        }
+      }
+    }
+  }
+  errno = saved_errno;
 }
 
-/** You should not modify any of the functions below this point, nor should you
- *  call these functions from anywhere else in your code. These functions are
- *  used to handle the initial setup of the Air Traffic Control system.
+/** These functions are used to handle the initial setup of the Air Traffic
+ *  Control system and the supervision of its airport nodes. They should not
+ *  be called from anywhere else in your code.
+ */
+
+/** @brief Finds the `airport_server` program in the directory of the
+ *         controller's own executable.
+ *
+ *  @returns 0 if it is there and executable, -1 otherwise.
  */
+int find_node_program(void) {
+  char *slash;
+  ssize_t len = readlink("/proc/self/exe", NODE_PROGRAM, sizeof(NODE_PROGRAM) - 1);
+
+  if (len < 0)
+    return -1;
+  NODE_PROGRAM[len] = '\0';
+  if ((slash = strrchr(NODE_PROGRAM, '/')) == NULL ||
+      (size_t)(slash - NODE_PROGRAM) + sizeof("/airport_server") > sizeof(NODE_PROGRAM))
+    return -1;
+  strcpy(slash, "/airport_server");
+  return access(NODE_PROGRAM, X_OK);
+}
+
+/** @brief Closes every file descriptor above stderr but `keep`, below
+ *         `max_fd`. Only makes system calls, so it is safe between fork and
+ *         exec.
+ */
+static void close_fds_except(int keep, long max_fd) {
+  if ((keep == 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0) &&
+      syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+    return;
+  // kernels before 5.9 have no close_range
+  for (long fd = 3; fd < max_fd; fd++) {
+    if (fd != keep)
+      close((int)fd);
+  }
+}
+
+/** @brief Opens the listening socket of `node` on its assigned port and
+ *         starts a child process running `airport_server` on it. Any
+ *         persisted schedule is recovered by the child as it starts.
+ *
+ *  The controller is threaded by then, so the child execs straight away
+ *  rather than running the node in a copy of the controller, which could
+ *  inherit locks held by other threads. It keeps only the listening socket,
+ *  so the controller's client connections are closed as soon as the
+ *  controller closes them, however long the node lives.
+ *
+ *  @returns 0 if the node was started, -1 otherwise.
+ */
+int spawn_airport_node(node_info_t *node) {
+  char port_str[PORT_STRLEN], name[64];
+  char id[16], gates[16], fd[16], shard[16], base[16], groups[16], slots[16];
+  char *argv[24];
+  int lfd, argc = 0;
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  pid_t pid, controller = getpid();
+
+  snprintf(port_str, PORT_STRLEN, "%d", node->port);
+  lfd = ACCEPT_GROUPS > 1 ? open_listenfd_reuseport(port_str) : open_listenfd(port_str);
+  if (lfd < 0) {
+    perror("open_listenfd");
+    return -1;
+  }
+
+  // everything the child runs is prepared beforehand, as it may not allocate
+  snprintf(id, sizeof(id), "%d", node->id);
+  snprintf(gates, sizeof(gates), "%d", node->num_gates);
+  snprintf(fd, sizeof(fd), "%d", lfd);
+  snprintf(shard, sizeof(shard), "%d", node->shard);
+  snprintf(base, sizeof(base), "%d", node->gate_base);
+  snprintf(groups, sizeof(groups), "%d", ACCEPT_GROUPS);
+  snprintf(slots, sizeof(slots), "%d", NUM_TIME_SLOTS);
+  argv[argc++] = NODE_PROGRAM;
+  argv[argc++] = "-a";
+  argv[argc++] = id;
+  argv[argc++] = "-g";
+  argv[argc++] = gates;
+  argv[argc++] = "-p";
+  argv[argc++] = port_str;
+  argv[argc++] = "-f";
+  argv[argc++] = fd;
+  if (node->shard >= 0) {
+    argv[argc++] = "-k";
+    argv[argc++] = shard;
+    argv[argc++] = "-b";
+    argv[argc++] = base;
+  }
+  argv[argc++] = "-l";
+  argv[argc++] = groups;
+  argv[argc++] = "-H";
+  argv[argc++] = slots;
+  if (ATC_INFO.persist_dir != NULL) {
+    argv[argc++] = "-d";
+    argv[argc++] = ATC_INFO.persist_dir;
+  }
+  if (ATC_INFO.import_path != NULL) {
+    argv[argc++] = "-i";
+    argv[argc++] = ATC_INFO.import_path;
+  }
+  if (uring_server_enabled())
+    argv[argc++] = "-u";
+  argv[argc] = NULL;
+
+  if ((pid = fork()) == 0) {
+    // a node should not outlive the controller that supervises it
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != controller)
+      _exit(1);
+    close_fds_except(lfd, max_fd);
+    execv(NODE_PROGRAM, argv);
+    _exit(127);
+  } else if (pid < 0) {
+    perror("fork");
+    close(lfd);
+    return -1;
+  }
+  node->pid = pid;
+  node->available = 1;
+  // a respawned node may have lost writes that were not persisted
+  cache_invalidate(node->id);
+  fprintf(stderr, "[Controller] %s assigned port %s\n",
+          node_name(node, name, sizeof(name)), port_str);
+  close(lfd);
+  return 0;
+}
+
+/** @brief Supervisor thread that respawns airport nodes after they exit,
+ *         backing off exponentially while a node keeps failing to start.
+ */
+void *supervisor_thread(void *arg) {
+  int idx, down, backoff_ms = RESPAWN_BACKOFF_MIN_MS;
+  node_info_t *node;
+  char name[64];
+
+  struct pollfd pfd = {.fd = supervisor_pipe[0], .events = POLLIN};
+
+  while (1) {
+    /* Also wake up periodically, in case a node exited before its pid was
+     * recorded and so was reaped without being marked as down. */
+    if (poll(&pfd, 1, SUPERVISOR_POLL_MS) > 0 &&
+        read(supervisor_pipe[0], &idx, sizeof(idx)) < 0 && errno != EINTR)
+      break;
+
+    do {
+      down = 0;
+      for (idx = 0; idx < ATC_INFO.num_nodes; idx++) {
+        node = &ATC_INFO.airport_nodes[idx];
+        if (node->available && kill(node->pid, 0) < 0 && errno == ESRCH)
+          node->available = 0;
+        if (node->available)
+          continue;
+        fprintf(stderr, "[Controller] %s is down, respawning\n",
+                node_name(node, name, sizeof(name)));
+        if (spawn_airport_node(node) < 0) {
+          down = 1;
+        } else {
+          node->restarts++;
+        }
+      }
+      if (down) {
+        usleep((useconds_t)backoff_ms * 1000);
+        backoff_ms = backoff_ms * 2 > RESPAWN_BACKOFF_MAX_MS
+                         ? RESPAWN_BACKOFF_MAX_MS
+                         : backoff_ms * 2;
+      } else {
+        backoff_ms = RESPAWN_BACKOFF_MIN_MS;
+      }
+    } while (down);
+  }
+  return NULL;
+}
+
+/** @brief Splits each airport into `ATC_INFO.num_shards` nodes serving
+ *         consecutive ranges of its gates, or fewer if it has fewer gates,
+ *         filling in every node but its port.
+ *
+ *  @returns 0 on success, -1 if memory could not be allocated.
+ */
+int plan_airport_nodes(void) {
+  int num_airports = ATC_INFO.num_airports, num_nodes = 0;
+
+  if ((ATC_INFO.first_node = calloc((unsigned)num_airports + 1, sizeof(int))) == NULL)
+    return -1;
+  for (int idx = 0; idx < num_airports; idx++) {
+    int shards = ATC_INFO.gate_counts[idx] < ATC_INFO.num_shards ? ATC_INFO.gate_counts[idx]
+                                                                  : ATC_INFO.num_shards;
+    ATC_INFO.first_node[idx] = num_nodes;
+    num_nodes += shards > 1 ? shards : 1;
+  }
+  ATC_INFO.first_node[num_airports] = ATC_INFO.num_nodes = num_nodes;
+  if ((ATC_INFO.airport_nodes = calloc((unsigned)num_nodes, sizeof(node_info_t))) == NULL)
+    return -1;
+
+  for (int idx = 0; idx < num_airports; idx++) {
+    int shards = airport_shards(idx), gates = ATC_INFO.gate_counts[idx];
+    for (int shard = 0; shard < shards; shard++) {
+      node_info_t *node = shard_node(idx, shard);
+      node->id = idx;
+      node->shard = shards > 1 ? shard : -1;
+      node->replica = -1;
+      node->gate_base = (int)((long)gates * shard / shards);
+      node->num_gates = (int)((long)gates * (shard + 1) / shards) - node->gate_base;
+    }
+  }
+  return 0;
+}
+
+/** @brief Places a node or replica listed in a topology file at `endpoint`,
+ *         a `host:port` string.
+ *
+ *  @returns 0 on success, -1 if it is malformed or the host is unknown.
+ */
+static int place_node(node_info_t *node, char *endpoint) {
+  char *colon = strrchr(endpoint, ':');
+  if (colon == NULL || colon == endpoint || (size_t)(colon - endpoint) >= HOST_LEN ||
+      sscanf(colon + 1, "%d", &node->port) != 1 || node->port < MIN_PORTNUM ||
+      node->port > MAX_PORTNUM) {
+    fprintf(stderr, "Expected host:port in the topology, got %s.\n", endpoint);
+    return -1;
+  }
+  snprintf(node->host, HOST_LEN, "%.*s", (int)(colon - endpoint), endpoint);
+  if (resolve_ipv4(node->host, node->port, &node->addr) < 0) {
+    fprintf(stderr, "Cannot resolve host %s.\n", node->host);
+    return -1;
+  }
+  node->available = 1;
+  return 0;
+}
+
+/** @brief Reads `ATC_INFO.topology`, which places every node on a host
+ *         instead of forking it. Each line names a node, as an airport id
+ *         followed by `/<shard>` if its airport is split, and the `host:port`
+ *         it listens on, then those of any replicas. Blank lines and lines
+ *         starting with `#` are skipped.
+ *
+ *  @returns 0 if every node was placed, -1 otherwise.
+ */
+int load_topology(void) {
+  char line[MAXLINE], *token, *save;
+  int airport_num, shard, line_num = 0, ret = 0;
+  node_info_t *node;
+  FILE *file;
+
+  if ((file = fopen(ATC_INFO.topology, "r")) == NULL) {
+    perror(ATC_INFO.topology);
+    return -1;
+  }
+  while (ret == 0 && fgets(line, sizeof(line), file) != NULL) {
+    line_num++;
+    if ((token = strtok_r(line, " \t\r\n", &save)) == NULL || token[0] == '#')
+      continue;
+    shard = 0;
+    if (sscanf(token, "%d/%d", &airport_num, &shard) < 1 || airport_num < 0 ||
+        airport_num >= ATC_INFO.num_airports || shard < 0 ||
+        shard >= airport_shards(airport_num)) {
+      fprintf(stderr, "Line %d of the topology names no node: %s.\n", line_num, token);
+      ret = -1;
+      break;
+    }
+    node = shard_node(airport_num, shard);
+    if (node->host[0]) {
+      fprintf(stderr, "Line %d of the topology places a node twice.\n", line_num);
+      ret = -1;
+      break;
+    }
+    if ((token = strtok_r(NULL, " \t\r\n", &save)) == NULL || place_node(node, token) < 0) {
+      fprintf(stderr, "Line %d of the topology gives no host:port.\n", line_num);
+      ret = -1;
+      break;
+    }
+    if ((node->replicas = calloc(MAX_REPLICAS, sizeof(node_info_t))) == NULL) {
+      ret = -1;
+      break;
+    }
+    while (ret == 0 && (token = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      node_info_t *replica = &node->replicas[node->num_replicas];
+      if (node->num_replicas == MAX_REPLICAS) {
+        fprintf(stderr, "Line %d of the topology has over %d replicas.\n", line_num,
+                MAX_REPLICAS);
+        ret = -1;
+      } else {
+        *replica = *node;
+        replica->replica = node->num_replicas++;
+        replica->num_replicas = 0;
+        replica->replicas = NULL;
+        ret = place_node(replica, token);
+      }
+    }
+  }
+  fclose(file);
+
+  for (int idx = 0; ret == 0 && idx < ATC_INFO.num_nodes; idx++) {
+    char name[96];
+    node = &ATC_INFO.airport_nodes[idx];
+    if (!node->host[0]) {
+      fprintf(stderr, "The topology does not place %s.\n", node_name(node, name, sizeof(name)));
+      ret = -1;
+    }
+  }
+  return ret;
+}
 
 /** @brief This function spawns child processes for each airport node, and
- *         opens a listening socket for the controller to use.
+ *         opens a listening socket for the controller to use. With a topology
+ *         file, the nodes are already running elsewhere and are not
+ *         supervised.
  */
 void initialise_network(void) {
   char port_str[PORT_STRLEN];
   int num_airports = ATC_INFO.num_airports;
-  int lfd, idx, port_num = ATC_INFO.portnum;
+  int idx, port_num = ATC_INFO.portnum;
   node_info_t *node;
-  pid_t pid;
+  pthread_t supervisor;
 
   snprintf(port_str, PORT_STRLEN, "%d", port_num);
-  if ((ATC_INFO.listenfd = open_listenfd(port_str)) < 0) {
+  ATC_INFO.listenfd =
+      ACCEPT_GROUPS > 1 ? open_listenfd_reuseport(port_str) : open_listenfd(port_str);
+  if (ATC_INFO.listenfd < 0) {
     perror("[Controller] open_listenfd");
     exit(1);
   }
 
-  for (idx = 0; idx < num_airports; idx++) {
+  cache_init(num_airports);
+  if (ATC_INFO.topology != NULL) {
+    char name[96];
+    for (idx = 0; idx < ATC_INFO.num_nodes; idx++) {
+      node = &ATC_INFO.airport_nodes[idx];
+      for (int replica = -1; replica < node->num_replicas; replica++) {
+        node_info_t *served = replica < 0 ? node : &node->replicas[replica];
+        fprintf(stderr, "[Controller] %s at %s:%d\n",
+                node_name(served, name, sizeof(name)), served->host, served->port);
+      }
+    }
+    controller_server_loop();
+    exit(0);
+  }
+  if (pipe(supervisor_pipe) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  signal(SIGCHLD, sigchld_handler);
+
+  for (idx = 0; idx < ATC_INFO.num_nodes; idx++) {
     node = &ATC_INFO.airport_nodes[idx];
-    node->id = idx;
     node->port = ++port_num;
-    snprintf(port_str, PORT_STRLEN, "%d", port_num);
-    if ((lfd = open_listenfd(port_str)) < 0) {
-      perror("open_listenfd");
-      continue;
-    }
-    if ((pid = fork()) == 0) {
-      close(ATC_INFO.listenfd);
-      initialise_node(idx, ATC_INFO.gate_counts[idx], lfd);
-      exit(0);
-    } else if (pid < 0) {
-      perror("fork");
-    } else {
-      node->pid = pid;
-      fprintf(stderr, "[Controller] Airport %d assigned port %s\n", idx, port_str);
-      close(lfd);
-    }
+    snprintf(node->host, HOST_LEN, "localhost");
+    resolve_ipv4("127.0.0.1", node->port, &node->addr);
+    // nodes that fail to start are retried by the supervisor
+    spawn_airport_node(node);
   }
 
-  signal(SIGCHLD, sigchld_handler);
+  if (pthread_create(&supervisor, NULL, supervisor_thread, NULL) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+  pthread_detach(supervisor);
   controller_server_loop();
   exit(0);
 }
 
 /** @brief Prints usage information for the program and then exits. */
 void print_usage(char *program_name) {
-  printf("Usage: %s [-n N] [-p P] -- [gate count list]\n", program_name);
+  printf("Usage: %s [-n N] [-p P] [-s S] [-t FILE] [-l L] [-r R[,B]] [-q Q] [-d DIR] [-m PORT] "
+         "[-i FILE] [-H SLOTS] [-R FILE] [-u] [-C] -- "
+         "[gate count list]\n",
+         program_name);
   printf("  -n: Number of airports to create.\n");
   printf("  -p: Port number to use for controller.\n");
+  printf("  -s: Split each airport's gates across up to S nodes (default 1, at most %d).\n",
+         MAX_SHARDS);
+  printf("  -t: Topology file placing airport nodes and replicas on hosts, instead of\n"
+         "      starting them.\n");
+  printf("  -l: Accept on L sockets sharing each port with SO_REUSEPORT, each with its\n"
+         "      own workers (default 1, at most %d).\n",
+         MAX_ACCEPT_GROUPS);
+  printf("  -r: Answer each client address's requests beyond R a second, in bursts of\n"
+         "      up to B (default R), with Error: Busy.\n");
+  printf("  -q: Answer requests with Error: Busy while Q are waiting on airport nodes.\n");
+  printf("  -d: Directory in which airport nodes persist their schedules.\n");
+  printf("  -i: CSV file of airport,plane,earliest,duration,fuel lines that airport nodes\n"
+         "      with empty schedules are seeded from before serving.\n");
+  printf("  -m: Port on which to serve metrics over HTTP for Prometheus.\n");
+  printf("  -H: Time slots per gate: 48 of 30 minutes (default), 96 of 15 minutes,\n"
+         "      288 of 5 minutes, or 2016 of 5 minutes spanning a week.\n");
+  printf("  -R: Record every client request and its response to FILE, for replay.\n");
+  printf("  -u: Serve the airport nodes' connections with io_uring where the kernel\n"
+         "      supports it.\n");
+  printf("  -C: Disable the cache of PLANE_STATUS and TIME_STATUS responses.\n");
   printf("  -h: Print this help message and exit.\n");
   exit(0);
 }
@@ -361,10 +2125,13 @@ int *parse_gate_counts(char *list_arg, int expected) {
 int parse_args(int argc, char *argv[]) {
   int c, ret = 0, *gate_counts = NULL;
   int atc_portnum = DEFAULT_PORTNUM;
-  int num_airports = 0;
+  int num_airports = 0, num_shards = 1;
   int max_portnum = MAX_PORTNUM;
+  int num_slots = DEFAULT_TIME_SLOTS;
+  double rate = 0, burst = 0;
+  char *import_path = NULL, *record_path = NULL;
 
-  while ((c = getopt(argc, argv, "n:p:h")) != -1) {
+  while ((c = getopt(argc, argv, "n:p:s:t:l:r:q:d:i:m:H:R:uCh")) != -1) {
     switch (c) {
     case 'n':
       sscanf(optarg, "%d", &num_airports);
@@ -373,6 +2140,43 @@ int parse_args(int argc, char *argv[]) {
     case 'p':
       sscanf(optarg, "%d", &atc_portnum);
       break;
+    case 's':
+      sscanf(optarg, "%d", &num_shards);
+      break;
+    case 't':
+      ATC_INFO.topology = optarg;
+      break;
+    case 'l':
+      sscanf(optarg, "%d", &ACCEPT_GROUPS);
+      break;
+    case 'r':
+      if (sscanf(optarg, "%lf,%lf", &rate, &burst) < 2)
+        burst = rate;
+      break;
+    case 'q':
+      sscanf(optarg, "%ld", &MAX_IN_FLIGHT);
+      break;
+    case 'd':
+      ATC_INFO.persist_dir = optarg;
+      break;
+    case 'i':
+      import_path = ATC_INFO.import_path = optarg;
+      break;
+    case 'm':
+      sscanf(optarg, "%d", &METRICS_PORT);
+      break;
+    case 'H':
+      sscanf(optarg, "%d", &num_slots);
+      break;
+    case 'R':
+      record_path = optarg;
+      break;
+    case 'u':
+      uring_server_set_enabled(1);
+      break;
+    case 'C':
+      cache_set_enabled(0);
+      break;
     case 'h':
       print_usage(argv[0]);
       break;
@@ -388,10 +2192,46 @@ int parse_args(int argc, char *argv[]) {
     fprintf(stderr, "-n must be greater than 0.\n");
     ret = -1;
   }
+  if (ACCEPT_GROUPS < 1 || ACCEPT_GROUPS > MAX_ACCEPT_GROUPS) {
+    fprintf(stderr, "-l must be between 1-%d.\n", MAX_ACCEPT_GROUPS);
+    ret = -1;
+  }
+  if (rate < 0 || (rate > 0 && burst < 1)) {
+    fprintf(stderr, "-r must be at least 0, with a burst of at least 1.\n");
+    ret = -1;
+  }
+  if (MAX_IN_FLIGHT < 0) {
+    fprintf(stderr, "-q must be at least 0.\n");
+    ret = -1;
+  }
+  if (num_shards < 1 || num_shards > MAX_SHARDS) {
+    fprintf(stderr, "-s must be between 1-%d.\n", MAX_SHARDS);
+    ret = -1;
+  }
+  if (set_time_slots(num_slots) < 0) {
+    fprintf(stderr, "-H must be 48, 96, 288 or 2016.\n");
+    ret = -1;
+  }
+  // nodes read it, but would only be respawned if they could not
+  if (import_path && access(import_path, R_OK) < 0) {
+    fprintf(stderr, "-i must be a readable file.\n");
+    ret = -1;
+  }
+  if (record_path && record_open(record_path) < 0) {
+    fprintf(stderr, "-R must be a file that can be created.\n");
+    ret = -1;
+  }
   if (atc_portnum < MIN_PORTNUM || atc_portnum >= max_portnum) {
     fprintf(stderr, "-p must be between %d-%d.\n", MIN_PORTNUM, max_portnum);
     ret = -1;
   }
+  if (METRICS_PORT != 0 && (METRICS_PORT < MIN_PORTNUM || METRICS_PORT > MAX_PORTNUM ||
+                            (METRICS_PORT >= atc_portnum &&
+                             METRICS_PORT <= atc_portnum + num_airports))) {
+    fprintf(stderr, "-m must be between %d-%d and not used by an airport.\n",
+            MIN_PORTNUM, MAX_PORTNUM);
+    ret = -1;
+  }
 
   if (ret >= 0) {
     if ((gate_counts = parse_gate_counts(argv[optind], num_airports)) == NULL)
@@ -399,7 +2239,34 @@ int parse_args(int argc, char *argv[]) {
     ATC_INFO.num_airports = num_airports;
     ATC_INFO.gate_counts = gate_counts;
     ATC_INFO.portnum = atc_portnum;
-    ATC_INFO.airport_nodes = calloc((unsigned)num_airports, sizeof(node_info_t));
+    ATC_INFO.num_shards = num_shards;
+    admission_set_rate(rate, burst);
+    if (plan_airport_nodes() < 0)
+      return -1;
+    if (ATC_INFO.topology != NULL)
+      return load_topology();
+    if (find_node_program() < 0) {
+      fprintf(stderr, "airport_server must be built next to the controller.\n");
+      return -1;
+    }
+    // nodes would refuse to start on them, and only be respawned
+    for (int idx = 0; ATC_INFO.persist_dir != NULL && idx < ATC_INFO.num_nodes; idx++) {
+      node_info_t *node = &ATC_INFO.airport_nodes[idx];
+      if (persist_check_horizon(ATC_INFO.persist_dir, node->id, node->shard) < 0)
+        ret = -1;
+    }
+    if (ret < 0) {
+      fprintf(stderr, "-H must match the horizon the schedules in -d were persisted with.\n");
+      return -1;
+    }
+    // shards take a port each, after those of the airports
+    if (atc_portnum + ATC_INFO.num_nodes >= MAX_PORTNUM ||
+        (METRICS_PORT != 0 && METRICS_PORT >= atc_portnum &&
+         METRICS_PORT <= atc_portnum + ATC_INFO.num_nodes)) {
+      fprintf(stderr, "Not enough ports after %d for %d airport nodes.\n", atc_portnum,
+              ATC_INFO.num_nodes);
+      ret = -1;
+    }
   }
 
   return ret;
@@ -408,6 +2275,8 @@ int parse_args(int argc, char *argv[]) {
 int main(int argc, char *argv[]) {
   if (parse_args(argc, argv) < 0)
     return 1;
+  log_init("controller");
+  trace_init("controller");
   initialise_network();
   return 0;
 }
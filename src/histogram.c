@@ -0,0 +1,80 @@
+#include "histogram.h"
+#include <string.h>
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+void hist_init(histogram_t *h) { memset(h, 0, sizeof(*h)); }
+
+int hist_bucket(uint64_t value) {
+  int msb, shift;
+  if (value < HIST_SUB_COUNT)
+    return (int)value;
+  msb = 63 - __builtin_clzll(value);
+  /* Keep the top HIST_SUB_BITS bits, which lie in [SUB_COUNT/2, SUB_COUNT). */
+  shift = msb - HIST_SUB_BITS + 1;
+  return shift * (HIST_SUB_COUNT / 2) + (int)(value >> shift);
+}
+
+uint64_t hist_bucket_value(int idx) {
+  int shift;
+  if (idx < HIST_SUB_COUNT)
+    return (uint64_t)idx;
+  shift = idx / (HIST_SUB_COUNT / 2) - 1;
+  return (uint64_t)(idx - shift * (HIST_SUB_COUNT / 2)) << shift;
+}
+
+void hist_record(histogram_t *h, uint64_t value) {
+  int idx = hist_bucket(value);
+  /* Single writer: plain read-modify-write, published with relaxed stores. */
+  STORE(&h->counts[idx], LOAD(&h->counts[idx]) + 1);
+  STORE(&h->total, LOAD(&h->total) + 1);
+  STORE(&h->sum, LOAD(&h->sum) + value);
+  if (value > LOAD(&h->max))
+    STORE(&h->max, value);
+}
+
+void hist_merge(histogram_t *dst, const histogram_t *src) {
+  uint64_t total = 0, count, max;
+  for (int idx = 0; idx < HIST_NUM_BUCKETS; idx++) {
+    if ((count = LOAD(&src->counts[idx])) == 0)
+      continue;
+    dst->counts[idx] += count;
+    total += count;
+  }
+  /* Derive the total from the buckets so percentiles stay consistent even
+   * while `src` is being written. */
+  dst->total += total;
+  dst->sum += LOAD(&src->sum);
+  if ((max = LOAD(&src->max)) > dst->max)
+    dst->max = max;
+}
+
+uint64_t hist_percentile(const histogram_t *h, double pct) {
+  uint64_t total = 0, seen = 0, target, width;
+  int idx;
+  for (idx = 0; idx < HIST_NUM_BUCKETS; idx++)
+    total += LOAD(&h->counts[idx]);
+  if (total == 0)
+    return 0;
+  target = (uint64_t)((pct / 100.0) * (double)total + 0.5);
+  if (target == 0)
+    target = 1;
+  for (idx = 0; idx < HIST_NUM_BUCKETS; idx++) {
+    seen += LOAD(&h->counts[idx]);
+    if (seen >= target)
+      break;
+  }
+  if (idx >= HIST_NUM_BUCKETS)
+    return LOAD(&h->max);
+  /* Report the middle of the bucket, capped at the largest value seen. */
+  width = hist_bucket_value(idx + 1) - hist_bucket_value(idx);
+  if (hist_bucket_value(idx) + width / 2 > LOAD(&h->max))
+    return LOAD(&h->max);
+  return hist_bucket_value(idx) + width / 2;
+}
+
+double hist_mean(const histogram_t *h) {
+  uint64_t total = LOAD(&h->total);
+  return total ? (double)LOAD(&h->sum) / (double)total : 0.0;
+}
@@ -0,0 +1,52 @@
+#ifndef HISTOGRAM_HEADER
+#define HISTOGRAM_HEADER
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** A log-linear latency histogram in the style of HdrHistogram.
+ *
+ *  Values below `HIST_SUB_COUNT` are counted exactly. Above that, every power
+ *  of two is split into `HIST_SUB_COUNT / 2` equal buckets, so any recorded
+ *  value is reported to within 1% over the full 64-bit range.
+ *
+ *  A histogram has a single writer. Counts are updated with relaxed atomics,
+ *  so other threads may read or merge it at any time without locking.
+ */
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS ((64 - HIST_SUB_BITS + 1) * (HIST_SUB_COUNT / 2) + HIST_SUB_COUNT / 2)
+
+typedef struct histogram_t {
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t counts[HIST_NUM_BUCKETS];
+} histogram_t;
+
+/** @brief Resets every count of `h` to zero. */
+void hist_init(histogram_t *h);
+
+/** @brief Records one occurrence of `value`. Must only be called by the
+ *         thread owning `h`. */
+void hist_record(histogram_t *h, uint64_t value);
+
+/** @brief Adds every count of `src` to `dst`. `src` may be concurrently
+ *         written by its owner. */
+void hist_merge(histogram_t *dst, const histogram_t *src);
+
+/** @brief Returns the value at percentile `pct` (0-100) of the recorded
+ *         values, or 0 if nothing has been recorded. */
+uint64_t hist_percentile(const histogram_t *h, double pct);
+
+/** @brief Returns the mean of the recorded values. */
+double hist_mean(const histogram_t *h);
+
+/** @brief Returns the index of the bucket `value` is counted in. */
+int hist_bucket(uint64_t value);
+
+/** @brief Returns the smallest value counted in bucket `idx`. */
+uint64_t hist_bucket_value(int idx);
+
+#endif
@@ -0,0 +1,152 @@
+#include "import.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrics.h"
+#include "persist.h"
+
+/** Seeding of airport schedules from a CSV file. See `import.h` for the
+ *  format and how sharded airports are handled.
+ */
+
+#define IMPORT_FIELDS 5 /* airport, plane, earliest, duration, fuel */
+
+static char *IMPORT_PATH = NULL;
+
+void import_set_file(const char *path) {
+  free(IMPORT_PATH);
+  IMPORT_PATH = path ? strdup(path) : NULL;
+}
+
+int import_enabled(void) { return IMPORT_PATH != NULL; }
+
+static const char *skip_blanks(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    p++;
+  return p;
+}
+
+/* Reads the comma-separated integers of the line `[p, end)` into `fields`.
+ * Returns -1 unless it holds exactly `IMPORT_FIELDS` of them. */
+static int parse_flight(const char *p, const char *end, int *fields) {
+  for (int field = 0; field < IMPORT_FIELDS; field++) {
+    long value = 0;
+    int negative = 0;
+    const char *digits;
+    p = skip_blanks(p, end);
+    if (p < end && (*p == '-' || *p == '+'))
+      negative = *p++ == '-';
+    for (digits = p; p < end && *p >= '0' && *p <= '9' && value <= INT_MAX; p++)
+      value = value * 10 + (*p - '0');
+    if (p == digits || value > (long)INT_MAX + negative)
+      return -1;
+    fields[field] = (int)(negative ? -value : value);
+    p = skip_blanks(p, end);
+    if (field < IMPORT_FIELDS - 1 && (p == end || *p++ != ','))
+      return -1;
+  }
+  return p == end ? 0 : -1;
+}
+
+/* Returns 1 if any slot of `airport` is booked. */
+static int has_bookings(const airport_t *airport) {
+  for (int i = 0; i < airport->num_gates; i++) {
+    for (int idx = 0; idx < NUM_TIME_SLOTS; idx++) {
+      if (airport->gates[i].time_slots[idx].status == 1)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+static void free_scratch(airport_t *airport) {
+  if (airport == NULL)
+    return;
+  free(airport->slots);
+  free(airport->busy);
+  free(airport);
+}
+
+int import_flights(int airport_id, int gate_base, airport_t *airport) {
+  airport_t *before = NULL; /* the shards before this one */
+  const char *data, *line, *eol, *end;
+  int fd, fields[IMPORT_FIELDS], imported = 0, unplaced = 0, invalid = 0;
+  int line_num = 0, first_invalid = 0;
+  uint64_t begin = metrics_now_ns();
+  struct stat st;
+
+  if (has_bookings(airport)) {
+    fprintf(stderr, "[Airport %d] Schedule restored, skipping import of %s\n", airport_id,
+            IMPORT_PATH);
+    return 0;
+  }
+  if ((fd = open(IMPORT_PATH, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "[Airport %d] Cannot read %s: %s\n", airport_id, IMPORT_PATH,
+            strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "[Airport %d] Cannot map %s: %s\n", airport_id, IMPORT_PATH,
+            strerror(errno));
+    return -1;
+  }
+  madvise((void *)data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  if (gate_base > 0 && (before = create_airport(gate_base)) == NULL) {
+    munmap((void *)data, (size_t)st.st_size);
+    return -1;
+  }
+
+  end = data + st.st_size;
+  for (line = data; line < end; line = eol + 1) {
+    if ((eol = memchr(line, '\n', (size_t)(end - line))) == NULL)
+      eol = end;
+    line_num++;
+    line = skip_blanks(line, eol);
+    if (line == eol || *line == '#')
+      continue;
+    if (parse_flight(line, eol, fields) < 0) {
+      if (invalid++ == 0)
+        first_invalid = line_num;
+      continue;
+    }
+    if (fields[0] != airport_id)
+      continue;
+
+    int plane_id = fields[1], earliest = fields[2], duration = fields[3], fuel = fields[4];
+    // flights a node would answer with an error are not placed either
+    if (earliest < 0 || earliest >= NUM_TIME_SLOTS || duration < 0 ||
+        earliest + duration > NUM_TIME_SLOTS) {
+      if (invalid++ == 0)
+        first_invalid = line_num;
+      continue;
+    }
+    if (before && import_plane(before, plane_id, earliest, duration, fuel).gate_number >= 0)
+      continue;
+    time_info_t result = import_plane(airport, plane_id, earliest, duration, fuel);
+    if (result.gate_number < 0) {
+      unplaced++;
+      continue;
+    }
+    persist_log_schedule(plane_id, result.gate_number, result.start_time, result.end_time);
+    imported++;
+  }
+  munmap((void *)data, (size_t)st.st_size);
+  free_scratch(before);
+
+  fprintf(stderr, "[Airport %d] Imported %d flights from %s in %.1f ms, %d did not fit",
+          airport_id, imported, IMPORT_PATH, (double)(metrics_now_ns() - begin) / 1e6,
+          unplaced);
+  if (invalid > 0)
+    fprintf(stderr, ", %d invalid lines from line %d", invalid, first_invalid);
+  fprintf(stderr, "\n");
+  return imported;
+}
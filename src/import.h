@@ -0,0 +1,44 @@
+#ifndef IMPORT_HEADER
+#define IMPORT_HEADER
+
+#include "airport.h"
+
+/** Bulk loading of flight schedules.
+ *
+ *  A node given an import file seeds its airport from it before serving any
+ *  request. The file is a CSV of flights, one per line, in the order their
+ *  SCHEDULEs would have been sent:
+ *
+ *    airport,plane,earliest,duration,fuel
+ *
+ *  Blank lines and lines starting with `#` are skipped. Every node maps the
+ *  file, picks out the flights of its own airport and places them with
+ *  `import_plane`, so each lands exactly where the same SCHEDULE would have,
+ *  without a connection, a parse into a request or an atomic per flight.
+ *
+ *  A shard of an airport also places the flights in a scratch copy of the
+ *  shards before it, which start as empty as it does, and keeps only those
+ *  that would not have fit there. Seeding is only done into an empty airport:
+ *  a node that restored bookings from its persistence directory has been
+ *  seeded before, and skips the import.
+ */
+
+/** @brief Sets the file airport nodes seed their schedules from. Must be
+ *         called before the node is initialised; `NULL` disables importing.
+ */
+void import_set_file(const char *path);
+
+/** @brief Returns 1 if an import file has been configured. */
+int import_enabled(void);
+
+/** @brief Places the flights of airport `airport_id` from the import file
+ *         into `airport`, whose gates are numbered from `gate_base`, and logs
+ *         them when persistence is enabled. Does nothing if `airport` already
+ *         has bookings.
+ *
+ *  @returns The number of flights placed, or -1 if the file could not be
+ *           read.
+ */
+int import_flights(int airport_id, int gate_base, airport_t *airport);
+
+#endif
@@ -0,0 +1,218 @@
+#include "logger.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+/* Bytes of logfmt output buffered by the drain thread before each write. */
+#define LOG_OUTPUT_BUFFER 16384
+
+typedef struct log_record_t {
+  uint64_t timestamp_ns; /* CLOCK_REALTIME */
+  uint64_t request_id;
+  const char *file;      /* string literals, so no copy is needed */
+  int32_t line;
+  int32_t level;
+  char message[LOG_MESSAGE_LEN];
+} log_record_t;
+
+/* Single-producer single-consumer ring owned by one thread. `head` is only
+ * written by the owner and `tail` only by the drain thread. */
+typedef struct log_ring_t {
+  struct log_ring_t *next;
+  unsigned generation;
+  int thread_num;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  uint64_t dropped_reported;
+  log_record_t records[LOG_RING_RECORDS];
+} log_ring_t;
+
+#ifdef ENABLE_LOG
+static int LEVEL = LOG_LEVEL_DEBUG;
+#else
+static int LEVEL = LOG_LEVEL_WARN;
+#endif
+
+static const char *LEVEL_NAMES[] = {"off", "error", "warn", "info", "debug", "trace"};
+#define NUM_LEVELS (int)(sizeof(LEVEL_NAMES) / sizeof(LEVEL_NAMES[0]))
+
+static char ROLE[32] = "main";
+static log_ring_t *RINGS = NULL;
+static int NUM_RINGS = 0;
+/* Bumped by `log_init` so rings inherited across a fork are re-registered. */
+static unsigned GENERATION = 0;
+static pthread_mutex_t DRAIN_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static __thread log_ring_t *SELF = NULL;
+static __thread uint64_t REQUEST_ID = 0;
+
+int log_level(void) { return LOAD(&LEVEL); }
+
+void log_set_level(log_level_t level) { STORE(&LEVEL, (int)level); }
+
+int log_parse_level(const char *name) {
+  for (int level = 0; level < NUM_LEVELS; level++)
+    if (strcasecmp(name, LEVEL_NAMES[level]) == 0)
+      return level;
+  return -1;
+}
+
+const char *log_level_name(log_level_t level) {
+  return (int)level >= 0 && (int)level < NUM_LEVELS ? LEVEL_NAMES[level] : "?";
+}
+
+void log_set_request_id(uint64_t request_id) { REQUEST_ID = request_id; }
+
+/* Returns the calling thread's ring, registering it on first use. */
+static log_ring_t *self(void) {
+  log_ring_t *ring = SELF;
+  unsigned generation = __atomic_load_n(&GENERATION, __ATOMIC_ACQUIRE);
+  if (ring && ring->generation == generation)
+    return ring;
+  if ((ring = calloc(1, sizeof(*ring))) == NULL)
+    return NULL;
+  ring->generation = generation;
+  ring->thread_num = __atomic_add_fetch(&NUM_RINGS, 1, __ATOMIC_RELAXED);
+  ring->next = __atomic_load_n(&RINGS, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&RINGS, &ring->next, ring, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return SELF = ring;
+}
+
+void log_write(log_level_t level, const char *file, int line, const char *fmt, ...) {
+  log_ring_t *ring = self();
+  log_record_t *record;
+  struct timespec ts;
+  va_list args;
+  uint64_t head;
+
+  if (ring == NULL)
+    return;
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS) {
+    STORE(&ring->dropped, ring->dropped + 1);
+    return;
+  }
+  record = &ring->records[head % LOG_RING_RECORDS];
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  record->request_id = REQUEST_ID;
+  record->file = file;
+  record->line = line;
+  record->level = (int32_t)level;
+  va_start(args, fmt);
+  vsnprintf(record->message, LOG_MESSAGE_LEN, fmt, args);
+  va_end(args);
+  /* Publish the record to the drain thread. */
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Appends `record` to `out` as one logfmt line, returning its length. */
+static int format_record(char *out, size_t size, const log_record_t *record,
+                         int thread_num) {
+  time_t secs = (time_t)(record->timestamp_ns / 1000000000ull);
+  const char *file = strrchr(record->file, '/');
+  char message[LOG_MESSAGE_LEN * 2], stamp[32];
+  struct tm tm;
+  size_t len = 0;
+
+  /* Quote the message, dropping its trailing newline if it has one. */
+  for (const char *c = record->message; *c && len < sizeof(message) - 2; c++) {
+    if (*c == '\n' && c[1] == '\0')
+      break;
+    if (*c == '"' || *c == '\\')
+      message[len++] = '\\';
+    message[len++] = *c == '\n' ? ' ' : *c;
+  }
+  message[len] = '\0';
+  gmtime_r(&secs, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  return snprintf(out, size,
+                  "ts=%s.%06luZ level=%s role=%s tid=%d req=%lu src=%s:%d msg=\"%s\"\n",
+                  stamp, (unsigned long)(record->timestamp_ns % 1000000000ull / 1000),
+                  log_level_name((log_level_t)record->level), ROLE, thread_num,
+                  (unsigned long)record->request_id, file ? file + 1 : record->file,
+                  record->line, message);
+}
+
+static void write_all(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, buf, len);
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= (size_t)n;
+  }
+}
+
+void log_flush(void) {
+  unsigned generation = __atomic_load_n(&GENERATION, __ATOMIC_ACQUIRE);
+  char out[LOG_OUTPUT_BUFFER];
+  size_t used = 0;
+  uint64_t tail, head, dropped;
+  log_ring_t *ring;
+  int len;
+
+  pthread_mutex_lock(&DRAIN_LOCK);
+  for (ring = __atomic_load_n(&RINGS, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    if (ring->generation != generation)
+      continue;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (tail = ring->tail; tail != head; tail++) {
+      if (used + LOG_MESSAGE_LEN * 3 > sizeof(out)) {
+        write_all(out, used);
+        used = 0;
+      }
+      len = format_record(out + used, sizeof(out) - used,
+                          &ring->records[tail % LOG_RING_RECORDS], ring->thread_num);
+      used += len > 0 ? (size_t)len : 0;
+    }
+    /* Hand the drained slots back to the owner. */
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    if ((dropped = LOAD(&ring->dropped)) != ring->dropped_reported) {
+      len = snprintf(out + used, sizeof(out) - used,
+                     "level=warn role=%s tid=%d msg=\"dropped %lu log records\"\n", ROLE,
+                     ring->thread_num, (unsigned long)(dropped - ring->dropped_reported));
+      used += len > 0 ? (size_t)len : 0;
+      ring->dropped_reported = dropped;
+    }
+  }
+  write_all(out, used);
+  pthread_mutex_unlock(&DRAIN_LOCK);
+}
+
+static void *drain_thread(void *arg) {
+  while (1) {
+    usleep(LOG_DRAIN_MS * 1000);
+    log_flush();
+  }
+  return NULL;
+}
+
+void log_init(const char *role) {
+  static int registered = 0;
+  pthread_t drainer;
+
+  /* Rings inherited from the parent belong to threads that no longer exist. */
+  pthread_mutex_init(&DRAIN_LOCK, NULL);
+  __atomic_store_n(&RINGS, NULL, __ATOMIC_RELAXED);
+  __atomic_store_n(&NUM_RINGS, 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&GENERATION, 1, __ATOMIC_RELEASE);
+  snprintf(ROLE, sizeof(ROLE), "%s", role);
+
+  if (!registered) {
+    atexit(log_flush);
+    registered = 1;
+  }
+  if (pthread_create(&drainer, NULL, drain_thread, NULL) == 0)
+    pthread_detach(drainer);
+}
@@ -0,0 +1,80 @@
+#ifndef LOGGER_HEADER
+#define LOGGER_HEADER
+
+#include <stdint.h>
+
+/** Asynchronous structured logging.
+ *
+ *  Each thread appends fixed-size binary records (timestamp, level, request
+ *  id, source location and message) to its own ring buffer, so logging never
+ *  takes a lock or makes a system call on the calling thread. A background
+ *  thread drains every ring every `LOG_DRAIN_MS` milliseconds and writes the
+ *  records to stderr as logfmt lines:
+ *
+ *    ts=2026-10-18T08:53:01.123456Z level=debug role=airport-0 tid=3 req=17
+ *        src=airport_node.c:312 msg="SCHEDULE 0 1 2 3 4"
+ *
+ *  When a ring is full new records are dropped rather than blocking the
+ *  caller, and the number dropped is reported by the drain thread.
+ *
+ *  Messages below the current level cost one relaxed load. The level defaults
+ *  to `LOG_LEVEL_DEBUG` when built with `make LOG=1` and `LOG_LEVEL_WARN`
+ *  otherwise, and can be changed at runtime with `log_set_level`.
+ */
+
+#define LOG_DRAIN_MS 10
+#define LOG_RING_RECORDS 512
+#define LOG_MESSAGE_LEN 192
+
+typedef enum log_level_t {
+  LOG_LEVEL_OFF,
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG,
+  LOG_LEVEL_TRACE
+} log_level_t;
+
+#define LOG_AT(level, ...)                                    \
+  do {                                                        \
+    if ((int)(level) <= log_level())                          \
+      log_write((level), __FILE__, __LINE__, __VA_ARGS__);    \
+  } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+/** @brief Starts the drain thread of this process. Must be called again in a
+ *         forked child, whose records are then labelled with `role` instead;
+ *         records its parent had not drained yet are discarded.
+ */
+void log_init(const char *role);
+
+/** @brief Returns the current log level. */
+int log_level(void);
+
+/** @brief Sets the log level for every thread of this process. */
+void log_set_level(log_level_t level);
+
+/** @brief Parses a level name such as "debug", returning -1 if unknown. */
+int log_parse_level(const char *name);
+
+/** @brief Returns the name of `level`. */
+const char *log_level_name(log_level_t level);
+
+/** @brief Sets the request id attached to the calling thread's records, or 0
+ *         if it is not handling a request. */
+void log_set_request_id(uint64_t request_id);
+
+/** @brief Appends a record to the calling thread's ring. Use the `LOG` macros
+ *         instead, which skip formatting for disabled levels. */
+void log_write(log_level_t level, const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/** @brief Writes out every record appended so far. Called on exit. */
+void log_flush(void);
+
+#endif
@@ -0,0 +1,256 @@
+#include "metrics.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+/* Counters have a single writer, so a relaxed load and store is enough. */
+#define BUMP(p, v) STORE((p), LOAD(p) + (v))
+
+#define MAX_GAUGES 16
+
+static const char *COMMAND_NAMES[METRIC_NUM_COMMANDS] = {
+    "SCHEDULE", "PLANE_STATUS", "TIME_STATUS", "OTHER"};
+static const char *REJECT_NAMES[METRIC_NUM_REJECTS] = {"rate", "overload"};
+
+/* Metrics recorded by a single thread. */
+typedef struct metrics_thread_t {
+  struct metrics_thread_t *next;
+  uint64_t requests[METRIC_NUM_COMMANDS];
+  uint64_t errors[METRIC_NUM_COMMANDS];
+  histogram_t latency[METRIC_NUM_COMMANDS];
+  histogram_t forward_rtt;
+  histogram_t lock_wait;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t rejections[METRIC_NUM_REJECTS];
+  /* Per-airport series, `NUM_AIRPORTS` entries each. */
+  uint64_t *airport_requests;
+  uint64_t *airport_forwards;
+  uint64_t *airport_rtt_ns;
+} metrics_thread_t;
+
+typedef struct gauge_t {
+  const char *name;
+  const char *help;
+  long (*read)(void);
+} gauge_t;
+
+static const char *LABELS = "";
+static int NUM_AIRPORTS = 0;
+static metrics_thread_t *THREADS = NULL;
+static gauge_t GAUGES[MAX_GAUGES];
+static int NUM_GAUGES = 0;
+static __thread metrics_thread_t *SELF = NULL;
+
+void metrics_init(const char *labels, int num_airports) {
+  LABELS = strdup(labels);
+  NUM_AIRPORTS = num_airports;
+}
+
+uint64_t metrics_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Returns the calling thread's block, registering it on first use. */
+static metrics_thread_t *self(void) {
+  metrics_thread_t *t = SELF;
+  if (t)
+    return t;
+  if ((t = calloc(1, sizeof(*t))) == NULL)
+    abort();
+  if (NUM_AIRPORTS > 0) {
+    t->airport_requests = calloc((size_t)NUM_AIRPORTS, sizeof(uint64_t));
+    t->airport_forwards = calloc((size_t)NUM_AIRPORTS, sizeof(uint64_t));
+    t->airport_rtt_ns = calloc((size_t)NUM_AIRPORTS, sizeof(uint64_t));
+    if (!t->airport_requests || !t->airport_forwards || !t->airport_rtt_ns)
+      abort();
+  }
+  t->next = __atomic_load_n(&THREADS, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&THREADS, &t->next, t, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return SELF = t;
+}
+
+metric_cmd_t metrics_command(const char *request_type) {
+  for (int cmd = 0; cmd < METRIC_OTHER; cmd++)
+    if (strcmp(request_type, COMMAND_NAMES[cmd]) == 0)
+      return (metric_cmd_t)cmd;
+  return METRIC_OTHER;
+}
+
+void metrics_record_request(metric_cmd_t cmd, int airport, int is_error,
+                            uint64_t latency_ns) {
+  metrics_thread_t *t = self();
+  BUMP(&t->requests[cmd], 1);
+  if (is_error)
+    BUMP(&t->errors[cmd], 1);
+  hist_record(&t->latency[cmd], latency_ns);
+  if (airport >= 0 && airport < NUM_AIRPORTS)
+    BUMP(&t->airport_requests[airport], 1);
+}
+
+void metrics_record_forward(int airport, uint64_t rtt_ns) {
+  metrics_thread_t *t = self();
+  hist_record(&t->forward_rtt, rtt_ns);
+  if (airport >= 0 && airport < NUM_AIRPORTS) {
+    BUMP(&t->airport_forwards[airport], 1);
+    BUMP(&t->airport_rtt_ns[airport], rtt_ns);
+  }
+}
+
+void metrics_record_lock_wait(uint64_t wait_ns) {
+  hist_record(&self()->lock_wait, wait_ns);
+}
+
+void metrics_record_cache(int hit) {
+  metrics_thread_t *t = self();
+  if (hit)
+    BUMP(&t->cache_hits, 1);
+  else
+    BUMP(&t->cache_misses, 1);
+}
+
+void metrics_record_rejection(metric_reject_t reason) {
+  BUMP(&self()->rejections[reason], 1);
+}
+
+void metrics_register_gauge(const char *name, const char *help,
+                            long (*read)(void)) {
+  if (NUM_GAUGES < MAX_GAUGES)
+    GAUGES[NUM_GAUGES++] = (gauge_t){name, help, read};
+}
+
+/* Writes a histogram of nanosecond values as a Prometheus summary. The
+ * HELP and TYPE lines are only written when `help` is given, so several
+ * labelled series can share them. */
+static void format_summary(FILE *out, const char *name, const char *help,
+                           const char *extra_label, const histogram_t *h) {
+  static const double QUANTILES[] = {50, 90, 99, 99.9};
+  const char *sep = extra_label[0] ? "," : "";
+  if (help)
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+  for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++)
+    fprintf(out, "%s{%s%s%s,quantile=\"%g\"} %.9f\n", name, LABELS, sep,
+            extra_label, QUANTILES[q] / 100,
+            (double)hist_percentile(h, QUANTILES[q]) / 1e9);
+  fprintf(out, "%s_sum{%s%s%s} %.9f\n", name, LABELS, sep, extra_label,
+          (double)h->sum / 1e9);
+  fprintf(out, "%s_count{%s%s%s} %lu\n", name, LABELS, sep, extra_label,
+          (unsigned long)h->total);
+}
+
+char *metrics_format(size_t *len) {
+  uint64_t requests[METRIC_NUM_COMMANDS] = {0}, errors[METRIC_NUM_COMMANDS] = {0};
+  uint64_t *airport_totals = NULL, cache_hits = 0, cache_misses = 0;
+  uint64_t rejections[METRIC_NUM_REJECTS] = {0};
+  histogram_t *hists;
+  metrics_thread_t *t;
+  char *buf = NULL, label[64];
+  FILE *out;
+  int cmd, idx;
+
+  /* One merged histogram per command, then forward RTT and lock wait. */
+  if ((hists = calloc(METRIC_NUM_COMMANDS + 2, sizeof(histogram_t))) == NULL)
+    return NULL;
+  if (NUM_AIRPORTS > 0 &&
+      (airport_totals = calloc((size_t)NUM_AIRPORTS * 3, sizeof(uint64_t))) == NULL) {
+    free(hists);
+    return NULL;
+  }
+  if ((out = open_memstream(&buf, len)) == NULL) {
+    free(hists);
+    free(airport_totals);
+    return NULL;
+  }
+
+  for (t = __atomic_load_n(&THREADS, __ATOMIC_ACQUIRE); t; t = t->next) {
+    for (cmd = 0; cmd < METRIC_NUM_COMMANDS; cmd++) {
+      requests[cmd] += LOAD(&t->requests[cmd]);
+      errors[cmd] += LOAD(&t->errors[cmd]);
+      hist_merge(&hists[cmd], &t->latency[cmd]);
+    }
+    hist_merge(&hists[METRIC_NUM_COMMANDS], &t->forward_rtt);
+    hist_merge(&hists[METRIC_NUM_COMMANDS + 1], &t->lock_wait);
+    cache_hits += LOAD(&t->cache_hits);
+    cache_misses += LOAD(&t->cache_misses);
+    for (idx = 0; idx < METRIC_NUM_REJECTS; idx++)
+      rejections[idx] += LOAD(&t->rejections[idx]);
+    for (idx = 0; idx < NUM_AIRPORTS; idx++) {
+      airport_totals[idx * 3] += LOAD(&t->airport_requests[idx]);
+      airport_totals[idx * 3 + 1] += LOAD(&t->airport_forwards[idx]);
+      airport_totals[idx * 3 + 2] += LOAD(&t->airport_rtt_ns[idx]);
+    }
+  }
+
+  fprintf(out, "# HELP atc_requests_total Requests handled, by command.\n"
+               "# TYPE atc_requests_total counter\n");
+  for (cmd = 0; cmd < METRIC_NUM_COMMANDS; cmd++)
+    fprintf(out, "atc_requests_total{%s,command=\"%s\"} %lu\n", LABELS,
+            COMMAND_NAMES[cmd], (unsigned long)requests[cmd]);
+  fprintf(out, "# HELP atc_request_errors_total Requests answered with an "
+               "error, by command.\n"
+               "# TYPE atc_request_errors_total counter\n");
+  for (cmd = 0; cmd < METRIC_NUM_COMMANDS; cmd++)
+    fprintf(out, "atc_request_errors_total{%s,command=\"%s\"} %lu\n", LABELS,
+            COMMAND_NAMES[cmd], (unsigned long)errors[cmd]);
+  for (cmd = 0; cmd < METRIC_NUM_COMMANDS; cmd++) {
+    snprintf(label, sizeof(label), "command=\"%s\"", COMMAND_NAMES[cmd]);
+    format_summary(out, "atc_request_latency_seconds",
+                   cmd == 0 ? "Time from reading a request to sending its "
+                              "response."
+                            : NULL,
+                   label, &hists[cmd]);
+  }
+  fprintf(out, "# HELP atc_rejected_total Requests and connections turned "
+               "away as busy, by reason.\n"
+               "# TYPE atc_rejected_total counter\n");
+  for (idx = 0; idx < METRIC_NUM_REJECTS; idx++)
+    fprintf(out, "atc_rejected_total{%s,reason=\"%s\"} %lu\n", LABELS,
+            REJECT_NAMES[idx], (unsigned long)rejections[idx]);
+  format_summary(out, "atc_forward_rtt_seconds",
+                 "Round trip of requests forwarded to airport nodes.", "",
+                 &hists[METRIC_NUM_COMMANDS]);
+  format_summary(out, "atc_gate_lock_wait_seconds",
+                 "Time spent waiting for gate locks held by another thread.", "",
+                 &hists[METRIC_NUM_COMMANDS + 1]);
+
+  if (NUM_AIRPORTS > 0) {
+    fprintf(out, "# HELP atc_airport_requests_total Requests for each airport.\n"
+                 "# TYPE atc_airport_requests_total counter\n");
+    for (idx = 0; idx < NUM_AIRPORTS; idx++)
+      fprintf(out, "atc_airport_requests_total{%s,airport=\"%d\"} %lu\n",
+              LABELS, idx, (unsigned long)airport_totals[idx * 3]);
+    fprintf(out, "# HELP atc_airport_forward_rtt_seconds Round trip of "
+                 "requests forwarded to each airport.\n"
+                 "# TYPE atc_airport_forward_rtt_seconds summary\n");
+    for (idx = 0; idx < NUM_AIRPORTS; idx++) {
+      fprintf(out, "atc_airport_forward_rtt_seconds_sum{%s,airport=\"%d\"} %.9f\n",
+              LABELS, idx, (double)airport_totals[idx * 3 + 2] / 1e9);
+      fprintf(out, "atc_airport_forward_rtt_seconds_count{%s,airport=\"%d\"} %lu\n",
+              LABELS, idx, (unsigned long)airport_totals[idx * 3 + 1]);
+    }
+    fprintf(out, "# HELP atc_cache_lookups_total Reads looked up in the response "
+                 "cache, by result.\n"
+                 "# TYPE atc_cache_lookups_total counter\n"
+                 "atc_cache_lookups_total{%s,result=\"hit\"} %lu\n"
+                 "atc_cache_lookups_total{%s,result=\"miss\"} %lu\n",
+            LABELS, (unsigned long)cache_hits, LABELS, (unsigned long)cache_misses);
+  }
+
+  for (idx = 0; idx < NUM_GAUGES; idx++)
+    fprintf(out, "# HELP atc_%s %s\n# TYPE atc_%s gauge\natc_%s{%s} %ld\n",
+            GAUGES[idx].name, GAUGES[idx].help, GAUGES[idx].name,
+            GAUGES[idx].name, LABELS, GAUGES[idx].read());
+
+  fclose(out);
+  free(hists);
+  free(airport_totals);
+  return buf;
+}
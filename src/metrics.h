@@ -0,0 +1,81 @@
+#ifndef METRICS_HEADER
+#define METRICS_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include "histogram.h"
+
+/** Low-overhead runtime metrics for the controller and airport nodes.
+ *
+ *  Each thread records into its own block of counters and histograms, which
+ *  is registered on first use and never freed. Recording only touches the
+ *  calling thread's block, and readers sum every block with relaxed loads, so
+ *  neither side takes a lock.
+ *
+ *  `metrics_format` renders everything in the Prometheus text exposition
+ *  format; the controller serves it through the `STATS` command and, when
+ *  started with `-m PORT`, over HTTP for scraping.
+ */
+
+typedef enum metric_cmd_t {
+  METRIC_SCHEDULE,
+  METRIC_PLANE_STATUS,
+  METRIC_TIME_STATUS,
+  METRIC_OTHER,
+  METRIC_NUM_COMMANDS
+} metric_cmd_t;
+
+/* Why a request or connection was turned away with `Error: Busy`. */
+typedef enum metric_reject_t {
+  METRIC_REJECT_RATE,     /* the client was over its rate limit */
+  METRIC_REJECT_OVERLOAD, /* too much work was already queued or in flight */
+  METRIC_NUM_REJECTS
+} metric_reject_t;
+
+/** @brief Sets up metrics for this process. Must be called before any other
+ *         thread records metrics.
+ *
+ *  @param labels       Prometheus labels attached to every series, such as
+ *                      `role="airport",airport="2"`.
+ *  @param num_airports Number of airports to keep per-airport series for, or
+ *                      0 to keep none.
+ */
+void metrics_init(const char *labels, int num_airports);
+
+/** @brief Returns a monotonic timestamp in nanoseconds. */
+uint64_t metrics_now_ns(void);
+
+/** @brief Maps a request's command name to its metric category. */
+metric_cmd_t metrics_command(const char *request_type);
+
+/** @brief Records a handled request and the time taken to respond to it.
+ *         `airport` is ignored if it has no per-airport series. */
+void metrics_record_request(metric_cmd_t cmd, int airport, int is_error,
+                            uint64_t latency_ns);
+
+/** @brief Records the round trip of a request forwarded to an airport. */
+void metrics_record_forward(int airport, uint64_t rtt_ns);
+
+/** @brief Records a lookup in the controller's response cache. */
+void metrics_record_cache(int hit);
+
+/** @brief Records a request or connection turned away for `reason`. */
+void metrics_record_rejection(metric_reject_t reason);
+
+/** @brief Records how long a thread waited to acquire a gate lock. */
+void metrics_record_lock_wait(uint64_t wait_ns);
+
+/** @brief Registers a gauge whose value is read by calling `read` each time
+ *         metrics are formatted. */
+void metrics_register_gauge(const char *name, const char *help,
+                            long (*read)(void));
+
+/** @brief Renders every metric in the Prometheus text format.
+ *
+ *  @returns A buffer allocated with `malloc`, which the caller must free, or
+ *           NULL if memory could not be allocated. Its length is stored in
+ *           `len`.
+ */
+char *metrics_format(size_t *len);
+
+#endif
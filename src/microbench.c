@@ -0,0 +1,271 @@
+/*
+ * microbench.c - In-process benchmarks for the airport scheduling core
+ *
+ * Calls the functions of airport.c directly, with no sockets or request
+ * parsing involved, over synthetic airports of varying size and occupancy.
+ * Every measurement is printed as one line of
+ *
+ *   <operation> <gates> <occupancy%> <threads> <ns/op> <Mops/s>
+ *
+ * so runs can be compared or plotted as scaling curves. ns/op is the average
+ * latency seen by each thread and Mops/s the combined throughput of all
+ * threads.
+ *
+ * The formatting of TIME_STATUS responses is also timed, with `sprintf` as
+ * the node used to and with `format_time_status`; there ns/op is per line
+ * and Mops/s is millions of lines per second.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "airport.h"
+#include "xorshift.h"
+
+#define MAX_THREADS 64
+
+static const int GATE_COUNTS[] = {1, 10, 100, 1000, 10000};
+static const int OCCUPANCIES[] = {0, 50, 90};
+
+#define NUM_GATE_COUNTS (int)(sizeof(GATE_COUNTS) / sizeof(GATE_COUNTS[0]))
+#define NUM_OCCUPANCIES (int)(sizeof(OCCUPANCIES) / sizeof(OCCUPANCIES[0]))
+
+/** Options controlling the size of each run. */
+static int MAX_GATES = 10000;
+static int MAX_BENCH_THREADS = 8;
+static long MIN_OPS = 200000;
+static int LOCK_PROFILE = 0;
+
+/* The airport under test, plus a pristine copy of its slots used to undo the
+ * bookings made by mutating benchmarks. */
+static time_slot_t *TEMPLATE_SLOTS = NULL;
+static int NUM_PLANES = 0;
+
+typedef struct worker_arg_t {
+  int op;
+  int idx;
+  long ops;
+  uint64_t rng;
+  pthread_barrier_t *barrier;
+} worker_arg_t;
+
+enum { OP_ASSIGN, OP_SEARCH, OP_LOOKUP, OP_SCHEDULE, NUM_OPS };
+
+static const char *OP_NAMES[NUM_OPS] = {"assign_in_gate", "search_gate",
+                                        "lookup_plane", "schedule_plane"};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int random_below(uint64_t *rng, int bound) {
+  return (int)(xorshift_next(rng) % (uint64_t)bound);
+}
+
+/* Fills each gate with random bookings until `occupancy` percent of its slots
+ * are taken, then saves the result as the template. */
+static void build_airport(int num_gates, int occupancy) {
+  airport_t *airport = create_airport(num_gates);
+  uint64_t rng = 0x2545f4914f6cdd1dull;
+  size_t slot_bytes = sizeof(time_slot_t) * (size_t)NUM_TIME_SLOTS * (size_t)num_gates;
+  int target = NUM_TIME_SLOTS * occupancy / 100;
+
+  if (airport == NULL) {
+    fprintf(stderr, "Cannot allocate airport of %d gates\n", num_gates);
+    exit(1);
+  }
+  use_airport(airport);
+  set_lock_profiling(LOCK_PROFILE);
+  NUM_PLANES = 0;
+  for (int gate_idx = 0; gate_idx < num_gates; gate_idx++) {
+    gate_t *gate = get_gate_by_idx(gate_idx);
+    int used = 0, attempts = 0;
+    while (used < target && attempts++ < 1000) {
+      int duration = random_below(&rng, 4);
+      int start = random_below(&rng, NUM_TIME_SLOTS - duration);
+      if (assign_in_gate(gate, ++NUM_PLANES, start, duration, 0) >= 0)
+        used += duration + 1;
+    }
+  }
+  TEMPLATE_SLOTS = realloc(TEMPLATE_SLOTS, slot_bytes);
+  memcpy(TEMPLATE_SLOTS, airport->slots, slot_bytes);
+}
+
+static void reset_airport(void) {
+  airport_t *airport = get_airport();
+  memcpy(airport->slots, TEMPLATE_SLOTS,
+         sizeof(time_slot_t) * (size_t)NUM_TIME_SLOTS * (size_t)airport->num_gates);
+  rebuild_occupancy(airport);
+}
+
+static void free_airport(void) {
+  airport_t *airport = get_airport();
+  free(airport->slots);
+  free(airport->busy);
+  free(airport);
+  use_airport(NULL);
+}
+
+/* Runs `ops` operations of one kind, returning a value derived from the
+ * results so the compiler cannot discard the calls. */
+static long run_ops(int op, long ops, uint64_t *rng, int plane_base) {
+  int num_gates = get_airport()->num_gates;
+  long sink = 0;
+  for (long i = 0; i < ops; i++) {
+    int start = random_below(rng, NUM_TIME_SLOTS - 3);
+    switch (op) {
+    case OP_ASSIGN:
+      sink += assign_in_gate(get_gate_by_idx(random_below(rng, num_gates)),
+                             plane_base + (int)i, start, 2, 4);
+      break;
+    case OP_SEARCH:
+      /* Half of the searches are for planes that are not scheduled. */
+      sink += search_gate(get_gate_by_idx(random_below(rng, num_gates)),
+                          random_below(rng, 2 * NUM_PLANES + 1));
+      break;
+    case OP_LOOKUP:
+      sink += lookup_plane_in_airport(random_below(rng, 2 * NUM_PLANES + 1))
+                  .gate_number;
+      break;
+    default:
+      sink += schedule_plane(plane_base + (int)i, start, 2, 4).gate_number;
+    }
+  }
+  return sink;
+}
+
+static void *worker(void *arg) {
+  worker_arg_t *w = arg;
+  static volatile long sink;
+  pthread_barrier_wait(w->barrier);
+  sink += run_ops(w->op, w->ops, &w->rng, NUM_PLANES + 1 + w->idx * (int)w->ops);
+  return NULL;
+}
+
+/* Times `op` with `num_threads` threads sharing the airport, returning the
+ * elapsed time divided by the total number of operations. Mutating operations
+ * run on a fresh copy of the template airport each time. */
+static double measure(int op, int num_threads) {
+  pthread_t threads[MAX_THREADS];
+  worker_arg_t args[MAX_THREADS];
+  pthread_barrier_t barrier;
+  long ops = MIN_OPS / num_threads;
+  uint64_t begin, end;
+
+  /* Scanning operations are far slower on large airports; scale the count so
+   * every configuration runs for a similar time. */
+  if (op == OP_LOOKUP || op == OP_SCHEDULE)
+    ops = ops / (get_airport()->num_gates / 10 + 1) + 100;
+
+  reset_airport();
+  pthread_barrier_init(&barrier, NULL, (unsigned)num_threads + 1);
+  for (int t = 0; t < num_threads; t++) {
+    args[t] = (worker_arg_t){.op = op, .idx = t, .ops = ops,
+                             .rng = xorshift_seed(t),
+                             .barrier = &barrier};
+    pthread_create(&threads[t], NULL, worker, &args[t]);
+  }
+  begin = now_ns();
+  pthread_barrier_wait(&barrier);
+  for (int t = 0; t < num_threads; t++)
+    pthread_join(threads[t], NULL);
+  end = now_ns();
+  pthread_barrier_destroy(&barrier);
+  return (double)(end - begin) / (double)(ops * num_threads);
+}
+
+/* Formats the TIME_STATUS lines of every slot of gate 0 the way the node did
+ * before `format_time_status`, one `sprintf` per line. */
+static size_t format_time_status_sprintf(char *dst, const time_slot_t *slots) {
+  size_t len = 0;
+  for (int idx = 0; idx < NUM_TIME_SLOTS; idx++) {
+    const time_slot_t *ts = &slots[idx];
+    len += (size_t)sprintf(dst + len, "AIRPORT %d GATE %d %02d:%02d: %c - %d\n", 0, 0,
+                           IDX_TO_HOUR(idx), (int)IDX_TO_MINS(idx),
+                           ts->status == 1 ? 'A' : 'F', ts->status == 1 ? ts->plane_id : 0);
+  }
+  return len;
+}
+
+/* Times formatting every slot of gate 0 `fast`ly or with `sprintf`,
+ * returning the time per line. */
+static double measure_format(int fast) {
+  static char lines[MAX_TIME_SLOTS * TIME_STATUS_LINE_MAX];
+  static volatile size_t sink;
+  const time_slot_t *slots = get_time_slot_by_idx(get_gate_by_idx(0), 0);
+  long reps = MIN_OPS / NUM_TIME_SLOTS + 1;
+  uint64_t begin = now_ns();
+  for (long i = 0; i < reps; i++)
+    sink += fast ? format_time_status(lines, 0, 0, slots, 0, NUM_TIME_SLOTS - 1)
+                 : format_time_status_sprintf(lines, slots);
+  return (double)(now_ns() - begin) / (double)(reps * NUM_TIME_SLOTS);
+}
+
+static void print_usage(char *program_name) {
+  printf("Usage: %s [-g MAX_GATES] [-t MAX_THREADS] [-n OPS] [-H SLOTS] [-l]\n", program_name);
+  printf("  -g: Largest airport to benchmark (default 10000 gates).\n");
+  printf("  -t: Largest thread count for scaling runs (default 8).\n");
+  printf("  -n: Operations per measurement (default 200000).\n");
+  printf("  -H: Time slots per gate: 48 (default), 96, 288 or 2016.\n");
+  printf("  -l: Collect per-gate lock statistics while benchmarking.\n");
+  printf("  -h: Print this help message and exit.\n");
+  exit(0);
+}
+
+int main(int argc, char *argv[]) {
+  int c, num_slots = DEFAULT_TIME_SLOTS;
+  while ((c = getopt(argc, argv, "g:t:n:H:lh")) != -1) {
+    switch (c) {
+    case 'g': MAX_GATES = atoi(optarg); break;
+    case 't': MAX_BENCH_THREADS = atoi(optarg); break;
+    case 'n': MIN_OPS = atol(optarg); break;
+    case 'H': num_slots = atoi(optarg); break;
+    case 'l': LOCK_PROFILE = 1; break;
+    case 'h': print_usage(argv[0]); break;
+    default: return 1;
+    }
+  }
+  if (MAX_BENCH_THREADS < 1 || MAX_BENCH_THREADS > MAX_THREADS || MIN_OPS < 1) {
+    fprintf(stderr, "-t must be between 1-%d and -n greater than 0.\n",
+            MAX_THREADS);
+    return 1;
+  }
+  if (set_time_slots(num_slots) < 0) {
+    fprintf(stderr, "-H must be 48, 96, 288 or 2016.\n");
+    return 1;
+  }
+
+  printf("%-16s %6s %5s %7s %10s %9s\n", "operation", "gates", "occ%",
+         "threads", "ns/op", "Mops/s");
+  for (int g = 0; g < NUM_GATE_COUNTS && GATE_COUNTS[g] <= MAX_GATES; g++) {
+    for (int o = 0; o < NUM_OCCUPANCIES; o++) {
+      build_airport(GATE_COUNTS[g], OCCUPANCIES[o]);
+      for (int op = 0; op < NUM_OPS; op++) {
+        for (int threads = 1; threads <= MAX_BENCH_THREADS; threads *= 2) {
+          /* The per-gate functions are not thread safe on their own. */
+          if ((op == OP_ASSIGN || op == OP_SEARCH) && threads > 1)
+            break;
+          double ns = measure(op, threads);
+          printf("%-16s %6d %5d %7d %10.1f %9.3f\n", OP_NAMES[op],
+                 GATE_COUNTS[g], OCCUPANCIES[o], threads, ns * threads,
+                 1e3 / ns);
+        }
+      }
+      free_airport();
+    }
+  }
+
+  for (int o = 0; o < NUM_OCCUPANCIES; o++) {
+    build_airport(1, OCCUPANCIES[o]);
+    for (int fast = 0; fast <= 1; fast++) {
+      double ns = measure_format(fast);
+      printf("%-16s %6d %5d %7d %10.1f %9.3f\n", fast ? "format_fast" : "format_sprintf", 1,
+             OCCUPANCIES[o], 1, ns, 1e3 / ns);
+    }
+    free_airport();
+  }
+  return 0;
+}
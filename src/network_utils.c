@@ -45,12 +45,75 @@ int open_clientfd(char *hostname, char *port) {
     return clientfd;
 }
 
-/* Open and return a listening socket on the given port. This function is
- * reentrant and protocol-independent.
+/*
+ * connect_ipv4 - Open a socket of type `type` and connect it to `addr`. A
+ *     non-blocking socket may be returned before the connection is
+ *     established.
+ */
+static int connect_ipv4(const struct sockaddr_in *addr, int type) {
+  int clientfd, saved_errno;
+
+  if ((clientfd = socket(AF_INET, type, 0)) < 0)
+    return -1;
+  if (connect(clientfd, (const SA *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+    saved_errno = errno;
+    close(clientfd);
+    errno = saved_errno;
+    return -1;
+  }
+  return clientfd;
+}
+
+/*
+ * open_clientfd_nb - Start a non-blocking connection to `addr` and return
+ *     its socket descriptor, possibly before the connection is established.
+ *     The socket becomes writable once the connect completes, and SO_ERROR
+ *     then holds its result.
+ *
+ *     On error, returns -1 and sets errno.
+ */
+int open_clientfd_nb(const struct sockaddr_in *addr) {
+  return connect_ipv4(addr, SOCK_STREAM | SOCK_NONBLOCK);
+}
+
+/*
+ * open_clientfd_addr - Open a connection to `addr`, resolved beforehand by
+ *     `resolve_ipv4`, and return a socket descriptor ready for reading and
+ *     writing.
+ *
+ *     On error, returns -1 and sets errno.
+ */
+int open_clientfd_addr(const struct sockaddr_in *addr) {
+  return connect_ipv4(addr, SOCK_STREAM);
+}
+
+/*
+ * resolve_ipv4 - Look up the IPv4 address of <hostname, port> into `addr`,
+ *     so connections to it need no further lookups.
+ *
+ *     Returns 0 on success, or -1 if the host has no IPv4 address.
+ */
+int resolve_ipv4(char *hostname, int port, struct sockaddr_in *addr) {
+  struct addrinfo hints, *listp;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(hostname, NULL, &hints, &listp) != 0)
+    return -1;
+  memcpy(addr, listp->ai_addr, sizeof(*addr));
+  addr->sin_port = htons((uint16_t)port);
+  freeaddrinfo(listp);
+  return 0;
+}
+
+/* Open and return a listening socket on the given port, sharing it with
+ * other sockets if `reuseport` is set. This function is reentrant and
+ * protocol-independent.
  *
  * On error, returns -1 and sets errno.
  */
-int open_listenfd(char *port) {
+static int listen_on(char *port, int reuseport) {
   struct addrinfo hints, *listp, *p;
   int listenfd, rc, optval = 1;
 
@@ -71,6 +134,14 @@ int open_listenfd(char *port) {
     /* Eliminates "Address already in use" error from bind */
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval,
                sizeof(int));
+    /* Lets other sockets bind the same port, the kernel spreading new
+     * connections across them */
+    if (reuseport &&
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&optval,
+                   sizeof(int)) < 0) {
+      close(listenfd);
+      continue;
+    }
 
     /* Bind the descriptor to the address */
     if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -91,6 +162,22 @@ int open_listenfd(char *port) {
   return listenfd;
 }
 
+/*
+ * open_listenfd - Open and return a listening socket on the given port.
+ *
+ * On error, returns -1 and sets errno.
+ */
+int open_listenfd(char *port) { return listen_on(port, 0); }
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but with SO_REUSEPORT set, so
+ *     every socket opened this way on the same port by the same user accepts
+ *     its own share of new connections.
+ *
+ * On error, returns -1 and sets errno.
+ */
+int open_listenfd_reuseport(char *port) { return listen_on(port, 1); }
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -134,6 +221,59 @@ ssize_t rio_writen(int fd, char *usrbuf, size_t n) {
   return (ssize_t)n;
 }
 
+/*
+ * wbuf_init - Associate a descriptor with an empty output buffer. With fd -1
+ *    the buffer only accumulates, growing as needed, until its contents are
+ *    taken by the caller.
+ */
+void wbuf_init(wbuf_t *wb, int fd) {
+  wb->wb_fd = fd;
+  wb->wb_len = 0;
+  wb->wb_cap = 0;
+  wb->wb_buf = NULL;
+}
+
+/*
+ * wbuf_write - Buffer n bytes, flushing first if a descriptor is attached and
+ *    the buffer would pass WBUF_FLUSH_SIZE. Returns n, or -1 on error.
+ */
+ssize_t wbuf_write(wbuf_t *wb, const void *usrbuf, size_t n) {
+  if (wb->wb_fd >= 0 && wb->wb_len + n > WBUF_FLUSH_SIZE && wbuf_flush(wb) < 0)
+    return -1;
+  if (wb->wb_len + n > wb->wb_cap) {
+    size_t cap = wb->wb_cap ? wb->wb_cap : WBUF_FLUSH_SIZE;
+    char *buf;
+    while (cap < wb->wb_len + n)
+      cap *= 2;
+    if ((buf = realloc(wb->wb_buf, cap)) == NULL)
+      return -1;
+    wb->wb_buf = buf;
+    wb->wb_cap = cap;
+  }
+  memcpy(wb->wb_buf + wb->wb_len, usrbuf, n);
+  wb->wb_len += n;
+  return (ssize_t)n;
+}
+
+/*
+ * wbuf_flush - Write out everything buffered with a single rio_writen
+ */
+ssize_t wbuf_flush(wbuf_t *wb) {
+  ssize_t n = 0;
+  if (wb->wb_len > 0 && wb->wb_fd >= 0)
+    n = rio_writen(wb->wb_fd, wb->wb_buf, wb->wb_len);
+  wb->wb_len = 0;
+  return n;
+}
+
+/*
+ * wbuf_free - Release the memory of an output buffer, discarding its contents
+ */
+void wbuf_free(wbuf_t *wb) {
+  free(wb->wb_buf);
+  wbuf_init(wb, wb->wb_fd);
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
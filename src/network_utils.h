@@ -24,7 +24,11 @@ extern char **environ; /* Defined by libc */
 typedef struct sockaddr SA;
 
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_nb(const struct sockaddr_in *addr);
+int open_clientfd_addr(const struct sockaddr_in *addr);
+int resolve_ipv4(char *hostname, int port, struct sockaddr_in *addr);
 int open_listenfd(char *port);
+int open_listenfd_reuseport(char *port);
 void gai_error(int code, char *msg);
 
 #define RIO_BUFSIZE 8192
@@ -40,4 +44,19 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 ssize_t rio_writen(int fd, char *usrbuf, size_t n);
 
+/* Growable output buffer. A response is written into one of these and sent
+ * with a single write once complete, rather than one write per line. */
+#define WBUF_FLUSH_SIZE 8192
+typedef struct {
+    int wb_fd;     /* Descriptor flushed to, or -1 to only accumulate */
+    size_t wb_len; /* Bytes buffered */
+    size_t wb_cap; /* Bytes allocated */
+    char *wb_buf;  /* Buffered bytes, allocated on first write */
+} wbuf_t;
+
+void wbuf_init(wbuf_t *wb, int fd);
+ssize_t wbuf_write(wbuf_t *wb, const void *usrbuf, size_t n);
+ssize_t wbuf_flush(wbuf_t *wb);
+void wbuf_free(wbuf_t *wb);
+
 #endif
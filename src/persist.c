@@ -0,0 +1,489 @@
+#include "persist.h"
+#include <limits.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/** Write-ahead logging and snapshots for airport nodes. See `persist.h` for
+ *  the on-disk layout and durability guarantees.
+ */
+
+/* State shared by the request threads and the flusher thread of one node. */
+typedef struct persist_state_t {
+  airport_t *airport;
+  int airport_id;
+  int shard; /* -1 if the node serves the whole airport */
+  pthread_t flusher;
+  int running;
+
+  /* Request threads write their records to `wal_fd` themselves, each at the
+   * offset its lsn reserves, holding `rotate_lock` for reading so none of
+   * them waits for another. Only the flusher takes it for writing, to swap
+   * `wal_fd`, `wal_base` and `base_lsn` when it rotates the log. */
+  pthread_rwlock_t rotate_lock;
+  int wal_fd;
+  off_t wal_base;    /* offset in `wal_fd` of the record numbered `base_lsn` */
+  uint64_t base_lsn;
+  uint64_t next_lsn; /* reserved with an atomic fetch-add */
+  int unsynced;      /* records written since the last fdatasync, atomic */
+
+  /* Wakes the flusher early when the node shuts down. */
+  pthread_mutex_t mutex;
+  pthread_cond_t wake_flusher;
+  uint64_t records_since_snapshot; /* only touched by the flusher */
+} persist_state_t;
+
+static char *PERSIST_DIR = NULL;
+static persist_state_t PERSIST;
+
+void persist_set_dir(const char *dir) {
+  free(PERSIST_DIR);
+  PERSIST_DIR = dir ? strdup(dir) : NULL;
+}
+
+int persist_enabled(void) { return PERSIST_DIR != NULL; }
+
+uint64_t persist_checksum64(const void *data, size_t len, uint64_t seed) {
+  const uint64_t *words = data;
+  uint64_t hash = seed ^ 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < len / sizeof(uint64_t); i++) {
+    hash = (hash ^ words[i]) * 0x100000001b3ull;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+uint32_t persist_checksum(const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void node_path(char *buf, const char *dir, int airport_id, int shard,
+                      const char *suffix) {
+  if (shard < 0)
+    snprintf(buf, PATH_MAX, "%s/airport-%d%s", dir, airport_id, suffix);
+  else
+    snprintf(buf, PATH_MAX, "%s/airport-%d-shard-%d%s", dir, airport_id,
+             shard, suffix);
+}
+
+static void persist_path(char *buf, const char *suffix) {
+  node_path(buf, PERSIST_DIR, PERSIST.airport_id, PERSIST.shard, suffix);
+}
+
+static uint32_t record_checksum(const wal_record_t *rec) {
+  return persist_checksum(rec, offsetof(wal_record_t, checksum));
+}
+
+static uint32_t header_checksum(const wal_header_t *hdr) {
+  return persist_checksum(hdr, offsetof(wal_header_t, checksum));
+}
+
+/* Reads the slots per gate the log or schedule image `path` was written
+ * with into `num_slots`, leaving it 0 if the file is missing, empty or an
+ * image this version ignores. Returns -1 if it is a log without a valid
+ * header, which cannot be told. */
+static int stored_horizon(const char *path, int is_log, uint32_t *num_slots) {
+  union {
+    wal_header_t wal;
+    schedule_image_header_t image;
+  } hdr;
+  ssize_t len;
+  int fd;
+
+  *num_slots = 0;
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return 0;
+  len = pread(fd, &hdr, sizeof(hdr), 0);
+  close(fd);
+  if (is_log) {
+    // a header torn by a crash as the log was created leaves no records
+    if (len < (ssize_t)sizeof(wal_header_t))
+      return 0;
+    if (hdr.wal.magic != WAL_MAGIC || hdr.wal.version != WAL_VERSION ||
+        hdr.wal.checksum != header_checksum(&hdr.wal))
+      return -1;
+    *num_slots = hdr.wal.num_slots;
+  } else if (len >= (ssize_t)sizeof(schedule_image_header_t) &&
+             hdr.image.magic == SCHEDULE_IMAGE_MAGIC &&
+             hdr.image.version == SCHEDULE_IMAGE_VERSION) {
+    *num_slots = hdr.image.num_slots;
+  }
+  return 0;
+}
+
+int persist_check_horizon(const char *dir, int airport_id, int shard) {
+  static const char *suffixes[] = {".snap", ".wal.prev", ".wal"};
+  char path[PATH_MAX];
+  uint32_t num_slots;
+  int ret = 0;
+
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    node_path(path, dir, airport_id, shard, suffixes[i]);
+    if (stored_horizon(path, i > 0, &num_slots) < 0) {
+      fprintf(stderr, "[Persist] %s has no valid log header\n", path);
+      ret = -1;
+    } else if (num_slots != 0 && num_slots != (uint32_t)NUM_TIME_SLOTS) {
+      fprintf(stderr, "[Persist] %s was written with %u slots per gate, not %d\n", path,
+              num_slots, NUM_TIME_SLOTS);
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+/* Opens the log `path` for writing, first cutting it to `valid_len` bytes
+ * unless that is negative, and starts it with a header if it is empty. Sets
+ * `end` to the offset at which the next record goes. Not `O_APPEND`, as
+ * records are placed with `pwrite`. */
+static int open_log(const char *path, off_t valid_len, off_t *end) {
+  wal_header_t hdr = {WAL_MAGIC, WAL_VERSION, (uint32_t)NUM_TIME_SLOTS, 0};
+  struct stat st;
+  int fd;
+
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)
+    return -1;
+  /* Drop any torn record at the end so new appends follow valid ones. */
+  if (valid_len >= 0 && ftruncate(fd, valid_len) < 0)
+    perror("[Persist] ftruncate");
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    hdr.checksum = header_checksum(&hdr);
+    if (rio_writen(fd, (char *)&hdr, sizeof(hdr)) < 0)
+      perror("[Persist] write");
+  }
+  *end = fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(hdr) ? st.st_size
+                                                                  : (off_t)sizeof(hdr);
+  return fd;
+}
+
+static uint64_t image_checksum(const schedule_image_header_t *hdr,
+                               const time_slot_t *slots, size_t slot_bytes) {
+  uint64_t hash = persist_checksum64(
+      hdr, offsetof(schedule_image_header_t, checksum), 0);
+  return persist_checksum64(slots, slot_bytes, hash);
+}
+
+/* Maps the schedule image and, when it has at least as many gates as this
+ * airport, serves from the mapping in place. Returns the image's lsn, or 0 if
+ * there is no usable image. */
+static uint64_t load_snapshot(airport_t *airport) {
+  char path[PATH_MAX];
+  struct stat st;
+  schedule_image_header_t *hdr;
+  time_slot_t *slots;
+  size_t slot_bytes, gate_bytes = sizeof(time_slot_t) * (size_t)NUM_TIME_SLOTS;
+  int fd, num_gates;
+  uint64_t lsn;
+
+  persist_path(path, ".snap");
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || st.st_size < SCHEDULE_IMAGE_DATA_OFFSET) {
+    close(fd);
+    return 0;
+  }
+  /* Private and writable: pages are read from the page cache on first touch
+   * and copied only when a gate is modified. */
+  hdr = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+             fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED)
+    return 0;
+
+  slot_bytes = gate_bytes * hdr->num_gates;
+  slots = (time_slot_t *)((char *)hdr + SCHEDULE_IMAGE_DATA_OFFSET);
+  if (hdr->magic != SCHEDULE_IMAGE_MAGIC ||
+      hdr->version != SCHEDULE_IMAGE_VERSION ||
+      hdr->data_offset != SCHEDULE_IMAGE_DATA_OFFSET ||
+      hdr->slot_size != sizeof(time_slot_t) ||
+      hdr->num_slots != NUM_TIME_SLOTS ||
+      SCHEDULE_IMAGE_DATA_OFFSET + slot_bytes > (size_t)st.st_size ||
+      hdr->checksum != image_checksum(hdr, slots, slot_bytes)) {
+    fprintf(stderr, "[Airport %d] Ignoring invalid schedule image %s\n",
+            PERSIST.airport_id, path);
+    munmap(hdr, (size_t)st.st_size);
+    return 0;
+  }
+
+  lsn = hdr->lsn;
+  num_gates = (int)hdr->num_gates;
+  if (num_gates >= airport->num_gates) {
+    attach_airport_slots(airport, slots, 1);
+    return lsn;
+  }
+
+  /* The airport grew since the image was written, so copy what it has. */
+  memcpy(airport->slots, slots, slot_bytes);
+  rebuild_occupancy(airport);
+  munmap(hdr, (size_t)st.st_size);
+  return lsn;
+}
+
+/* Replays the valid records of a log file, whose header
+ * `persist_check_horizon` has checked, skipping records already covered by
+ * the snapshot. Returns the byte length up to the last valid record, 0 if not
+ * even the header is whole, or -1 if the file does not exist. */
+static off_t replay_log(const char *path, uint64_t snap_lsn, int *replayed) {
+  struct stat st;
+  char *base;
+  wal_record_t *recs;
+  size_t count, idx, valid = 0;
+  int fd;
+  gate_t *gate;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(wal_header_t)) {
+    close(fd);
+    return 0;
+  }
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return 0;
+
+  recs = (wal_record_t *)(base + sizeof(wal_header_t));
+  count = ((size_t)st.st_size - sizeof(wal_header_t)) / sizeof(wal_record_t);
+  for (idx = 0; idx < count; idx++) {
+    const wal_record_t *rec = &recs[idx];
+    /* Records are placed by lsn, so one whose request had reserved it but
+     * not written it when the node died leaves a zeroed hole, with records
+     * after it that were answered. Skip it, and any torn by a host crash. */
+    if (rec->checksum != record_checksum(rec))
+      continue;
+    valid = idx + 1;
+    if (rec->lsn >= PERSIST.next_lsn)
+      PERSIST.next_lsn = rec->lsn + 1;
+    if (rec->lsn <= snap_lsn)
+      continue;
+    gate = get_gate_by_idx(rec->gate);
+    if (gate == NULL ||
+        restore_plane_in_gate(gate, rec->plane_id, rec->start, rec->end) < 0) {
+      fprintf(stderr, "[Airport %d] Skipping conflicting log record %lu\n",
+              PERSIST.airport_id, (unsigned long)rec->lsn);
+      continue;
+    }
+    (*replayed)++;
+  }
+  munmap(base, (size_t)st.st_size);
+  return (off_t)(sizeof(wal_header_t) + valid * sizeof(wal_record_t));
+}
+
+/* Writes a schedule image of every gate to a temporary file and atomically
+ * renames it into place. Each gate is copied under its own lock, so requests
+ * keep being served while the snapshot is taken. */
+static int write_snapshot(uint64_t lsn) {
+  char tmp_path[PATH_MAX], path[PATH_MAX];
+  airport_t *airport = PERSIST.airport;
+  schedule_image_header_t *hdr;
+  time_slot_t *slots;
+  size_t gate_bytes = sizeof(time_slot_t) * (size_t)NUM_TIME_SLOTS;
+  size_t slot_bytes = gate_bytes * (size_t)airport->num_gates;
+  size_t size = SCHEDULE_IMAGE_DATA_OFFSET + slot_bytes;
+  int fd, gate_idx;
+
+  persist_path(tmp_path, ".snap.tmp");
+  persist_path(path, ".snap");
+  if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+  if (ftruncate(fd, (off_t)size) < 0) {
+    close(fd);
+    return -1;
+  }
+  hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (hdr == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  slots = (time_slot_t *)((char *)hdr + SCHEDULE_IMAGE_DATA_OFFSET);
+  for (gate_idx = 0; gate_idx < airport->num_gates; gate_idx++) {
+    gate_t *gate = &airport->gates[gate_idx];
+    uint64_t seq;
+    do {
+      seq = gate_read_begin(gate);
+      memcpy(&slots[(size_t)gate_idx * (size_t)NUM_TIME_SLOTS], gate->time_slots,
+             gate_bytes);
+    } while (gate_read_retry(gate, seq));
+  }
+  hdr->magic = SCHEDULE_IMAGE_MAGIC;
+  hdr->version = SCHEDULE_IMAGE_VERSION;
+  hdr->data_offset = SCHEDULE_IMAGE_DATA_OFFSET;
+  hdr->slot_size = sizeof(time_slot_t);
+  hdr->num_gates = (uint32_t)airport->num_gates;
+  hdr->num_slots = (uint32_t)NUM_TIME_SLOTS;
+  hdr->lsn = lsn;
+  hdr->checksum = image_checksum(hdr, slots, slot_bytes);
+
+  msync(hdr, size, MS_SYNC);
+  munmap(hdr, size);
+  close(fd);
+  return rename(tmp_path, path);
+}
+
+/* Takes a snapshot and rotates the log so the records it covers can be
+ * discarded. The current log is kept as `.wal.prev` until the snapshot is
+ * safely on disk. */
+static void snapshot_and_rotate(void) {
+  char path[PATH_MAX], prev_path[PATH_MAX];
+  uint64_t snap_lsn;
+  off_t base;
+  int fd, old_fd = -1;
+
+  persist_path(path, ".wal");
+  persist_path(prev_path, ".wal.prev");
+  // waits for records being written, and holds off new ones while swapping
+  pthread_rwlock_wrlock(&PERSIST.rotate_lock);
+  snap_lsn = PERSIST.next_lsn - 1;
+  /* If an earlier snapshot failed, `.wal.prev` is still needed by recovery,
+   * so keep appending to the current log instead of rotating again. */
+  if (access(prev_path, F_OK) != 0) {
+    if (rename(path, prev_path) == 0 &&
+        (fd = open_log(path, -1, &base)) >= 0) {
+      old_fd = PERSIST.wal_fd;
+      PERSIST.wal_fd = fd;
+      PERSIST.wal_base = base;
+      PERSIST.base_lsn = PERSIST.next_lsn;
+    }
+  }
+  pthread_rwlock_unlock(&PERSIST.rotate_lock);
+  if (old_fd >= 0) {
+    fdatasync(old_fd);
+    close(old_fd);
+  }
+  if (write_snapshot(snap_lsn) < 0) {
+    perror("[Persist] snapshot");
+    return;
+  }
+  unlink(prev_path);
+}
+
+/* Background thread performing group syncs of the log and periodic
+ * snapshots. */
+static void *flusher_thread(void *arg) {
+  struct timespec deadline;
+  int count, running = 1, snapshot, fd;
+
+  while (running) {
+    pthread_mutex_lock(&PERSIST.mutex);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += PERSIST_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (PERSIST.running)
+      if (pthread_cond_timedwait(&PERSIST.wake_flusher, &PERSIST.mutex,
+                                 &deadline) == ETIMEDOUT)
+        break;
+
+    running = PERSIST.running;
+    pthread_mutex_unlock(&PERSIST.mutex);
+
+    count = __atomic_exchange_n(&PERSIST.unsynced, 0, __ATOMIC_ACQ_REL);
+    fd = PERSIST.wal_fd;
+    PERSIST.records_since_snapshot += (uint64_t)count;
+    snapshot = PERSIST.records_since_snapshot >= PERSIST_SNAPSHOT_RECORDS;
+    if (snapshot)
+      PERSIST.records_since_snapshot = 0;
+
+    // only this thread rotates the log, so `fd` stays open meanwhile
+    if (count > 0)
+      fdatasync(fd);
+    if (snapshot)
+      snapshot_and_rotate();
+  }
+  return NULL;
+}
+
+int persist_open(int airport_id, int shard, airport_t *airport) {
+  char path[PATH_MAX], prev_path[PATH_MAX];
+  struct timespec begin, end;
+  uint64_t snap_lsn;
+  off_t valid_len;
+  int replayed = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  mkdir(PERSIST_DIR, 0755);
+  PERSIST.airport = airport;
+  PERSIST.airport_id = airport_id;
+  PERSIST.shard = shard;
+  PERSIST.next_lsn = 1;
+
+  // slot indices written under another horizon would land in the wrong slots
+  if (persist_check_horizon(PERSIST_DIR, airport_id, shard) < 0) {
+    fprintf(stderr, "[Airport %d] Start with the -H the files were written with, or "
+                    "remove them\n", airport_id);
+    return -1;
+  }
+  snap_lsn = load_snapshot(airport);
+  if (snap_lsn >= PERSIST.next_lsn)
+    PERSIST.next_lsn = snap_lsn + 1;
+  persist_path(prev_path, ".wal.prev");
+  persist_path(path, ".wal");
+  replay_log(prev_path, snap_lsn, &replayed);
+  valid_len = replay_log(path, snap_lsn, &replayed);
+
+  if ((PERSIST.wal_fd = open_log(path, valid_len, &PERSIST.wal_base)) < 0) {
+    perror("[Persist] open");
+    return -1;
+  }
+  PERSIST.base_lsn = PERSIST.next_lsn;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stderr,
+          "[Airport %d] Recovered snapshot lsn %lu and %d log records in "
+          "%.2f ms\n",
+          airport_id, (unsigned long)snap_lsn, replayed,
+          (double)(end.tv_sec - begin.tv_sec) * 1e3 +
+              (double)(end.tv_nsec - begin.tv_nsec) / 1e6);
+
+  pthread_rwlock_init(&PERSIST.rotate_lock, NULL);
+  pthread_mutex_init(&PERSIST.mutex, NULL);
+  pthread_cond_init(&PERSIST.wake_flusher, NULL);
+  PERSIST.running = 1;
+  if (pthread_create(&PERSIST.flusher, NULL, flusher_thread, NULL) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  return 0;
+}
+
+void persist_log_schedule(int plane_id, int gate_idx, int start, int end) {
+  wal_record_t rec;
+  off_t offset;
+
+  if (!PERSIST.running)
+    return;
+  rec.plane_id = plane_id;
+  rec.gate = gate_idx;
+  rec.start = start;
+  rec.end = end;
+  rec.pad = 0;
+  pthread_rwlock_rdlock(&PERSIST.rotate_lock);
+  rec.lsn = __atomic_fetch_add(&PERSIST.next_lsn, 1, __ATOMIC_RELAXED);
+  rec.checksum = record_checksum(&rec);
+  offset = PERSIST.wal_base + (off_t)(rec.lsn - PERSIST.base_lsn) * (off_t)sizeof(rec);
+  // in the page cache before the booking is answered, so it survives the
+  // node crashing; only the sync to disk is left to the flusher
+  if (pwrite(PERSIST.wal_fd, &rec, sizeof(rec), offset) != (ssize_t)sizeof(rec))
+    perror("[Persist] write");
+  __atomic_fetch_add(&PERSIST.unsynced, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&PERSIST.rotate_lock);
+}
+
+void persist_close(void) {
+  if (!PERSIST.running)
+    return;
+  pthread_mutex_lock(&PERSIST.mutex);
+  PERSIST.running = 0;
+  pthread_cond_signal(&PERSIST.wake_flusher);
+  pthread_mutex_unlock(&PERSIST.mutex);
+  pthread_join(PERSIST.flusher, NULL);
+  close(PERSIST.wal_fd);
+}
@@ -0,0 +1,125 @@
+#ifndef PERSIST_HEADER
+#define PERSIST_HEADER
+
+#include "airport.h"
+#include <stdint.h>
+
+/** Durability for airport nodes.
+ *
+ *  Every successful SCHEDULE is written to the log before it is answered, so
+ *  once in the page cache it survives the node process crashing. Each request
+ *  reserves its record's place in the log with an atomic increment and writes
+ *  it there with `pwrite`, so concurrent SCHEDULEs never queue behind one
+ *  another's write; only rotating the log holds them off. A background
+ *  thread `fdatasync`s the log as a group every `PERSIST_FLUSH_MS`
+ *  milliseconds. Requests never wait for the disk, so a crash of the host can
+ *  lose at most one sync interval of bookings.
+ *
+ *  Every `PERSIST_SNAPSHOT_RECORDS` records the flusher also writes a
+ *  memory-mapped snapshot of every gate schedule, after which the log is
+ *  rotated so recovery only has to replay the records written since then.
+ *
+ *  Files kept per airport in the persistence directory:
+ *    airport-<id>.wal       log of bookings since the last snapshot
+ *    airport-<id>.wal.prev  previous log, removed once a snapshot completes
+ *    airport-<id>.snap      last complete snapshot, as a schedule image
+ *
+ *  On start a node maps its schedule image privately and serves straight out
+ *  of the mapping, so restarting costs a checksum pass over the image plus
+ *  the replay of at most `PERSIST_SNAPSHOT_RECORDS` log records.
+ *
+ *  Logs and images both record the slots per gate they were written with, as
+ *  their slot indices mean nothing under another horizon. A node whose files
+ *  were written with a different `NUM_TIME_SLOTS` refuses to start.
+ */
+
+#define PERSIST_FLUSH_MS 5
+#define PERSIST_SNAPSHOT_RECORDS 4096
+
+#define SCHEDULE_IMAGE_MAGIC 0x53435441u /* "ATCS" */
+#define SCHEDULE_IMAGE_VERSION 1
+/* Slot data starts on a page boundary so it can be used in place. */
+#define SCHEDULE_IMAGE_DATA_OFFSET 4096
+
+/** Header at the start of a schedule image. The image holds `num_gates`
+ *  arrays of `num_slots` `time_slot_t`s, starting at `data_offset`, laid out
+ *  exactly as `airport_t.slots` is in memory.
+ */
+typedef struct schedule_image_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t data_offset;
+  uint32_t slot_size;  /* sizeof(time_slot_t) when the image was written */
+  uint32_t num_gates;
+  uint32_t num_slots;
+  uint64_t lsn;        /* Every record with an lsn <= this is in the image */
+  uint64_t checksum;   /* `persist_checksum64` of the header and slot data */
+} schedule_image_header_t;
+
+#define WAL_MAGIC 0x57435441u /* "ATCW" */
+#define WAL_VERSION 1
+
+/** Header at the start of every log file, followed by its records. */
+typedef struct wal_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_slots; /* NUM_TIME_SLOTS of the node that created the log */
+  uint32_t checksum;  /* Checksum of all preceding fields */
+} wal_header_t;
+
+/** One log entry, describing a plane placed at `gate` for slots
+ *  `[start]..[end]` (inclusive). */
+typedef struct wal_record_t {
+  uint64_t lsn;      /* Log sequence number, strictly increasing */
+  int32_t plane_id;
+  int32_t gate;
+  int32_t start;
+  int32_t end;
+  uint32_t checksum; /* Checksum of all preceding fields */
+  uint32_t pad;
+} wal_record_t;
+
+/** @brief Sets the directory used for logs and snapshots. Must be called
+ *         before the node is initialised; `NULL` disables persistence.
+ */
+void persist_set_dir(const char *dir);
+
+/** @brief Returns 1 if a persistence directory has been configured. */
+int persist_enabled(void);
+
+/** @brief Checks that the snapshot and logs kept in `dir` for airport
+ *         `airport_id`, or its shard `shard` if that is not -1, were written
+ *         with `NUM_TIME_SLOTS` slots per gate, printing any that were not.
+ *
+ *  @returns 0 if they were, or there are none yet, -1 otherwise.
+ */
+int persist_check_horizon(const char *dir, int airport_id, int shard);
+
+/** @brief Restores `airport` from the snapshot and log of airport
+ *         `airport_id`, or of its shard `shard` if that is not -1, then
+ *         starts the background flusher.
+ *
+ *  @returns 0 on success, -1 if the files were written with another horizon
+ *           or the log could not be opened for writing.
+ */
+int persist_open(int airport_id, int shard, airport_t *airport);
+
+/** @brief Records that `plane_id` now occupies slots `[start]..[end]` of
+ *         `gate_idx`. Returns once the record has been written to the log,
+ *         without waiting for it to be synced to disk.
+ */
+void persist_log_schedule(int plane_id, int gate_idx, int start, int end);
+
+/** @brief Flushes any buffered records and stops the background flusher. */
+void persist_close(void);
+
+/** @brief 32-bit FNV-1a checksum over `len` bytes of `data`. */
+uint32_t persist_checksum(const void *data, size_t len);
+
+/** @brief Checksum over `len` bytes of `data`, consumed a word at a time so
+ *         large schedule images can be verified quickly. `len` must be a
+ *         multiple of 8.
+ */
+uint64_t persist_checksum64(const void *data, size_t len, uint64_t seed);
+
+#endif
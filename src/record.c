@@ -0,0 +1,142 @@
+#include "record.h"
+#include <pthread.h>
+#include <time.h>
+#include "metrics.h"
+#include "network_utils.h"
+
+/** Buffered writing of the controller's record file. See `record.h` for the
+ *  file layout.
+ */
+
+/* State shared by the request threads and the writer thread. */
+typedef struct record_state_t {
+  int fd;
+  int running;
+  uint64_t started_ns;
+  pthread_t writer;
+
+  /* Everything below is protected by `mutex`. Request threads append to
+   * `pending`, which the writer swaps with `writing` before doing I/O. */
+  pthread_mutex_t mutex;
+  pthread_cond_t wake_writer;
+  pthread_cond_t space_free;
+  char *pending;
+  char *writing;
+  size_t pending_len;
+} record_state_t;
+
+static record_state_t RECORD;
+
+int record_enabled(void) { return RECORD.running; }
+
+/* Background thread writing out what has been recorded every
+ * `RECORD_FLUSH_MS` milliseconds, or sooner once half the buffer is used. */
+static void *writer_thread(void *arg) {
+  struct timespec deadline;
+  char *batch;
+  size_t len;
+
+  while (1) {
+    pthread_mutex_lock(&RECORD.mutex);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += RECORD_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (RECORD.pending_len < RECORD_BUFFER_BYTES / 2)
+      if (pthread_cond_timedwait(&RECORD.wake_writer, &RECORD.mutex, &deadline) == ETIMEDOUT)
+        break;
+
+    batch = RECORD.pending;
+    len = RECORD.pending_len;
+    RECORD.pending = RECORD.writing;
+    RECORD.writing = batch;
+    RECORD.pending_len = 0;
+    pthread_cond_broadcast(&RECORD.space_free);
+    pthread_mutex_unlock(&RECORD.mutex);
+
+    if (len > 0 && rio_writen(RECORD.fd, batch, len) < 0)
+      perror("[Record] write");
+  }
+  return NULL;
+}
+
+int record_open(const char *path) {
+  record_file_header_t header = {RECORD_MAGIC, RECORD_VERSION, 0};
+
+  if ((RECORD.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror("[Record] open");
+    return -1;
+  }
+  RECORD.started_ns = header.started_ns = metrics_now_ns();
+  if (rio_writen(RECORD.fd, (char *)&header, sizeof(header)) < 0) {
+    perror("[Record] write");
+    close(RECORD.fd);
+    return -1;
+  }
+  RECORD.pending = malloc(RECORD_BUFFER_BYTES);
+  RECORD.writing = malloc(RECORD_BUFFER_BYTES);
+  if (RECORD.pending == NULL || RECORD.writing == NULL)
+    return -1;
+  pthread_mutex_init(&RECORD.mutex, NULL);
+  pthread_cond_init(&RECORD.wake_writer, NULL);
+  pthread_cond_init(&RECORD.space_free, NULL);
+  if (pthread_create(&RECORD.writer, NULL, writer_thread, NULL) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  RECORD.running = 1;
+  return 0;
+}
+
+/* Counts the lines of `len` bytes of `data`, the last of which may be
+ * unterminated. */
+static uint32_t count_lines(const char *data, size_t len) {
+  const char *p = data, *end = data + len, *newline;
+  uint32_t lines = 0;
+  while (p < end && (newline = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+    lines++;
+    p = newline + 1;
+  }
+  return p < end ? lines + 1 : lines;
+}
+
+void record_request(uint64_t conn_id, uint64_t begin_ns, const char *request,
+                    size_t request_len, const char *response, size_t response_len) {
+  record_entry_t entry;
+  size_t size;
+  char *dst;
+
+  if (!RECORD.running)
+    return;
+  entry.at_ns = begin_ns > RECORD.started_ns ? begin_ns - RECORD.started_ns : 0;
+  entry.latency_ns = metrics_now_ns() - begin_ns;
+  entry.conn_id = conn_id;
+  entry.request_len = (uint32_t)request_len;
+  entry.response_lines = count_lines(response, response_len);
+  entry.flags = 0;
+  if (response_len >= 4 && memcmp(response + response_len - 4, "END\n", 4) == 0 &&
+      (response_len == 4 || response[response_len - 5] == '\n'))
+    entry.flags |= RECORD_LISTING;
+  if (response_len > RECORD_RESPONSE_MAX) {
+    response_len = RECORD_RESPONSE_MAX;
+    entry.flags |= RECORD_TRUNCATED;
+  }
+  entry.response_len = (uint32_t)response_len;
+  size = sizeof(entry) + request_len + response_len;
+
+  pthread_mutex_lock(&RECORD.mutex);
+  while (RECORD.pending_len + size > RECORD_BUFFER_BYTES) {
+    pthread_cond_signal(&RECORD.wake_writer);
+    pthread_cond_wait(&RECORD.space_free, &RECORD.mutex);
+  }
+  dst = RECORD.pending + RECORD.pending_len;
+  memcpy(dst, &entry, sizeof(entry));
+  memcpy(dst + sizeof(entry), request, request_len);
+  memcpy(dst + sizeof(entry) + request_len, response, response_len);
+  RECORD.pending_len += size;
+  if (RECORD.pending_len >= RECORD_BUFFER_BYTES / 2)
+    pthread_cond_signal(&RECORD.wake_writer);
+  pthread_mutex_unlock(&RECORD.mutex);
+}
@@ -0,0 +1,70 @@
+#ifndef RECORD_HEADER
+#define RECORD_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Recording of client traffic for replay.
+ *
+ *  A controller started with a record file appends every request line it
+ *  answers, with its response, to an in-memory buffer, which a background
+ *  thread writes out every `RECORD_FLUSH_MS` milliseconds. Requests never
+ *  wait for the disk unless the buffer fills up, so killing the controller
+ *  loses at most one flush interval of requests.
+ *
+ *  The file starts with a `record_file_header_t`, followed by one entry per
+ *  request in the order their responses completed: a `record_entry_t`, the
+ *  request line, then the response. Responses longer than
+ *  `RECORD_RESPONSE_MAX` bytes, such as large EXPORTs, are cut short, but the
+ *  entry still counts the lines of the whole response. The `replay` tool
+ *  re-sends the requests in the order they arrived.
+ */
+
+#define RECORD_FLUSH_MS 10
+#define RECORD_BUFFER_BYTES (4 * 1024 * 1024)
+#define RECORD_RESPONSE_MAX (64 * 1024)
+
+#define RECORD_MAGIC 0x52435441u /* "ATCR" */
+#define RECORD_VERSION 1
+
+/* `record_entry_t.flags` */
+#define RECORD_LISTING 1   /* the response is a listing ending with END */
+#define RECORD_TRUNCATED 2 /* only the start of the response was kept */
+
+typedef struct record_file_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t started_ns; /* `metrics_now_ns` when the recording began */
+} record_file_header_t;
+
+/** One recorded request, followed in the file by `request_len` bytes of
+ *  request line and `response_len` bytes of response. */
+typedef struct record_entry_t {
+  uint64_t at_ns;          /* when the request was read, since the recording began */
+  uint64_t latency_ns;     /* from then until its response was complete */
+  uint64_t conn_id;        /* client connection the request came on */
+  uint32_t request_len;
+  uint32_t response_len;   /* bytes of response kept */
+  uint32_t response_lines; /* lines of the whole response */
+  uint32_t flags;
+} record_entry_t;
+
+/** @brief Creates the record file `path`, replacing any earlier recording,
+ *         and starts the background writer.
+ *
+ *  @returns 0 on success, -1 if the file could not be created.
+ */
+int record_open(const char *path);
+
+/** @brief Returns 1 if requests are being recorded. */
+int record_enabled(void);
+
+/** @brief Records the request line of `request_len` bytes, read from
+ *         connection `conn_id` at `begin_ns` (from `metrics_now_ns`), and
+ *         its response, which has just been completed. Waits only if the
+ *         writer has fallen a whole buffer behind.
+ */
+void record_request(uint64_t conn_id, uint64_t begin_ns, const char *request,
+                    size_t request_len, const char *response, size_t response_len);
+
+#endif
@@ -0,0 +1,441 @@
+/*
+ * replay.c - Replays traffic recorded by the Air Traffic Control controller
+ *
+ * Reads a record file written by a controller started with `-R` and re-sends
+ * its requests to a running controller in the order they arrived, each at the
+ * time it arrived, sped up by the factor given with `-x`. Reports the
+ * throughput reached, the latency of each command next to the latency that
+ * was recorded, and the responses that differ from the recorded ones.
+ *
+ * Requests recorded on the same connection are replayed by the same thread,
+ * in order. A thread waits for each response before sending its next
+ * request, and latency is measured from the time a request was due, so a
+ * build that cannot keep up with the recorded pace shows it. With `-t 1`
+ * every request is only sent once the one before it has been answered, so
+ * the responses depend on nothing but the recording.
+ *
+ * Responses to SCHEDULE, PLANE_STATUS, TIME_STATUS and EXPORT are compared
+ * with the recorded ones. Those of STATS, TRACE and the like change from run
+ * to run, and are not.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "histogram.h"
+#include "network_utils.h"
+#include "record.h"
+
+#define MAX_THREADS 256
+
+enum { CMD_SCHEDULE, CMD_PLANE_STATUS, CMD_TIME_STATUS, CMD_EXPORT, CMD_OTHER, NUM_COMMANDS };
+
+static const char *COMMAND_NAMES[NUM_COMMANDS] = {"SCHEDULE", "PLANE_STATUS", "TIME_STATUS",
+                                                  "EXPORT", "other"};
+
+/** Parameters shared by every replaying thread. */
+typedef struct replay_params_t {
+  char *host;
+  char *port;
+  char *path;        /* record file */
+  int num_threads;
+  double speed;      /* recorded time is divided by this, 0 = no waiting */
+  int diffs_shown;   /* differing responses printed, beyond which they are only counted */
+} replay_params_t;
+
+/** A recorded request, pointing into the mapped record file. */
+typedef struct replay_request_t {
+  record_entry_t entry;
+  const char *request;
+  const char *response;
+  size_t file_idx;   /* position in the file, to keep the sort stable */
+  int cmd;
+} replay_request_t;
+
+/** Results gathered by each replaying thread. */
+typedef struct replayer_t {
+  pthread_t thread;
+  int idx;
+  size_t *order;     /* indexes into `REQUESTS` of this thread's requests */
+  size_t count;
+  uint64_t completed[NUM_COMMANDS];
+  uint64_t errors[NUM_COMMANDS];
+  uint64_t diffs[NUM_COMMANDS];
+  uint64_t failed;   /* requests whose response never came */
+  uint64_t finished_at;
+  histogram_t latency[NUM_COMMANDS];
+} replayer_t;
+
+static replay_params_t PARAMS = {
+    .host = "localhost",
+    .port = "1024",
+    .num_threads = 4,
+    .speed = 1,
+    .diffs_shown = 10,
+};
+
+static replay_request_t *REQUESTS = NULL;
+static size_t NUM_REQUESTS = 0;
+static uint64_t START_NS = 0;
+
+/* Serialises the printing of differences, and counts those printed. */
+static pthread_mutex_t DIFF_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int DIFFS_PRINTED = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Returns the length of the line at `p`, without its newline, looking no
+ * further than `len` bytes. */
+static int line_len(const char *p, size_t len) {
+  const char *newline = memchr(p, '\n', len);
+  return (int)(newline ? (size_t)(newline - p) : len);
+}
+
+static int command_of(const char *request, size_t len) {
+  for (int cmd = 0; cmd < CMD_OTHER; cmd++) {
+    size_t name_len = strlen(COMMAND_NAMES[cmd]);
+    if (len > name_len && memcmp(request, COMMAND_NAMES[cmd], name_len) == 0 &&
+        (request[name_len] == ' ' || request[name_len] == '\n'))
+      return cmd;
+  }
+  return CMD_OTHER;
+}
+
+static int compare_arrival(const void *a, const void *b) {
+  const replay_request_t *x = a, *y = b;
+  if (x->entry.at_ns != y->entry.at_ns)
+    return x->entry.at_ns < y->entry.at_ns ? -1 : 1;
+  return x->file_idx < y->file_idx ? -1 : x->file_idx > y->file_idx;
+}
+
+/* Maps the record file and indexes its requests in the order they arrived.
+ * An entry cut short at the end of the file, as by a controller killed
+ * mid-write, is ignored. */
+static int load_recording(void) {
+  record_file_header_t header;
+  record_entry_t entry;
+  struct stat st;
+  const char *data, *p, *end;
+  size_t capacity = 0;
+  int fd;
+
+  if ((fd = open(PARAMS.path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror("[Replay] open");
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(header)) {
+    fprintf(stderr, "[Replay] %s is not a record file.\n", PARAMS.path);
+    return -1;
+  }
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("[Replay] mmap");
+    return -1;
+  }
+  madvise((void *)data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != RECORD_MAGIC || header.version != RECORD_VERSION) {
+    fprintf(stderr, "[Replay] %s is not a version %d record file.\n", PARAMS.path,
+            RECORD_VERSION);
+    return -1;
+  }
+
+  end = data + st.st_size;
+  for (p = data + sizeof(header); (size_t)(end - p) >= sizeof(entry);) {
+    memcpy(&entry, p, sizeof(entry));
+    if ((size_t)(end - p) - sizeof(entry) < (size_t)entry.request_len + entry.response_len)
+      break;
+    if (NUM_REQUESTS == capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      if ((REQUESTS = realloc(REQUESTS, sizeof(*REQUESTS) * capacity)) == NULL)
+        return -1;
+    }
+    replay_request_t *req = &REQUESTS[NUM_REQUESTS];
+    req->entry = entry;
+    req->request = p + sizeof(entry);
+    req->response = req->request + entry.request_len;
+    req->file_idx = NUM_REQUESTS++;
+    req->cmd = command_of(req->request, entry.request_len);
+    p = req->response + entry.response_len;
+  }
+  if (p < end)
+    fprintf(stderr, "[Replay] Ignoring %ld bytes of incomplete entry at the end of %s.\n",
+            (long)(end - p), PARAMS.path);
+  qsort(REQUESTS, NUM_REQUESTS, sizeof(*REQUESTS), compare_arrival);
+  return 0;
+}
+
+/* Returns the lines a successful response to `req` has, given that the
+ * recorded one may have been an error. */
+static uint32_t expected_lines(const replay_request_t *req) {
+  char request[MAXLINE];
+  int duration;
+  if (req->entry.response_len < 6 || memcmp(req->response, "Error:", 6) != 0)
+    return req->entry.response_lines;
+  snprintf(request, sizeof(request), "%.*s", (int)req->entry.request_len, req->request);
+  if (req->cmd == CMD_TIME_STATUS &&
+      sscanf(request, "TIME_STATUS %*d %*d %*d %d", &duration) == 1 && duration >= 0)
+    return (uint32_t)duration + 1;
+  return 1;
+}
+
+static int connect_controller(void) {
+  int fd;
+  while ((fd = open_clientfd(PARAMS.host, PARAMS.port)) < 0) {
+    perror("[Replay] open_clientfd");
+    sleep(1);
+  }
+  return fd;
+}
+
+/* Prints the first line in which `got` differs from the recorded response
+ * to `req`, unless enough differences have been printed already. */
+static void print_diff(const replay_request_t *req, const char *got, size_t got_len) {
+  const char *want = req->response;
+  size_t want_len = req->entry.response_len, offset = 0, line_start = 0;
+
+  while (offset < want_len && offset < got_len && want[offset] == got[offset])
+    if (want[offset++] == '\n')
+      line_start = offset;
+  pthread_mutex_lock(&DIFF_LOCK);
+  if (DIFFS_PRINTED++ < PARAMS.diffs_shown) {
+    printf("Diff at %.6fs on connection %lu: %.*s\n", (double)req->entry.at_ns / 1e9,
+           (unsigned long)req->entry.conn_id,
+           line_len(req->request, req->entry.request_len), req->request);
+    printf("  recorded: %.*s\n", line_len(want + line_start, want_len - line_start),
+           want + line_start);
+    printf("  replayed: %.*s\n", line_len(got + line_start, got_len - line_start),
+           got + line_start);
+  }
+  pthread_mutex_unlock(&DIFF_LOCK);
+}
+
+static void *replay_thread(void *arg) {
+  replayer_t *r = arg;
+  char line[MAXLINE];
+  char *got = malloc(RECORD_RESPONSE_MAX + 1);
+  rio_t rio;
+  uint64_t sent, end;
+  size_t got_len;
+  uint32_t lines, expected;
+  int fd, listing, is_error;
+  ssize_t n;
+
+  if (got == NULL)
+    return NULL;
+  fd = connect_controller();
+  rio_readinitb(&rio, fd);
+  for (size_t i = 0; i < r->count; i++) {
+    replay_request_t *req = &REQUESTS[r->order[i]];
+    sent = now_ns();
+    if (PARAMS.speed > 0) {
+      uint64_t due = START_NS + (uint64_t)((double)req->entry.at_ns / PARAMS.speed);
+      while (sent < due) {
+        struct timespec ts = {(time_t)((due - sent) / 1000000000ull),
+                              (long)((due - sent) % 1000000000ull)};
+        nanosleep(&ts, NULL);
+        sent = now_ns();
+      }
+      sent = due;
+    }
+
+    expected = expected_lines(req);
+    listing = (req->entry.flags & RECORD_LISTING) || req->cmd == CMD_EXPORT;
+    got_len = 0;
+    lines = 0;
+    is_error = 0;
+    if (rio_writen(fd, (char *)req->request, req->entry.request_len) < 0) {
+      n = -1;
+    } else {
+      while ((n = rio_readlineb(&rio, line, MAXLINE)) > 0) {
+        size_t keep = (size_t)n < RECORD_RESPONSE_MAX - got_len ? (size_t)n
+                                                                : RECORD_RESPONSE_MAX - got_len;
+        memcpy(got + got_len, line, keep);
+        got_len += keep;
+        if (++lines == 1 && strncmp(line, "Error:", 6) == 0) {
+          is_error = 1;
+          break;
+        }
+        if (listing ? strcmp(line, "END\n") == 0 : lines >= expected)
+          break;
+      }
+    }
+    end = now_ns();
+    if (n <= 0) {
+      // the connection was lost: count it and carry on over a new one
+      r->failed++;
+      close(fd);
+      fd = connect_controller();
+      rio_readinitb(&rio, fd);
+      continue;
+    }
+
+    r->completed[req->cmd]++;
+    if (is_error)
+      r->errors[req->cmd]++;
+    hist_record(&r->latency[req->cmd], end - sent);
+    if (req->cmd != CMD_OTHER &&
+        (lines != req->entry.response_lines || got_len != req->entry.response_len ||
+         memcmp(got, req->response, got_len) != 0)) {
+      r->diffs[req->cmd]++;
+      print_diff(req, got, got_len);
+    }
+  }
+  r->finished_at = now_ns();
+  close(fd);
+  free(got);
+  return NULL;
+}
+
+static void print_row(const char *name, const histogram_t *h, double duration_s,
+                      uint64_t errors, uint64_t diffs) {
+  printf("%-14s %10lu %8lu %8lu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+         (unsigned long)h->total, (unsigned long)errors, (unsigned long)diffs,
+         duration_s > 0 ? (double)h->total / duration_s : 0, hist_mean(h) / 1e3,
+         (double)hist_percentile(h, 50) / 1e3, (double)hist_percentile(h, 99) / 1e3,
+         (double)hist_percentile(h, 99.9) / 1e3, (double)h->max / 1e3);
+}
+
+static void print_usage(char *program_name) {
+  printf("Usage: %s [options] FILE\n", program_name);
+  printf("  Replays the requests recorded in FILE by a controller started with -R.\n");
+  printf("  -H: Controller host (default localhost).\n");
+  printf("  -p: Controller port (default 1024).\n");
+  printf("  -t: Number of replaying threads, over which the recorded connections\n"
+         "      are spread (default 4). With 1, responses are deterministic.\n");
+  printf("  -x: Speed-up over the recorded pace, or 0 to send each request as soon\n"
+         "      as its thread is free (default 1).\n");
+  printf("  -v: Differing responses printed; the rest are only counted (default 10).\n");
+  printf("  -h: Print this help message and exit.\n");
+  exit(0);
+}
+
+static int parse_args(int argc, char *argv[]) {
+  int c;
+  while ((c = getopt(argc, argv, "H:p:t:x:v:h")) != -1) {
+    switch (c) {
+    case 'H': PARAMS.host = optarg; break;
+    case 'p': PARAMS.port = optarg; break;
+    case 't': PARAMS.num_threads = atoi(optarg); break;
+    case 'x': PARAMS.speed = atof(optarg); break;
+    case 'v': PARAMS.diffs_shown = atoi(optarg); break;
+    case 'h':
+      print_usage(argv[0]);
+      break;
+    default:
+      return -1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Expected a record file.\n");
+    return -1;
+  }
+  PARAMS.path = argv[optind];
+  if (PARAMS.num_threads <= 0 || PARAMS.num_threads > MAX_THREADS) {
+    fprintf(stderr, "-t must be between 1-%d.\n", MAX_THREADS);
+    return -1;
+  }
+  if (PARAMS.speed < 0 || PARAMS.diffs_shown < 0) {
+    fprintf(stderr, "-x and -v must be at least 0.\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static replayer_t replayers[MAX_THREADS];
+  static histogram_t merged[NUM_COMMANDS], recorded[NUM_COMMANDS], all, all_recorded;
+  uint64_t errors[NUM_COMMANDS] = {0}, diffs[NUM_COMMANDS] = {0};
+  uint64_t recorded_errors[NUM_COMMANDS] = {0};
+  uint64_t total_errors = 0, total_diffs = 0, total_recorded_errors = 0, failed = 0;
+  uint64_t begin, finished = 0;
+  double duration_s, recorded_s;
+  size_t i;
+  int idx, cmd;
+
+  if (parse_args(argc, argv) < 0 || load_recording() < 0)
+    return 1;
+  if (NUM_REQUESTS == 0) {
+    fprintf(stderr, "[Replay] %s holds no requests.\n", PARAMS.path);
+    return 1;
+  }
+
+  // connections were numbered as accepted, so this deals them out in turn
+  for (i = 0; i < NUM_REQUESTS; i++)
+    replayers[REQUESTS[i].entry.conn_id % (uint64_t)PARAMS.num_threads].count++;
+  for (idx = 0; idx < PARAMS.num_threads; idx++) {
+    replayers[idx].idx = idx;
+    if ((replayers[idx].order = malloc(sizeof(size_t) * (replayers[idx].count + 1))) == NULL)
+      return 1;
+    replayers[idx].count = 0;
+  }
+  for (i = 0; i < NUM_REQUESTS; i++) {
+    replayer_t *r = &replayers[REQUESTS[i].entry.conn_id % (uint64_t)PARAMS.num_threads];
+    r->order[r->count++] = i;
+    hist_record(&recorded[REQUESTS[i].cmd], REQUESTS[i].entry.latency_ns);
+    hist_record(&all_recorded, REQUESTS[i].entry.latency_ns);
+    if (REQUESTS[i].entry.response_len >= 6 &&
+        memcmp(REQUESTS[i].response, "Error:", 6) == 0) {
+      recorded_errors[REQUESTS[i].cmd]++;
+      total_recorded_errors++;
+    }
+  }
+  recorded_s = (double)(REQUESTS[NUM_REQUESTS - 1].entry.at_ns - REQUESTS[0].entry.at_ns) / 1e9;
+
+  printf("Replaying %zu requests over %.1fs from %s to %s:%s with %d threads, ",
+         NUM_REQUESTS, recorded_s, PARAMS.path, PARAMS.host, PARAMS.port, PARAMS.num_threads);
+  if (PARAMS.speed > 0)
+    printf("at %gx speed\n", PARAMS.speed);
+  else
+    printf("as fast as possible\n");
+
+  // the first request is due straight away
+  begin = now_ns();
+  START_NS = begin - (uint64_t)((double)REQUESTS[0].entry.at_ns /
+                                (PARAMS.speed > 0 ? PARAMS.speed : 1));
+  for (idx = 0; idx < PARAMS.num_threads; idx++) {
+    if (pthread_create(&replayers[idx].thread, NULL, replay_thread, &replayers[idx]) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  for (idx = 0; idx < PARAMS.num_threads; idx++) {
+    pthread_join(replayers[idx].thread, NULL);
+    for (cmd = 0; cmd < NUM_COMMANDS; cmd++) {
+      hist_merge(&merged[cmd], &replayers[idx].latency[cmd]);
+      hist_merge(&all, &replayers[idx].latency[cmd]);
+      errors[cmd] += replayers[idx].errors[cmd];
+      diffs[cmd] += replayers[idx].diffs[cmd];
+      total_errors += replayers[idx].errors[cmd];
+      total_diffs += replayers[idx].diffs[cmd];
+    }
+    failed += replayers[idx].failed;
+    if (replayers[idx].finished_at > finished)
+      finished = replayers[idx].finished_at;
+  }
+  duration_s = (double)(finished - begin) / 1e9;
+
+  printf("%-14s %10s %8s %8s %12s %9s %9s %9s %9s %9s\n", "command", "requests", "errors",
+         "diffs", "req/s", "mean(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+  for (cmd = 0; cmd < NUM_COMMANDS; cmd++) {
+    if (recorded[cmd].total == 0)
+      continue;
+    print_row(COMMAND_NAMES[cmd], &merged[cmd], duration_s, errors[cmd], diffs[cmd]);
+    print_row("  recorded", &recorded[cmd], recorded_s, recorded_errors[cmd], 0);
+  }
+  print_row("total", &all, duration_s, total_errors, total_diffs);
+  print_row("  recorded", &all_recorded, recorded_s, total_recorded_errors, 0);
+  printf("Replayed in %.2fs; %lu responses differed from the recording\n", duration_s,
+         (unsigned long)total_diffs);
+  if (failed > 0)
+    printf("Warning: %lu requests lost their connection before being answered\n",
+           (unsigned long)failed);
+  return total_diffs > 0 || failed > 0 ? 2 : 0;
+}
@@ -0,0 +1,123 @@
+#include "response_cache.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct cache_entry_t {
+  uint64_t hash;
+  uint64_t version;
+  char *key;      /* request line without its newline */
+  char *response;
+  size_t len;
+} cache_entry_t;
+
+typedef struct cache_table_t {
+  pthread_mutex_t lock;
+  uint64_t version; /* also read without the lock */
+  cache_entry_t slots[CACHE_SLOTS];
+} cache_table_t;
+
+static cache_table_t *TABLES = NULL;
+static int NUM_TABLES = 0;
+static int ENABLED = 1;
+
+void cache_init(int num_airports) {
+  if ((TABLES = calloc((size_t)num_airports, sizeof(cache_table_t))) == NULL)
+    return;
+  for (int idx = 0; idx < num_airports; idx++)
+    pthread_mutex_init(&TABLES[idx].lock, NULL);
+  NUM_TABLES = num_airports;
+}
+
+void cache_set_enabled(int enabled) { ENABLED = enabled; }
+
+uint64_t cache_version(int airport) {
+  if (airport < 0 || airport >= NUM_TABLES)
+    return 0;
+  return __atomic_load_n(&TABLES[airport].version, __ATOMIC_ACQUIRE);
+}
+
+void cache_invalidate(int airport) {
+  if (airport >= 0 && airport < NUM_TABLES)
+    __atomic_add_fetch(&TABLES[airport].version, 1, __ATOMIC_RELEASE);
+}
+
+/* FNV-1a over the request line, which ends at its newline. */
+static uint64_t hash_key(const char *key, size_t *len) {
+  uint64_t hash = 14695981039346656037ull;
+  *len = strcspn(key, "\r\n");
+  for (size_t i = 0; i < *len; i++)
+    hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+  return hash;
+}
+
+static int entry_matches(const cache_entry_t *entry, uint64_t hash, const char *key,
+                         size_t key_len) {
+  return entry->key != NULL && entry->hash == hash &&
+         strncmp(entry->key, key, key_len) == 0 && entry->key[key_len] == '\0';
+}
+
+int cache_lookup(int airport, const char *key, wbuf_t *out, char *last_line) {
+  cache_table_t *table;
+  cache_entry_t *entry;
+  size_t key_len, start;
+  uint64_t hash;
+  int hit = 0;
+
+  if (!ENABLED || airport < 0 || airport >= NUM_TABLES)
+    return 0;
+  table = &TABLES[airport];
+  hash = hash_key(key, &key_len);
+  entry = &table->slots[hash & (CACHE_SLOTS - 1)];
+
+  pthread_mutex_lock(&table->lock);
+  if (entry_matches(entry, hash, key, key_len) &&
+      entry->version == __atomic_load_n(&table->version, __ATOMIC_ACQUIRE)) {
+    wbuf_write(out, entry->response, entry->len);
+    /* The last line starts after the newline before the final one. */
+    start = entry->len - 1;
+    while (start > 0 && entry->response[start - 1] != '\n')
+      start--;
+    if (entry->len - start >= MAXLINE)
+      start = entry->len - (MAXLINE - 1);
+    memcpy(last_line, entry->response + start, entry->len - start);
+    last_line[entry->len - start] = '\0';
+    hit = 1;
+  }
+  pthread_mutex_unlock(&table->lock);
+  return hit;
+}
+
+void cache_store(int airport, const char *key, uint64_t version, const char *response,
+                 size_t len) {
+  cache_table_t *table;
+  cache_entry_t *entry;
+  char *copy_key, *copy;
+  size_t key_len;
+  uint64_t hash;
+
+  if (!ENABLED || airport < 0 || airport >= NUM_TABLES || len == 0)
+    return;
+  table = &TABLES[airport];
+  if (version != __atomic_load_n(&table->version, __ATOMIC_ACQUIRE))
+    return;
+  hash = hash_key(key, &key_len);
+  if ((copy_key = strndup(key, key_len)) == NULL || (copy = malloc(len)) == NULL) {
+    free(copy_key);
+    return;
+  }
+  memcpy(copy, response, len);
+
+  entry = &table->slots[hash & (CACHE_SLOTS - 1)];
+  pthread_mutex_lock(&table->lock);
+  /* Swap the old contents out, to free them after unlocking. */
+  char *old_key = entry->key, *old_response = entry->response;
+  entry->hash = hash;
+  entry->version = version;
+  entry->key = copy_key;
+  entry->response = copy;
+  entry->len = len;
+  pthread_mutex_unlock(&table->lock);
+  free(old_key);
+  free(old_response);
+}
@@ -0,0 +1,52 @@
+#ifndef RESPONSE_CACHE_HEADER
+#define RESPONSE_CACHE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include "network_utils.h"
+
+/** Controller-side cache of read-only responses (PLANE_STATUS, TIME_STATUS).
+ *
+ *  Each airport has a direct-mapped table of `CACHE_SLOTS` entries keyed by
+ *  request line, and a schedule version that is bumped whenever a SCHEDULE
+ *  forwarded to it completes, or the node is respawned. An entry records the
+ *  version read before its request was forwarded, and is only served while
+ *  that version is still current. A read that raced with a mutation is thus
+ *  never served again, and no read after a mutation through the controller
+ *  sees the schedule from before it.
+ *
+ *  Mutations made by connecting to a node directly bypass the controller and
+ *  are not seen by the cache.
+ */
+
+#define CACHE_SLOTS 1024 /* per airport, must be a power of two */
+
+/** @brief Allocates the tables of `num_airports` airports. Must be called
+ *         before any other cache function. */
+void cache_init(int num_airports);
+
+/** @brief Turns the cache off, or back on. Lookups miss while it is off. */
+void cache_set_enabled(int enabled);
+
+/** @brief Returns airport `airport`'s current schedule version. */
+uint64_t cache_version(int airport);
+
+/** @brief Bumps airport `airport`'s schedule version, invalidating every
+ *         response cached for it. */
+void cache_invalidate(int airport);
+
+/** @brief Looks up the response to the request line `key` for `airport`.
+ *
+ *  @returns 1 on a hit, having written the response to `out` and copied its
+ *           last line into `last_line`, which holds MAXLINE bytes. Otherwise
+ *           returns 0.
+ */
+int cache_lookup(int airport, const char *key, wbuf_t *out, char *last_line);
+
+/** @brief Caches `len` bytes of `response` for the request line `key`, read
+ *         at schedule version `version`. Does nothing if the version has
+ *         changed since. */
+void cache_store(int airport, const char *key, uint64_t version, const char *response,
+                 size_t len);
+
+#endif
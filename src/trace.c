@@ -0,0 +1,123 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+/* Fields are written and read with relaxed atomics, so a span overwritten
+ * while being read is detected by re-checking `claimed` rather than torn. */
+typedef struct trace_span_t {
+  const char *name;
+  uint64_t request_id;
+  uint64_t start_ns;
+  uint64_t end_ns;
+} trace_span_t;
+
+typedef struct trace_ring_t {
+  struct trace_ring_t *next;
+  unsigned generation;
+  int thread_num;
+  uint64_t claimed; /* spans the owner has started writing */
+  uint64_t head;    /* spans the owner has finished writing */
+  trace_span_t spans[TRACE_RING_SPANS];
+} trace_ring_t;
+
+static char ROLE[32] = "main";
+static int ENABLED = 0;
+static trace_ring_t *RINGS = NULL;
+static int NUM_RINGS = 0;
+/* Bumped by `trace_init` so rings inherited across a fork are re-registered. */
+static unsigned GENERATION = 0;
+static __thread trace_ring_t *SELF = NULL;
+static __thread uint64_t REQUEST_ID = 0;
+
+void trace_init(const char *role) {
+  __atomic_store_n(&RINGS, NULL, __ATOMIC_RELAXED);
+  __atomic_store_n(&NUM_RINGS, 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&GENERATION, 1, __ATOMIC_RELEASE);
+  snprintf(ROLE, sizeof(ROLE), "%s", role);
+}
+
+void trace_set_enabled(int enabled) { STORE(&ENABLED, enabled ? 1 : 0); }
+
+int trace_enabled(void) { return LOAD(&ENABLED); }
+
+void trace_set_request(uint64_t request_id) { REQUEST_ID = request_id; }
+
+uint64_t trace_request(void) { return REQUEST_ID; }
+
+/* Returns the calling thread's ring, registering it on first use. */
+static trace_ring_t *self(void) {
+  trace_ring_t *ring = SELF;
+  unsigned generation = __atomic_load_n(&GENERATION, __ATOMIC_ACQUIRE);
+  if (ring && ring->generation == generation)
+    return ring;
+  if ((ring = calloc(1, sizeof(*ring))) == NULL)
+    return NULL;
+  ring->generation = generation;
+  ring->thread_num = __atomic_add_fetch(&NUM_RINGS, 1, __ATOMIC_RELAXED);
+  ring->next = __atomic_load_n(&RINGS, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&RINGS, &ring->next, ring, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return SELF = ring;
+}
+
+void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns) {
+  trace_ring_t *ring;
+  trace_span_t *span;
+  uint64_t head;
+  if (REQUEST_ID == 0 || (ring = self()) == NULL)
+    return;
+  head = ring->head;
+  span = &ring->spans[head % TRACE_RING_SPANS];
+  /* Claim the slot before overwriting it, so readers skip it. */
+  STORE(&ring->claimed, head + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  STORE(&span->name, name);
+  STORE(&span->request_id, REQUEST_ID);
+  STORE(&span->start_ns, start_ns);
+  STORE(&span->end_ns, end_ns);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+char *trace_format_events(size_t *len) {
+  unsigned generation = __atomic_load_n(&GENERATION, __ATOMIC_ACQUIRE);
+  int pid = (int)getpid();
+  char *buf = NULL;
+  trace_ring_t *ring;
+  trace_span_t span;
+  uint64_t head, first, idx;
+  FILE *out;
+
+  if ((out = open_memstream(&buf, len)) == NULL)
+    return NULL;
+  fprintf(out, ",{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+               "\"args\":{\"name\":\"%s\"}}\n", pid, ROLE);
+  for (ring = __atomic_load_n(&RINGS, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    if (ring->generation != generation)
+      continue;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    first = head > TRACE_RING_SPANS ? head - TRACE_RING_SPANS : 0;
+    for (idx = first; idx < head; idx++) {
+      trace_span_t *slot = &ring->spans[idx % TRACE_RING_SPANS];
+      span.name = LOAD(&slot->name);
+      span.request_id = LOAD(&slot->request_id);
+      span.start_ns = LOAD(&slot->start_ns);
+      span.end_ns = LOAD(&slot->end_ns);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      /* Skip spans the owner has started overwriting since we began. */
+      if (LOAD(&ring->claimed) > idx + TRACE_RING_SPANS)
+        continue;
+      fprintf(out, ",{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,"
+                   "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"req\":%lu}}\n",
+              span.name, pid, ring->thread_num, (double)span.start_ns / 1e3,
+              (double)(span.end_ns - span.start_ns) / 1e3,
+              (unsigned long)span.request_id);
+    }
+  }
+  fclose(out);
+  return buf;
+}
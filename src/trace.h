@@ -0,0 +1,60 @@
+#ifndef TRACE_HEADER
+#define TRACE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** End-to-end request tracing.
+ *
+ *  While tracing is enabled the controller gives each request an id and
+ *  forwards it to the airport node as a `#<id>` prefix on the request line.
+ *  Both sides then record timed spans for each stage of the request (queueing,
+ *  connecting, waiting on the node, gate locks, relaying the response) into a
+ *  per-thread ring of the last `TRACE_RING_SPANS` spans, which older spans
+ *  are overwritten from.
+ *
+ *  Spans are timestamped with CLOCK_MONOTONIC, which is shared by every
+ *  process on the host, so spans from the controller and its nodes line up.
+ *  `trace_format_events` renders them as Chrome trace events, viewable in
+ *  chrome://tracing or Perfetto.
+ */
+
+#define TRACE_RING_SPANS 4096
+
+/** @brief Labels this process's spans with `role`. Must be called again in a
+ *         forked child; spans recorded by the parent are discarded.
+ */
+void trace_init(const char *role);
+
+/** @brief Turns assigning trace ids to new requests on or off. */
+void trace_set_enabled(int enabled);
+
+/** @brief Returns 1 if new requests are being traced. */
+int trace_enabled(void);
+
+/** @brief Sets the trace id of the request the calling thread is handling,
+ *         or 0 if it is not handling a traced request. */
+void trace_set_request(uint64_t request_id);
+
+/** @brief Returns the trace id set by `trace_set_request`. */
+uint64_t trace_request(void);
+
+/** @brief Records a span from `start_ns` to `end_ns` (from `metrics_now_ns`)
+ *         for the calling thread's current request. Does nothing if the
+ *         thread is not handling a traced request. `name` must be a string
+ *         literal.
+ */
+void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns);
+
+/** @brief Renders this process's spans, plus an event naming the process, as
+ *         Chrome trace event objects. Every object is on its own line and
+ *         preceded by a comma, so the output of several processes can be
+ *         appended to an array that already has a first element.
+ *
+ *  @returns A buffer allocated with `malloc`, which the caller must free, or
+ *           NULL if memory could not be allocated. Its length is stored in
+ *           `len`.
+ */
+char *trace_format_events(size_t *len);
+
+#endif
@@ -0,0 +1,502 @@
+#include "uring_server.h"
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "airport.h"
+#include "arena.h"
+#include "logger.h"
+#include "metrics.h"
+
+#define URING_BGID 1
+
+/* Kinds of submission, stored in the low bits of `user_data` next to the
+ * connection they belong to. */
+enum { EV_ACCEPT, EV_RECV, EV_SEND, EV_CLOSE, EV_WAKE };
+#define EV_MASK 7ull
+
+/* A complete request line waiting for a worker. */
+typedef struct line_t {
+  struct line_t *next;
+  uint64_t queued_at;
+  ssize_t len;
+  char data[];
+} line_t;
+
+typedef struct conn_t {
+  int fd;
+  uint64_t id;    /* passed to the handler with each line */
+  int eof;        /* the client finished sending, or the connection failed */
+  int busy;       /* a line is with a worker, which owns `out` meanwhile */
+  int sending;    /* a send of `out` is in flight */
+  int closing;    /* the close has been submitted */
+  int inflight;   /* submissions that still refer to this connection */
+  size_t sent;    /* bytes of `out` already sent */
+  size_t partial_len;
+  char partial[MAXLINE]; /* start of a line still being received */
+  line_t *lines, *lines_tail; /* complete lines, in order */
+  line_t *current;            /* the line being handled by a worker */
+  wbuf_t out;                 /* response of `current` */
+  struct conn_t *next_job;
+} conn_t;
+
+typedef struct uring_t {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries, sq_local_tail, to_submit;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *buf_ring;
+  char *buffers;
+} uring_t;
+
+static int ENABLED = 0;
+
+/* Connections and lines, recycled by the ring thread, which allocates and
+ * frees them all. Every line takes room for the longest one. */
+static slab_t CONN_SLAB = SLAB_INITIALIZER(conn_t);
+static slab_t LINE_SLAB = {sizeof(line_t) + MAXLINE + 1, NULL, 0};
+
+static uint64_t NEXT_CONN_ID = 0; /* only used by the ring thread */
+
+/* Lines waiting for a worker, in one list per lane, and connections whose
+ * worker has finished. */
+static pthread_mutex_t JOBS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t JOBS_READY = PTHREAD_COND_INITIALIZER;
+static conn_t *JOBS[NUM_LANES], *JOBS_TAIL[NUM_LANES];
+static int QUEUED_JOBS = 0;
+static int PASSED_OVER = 0; /* jobs taken while a less urgent lane waited */
+static conn_t *DONE = NULL;
+static int WAKE_FD = -1;
+static uint64_t WAKE_VALUE;
+static uring_line_handler_t HANDLER;
+
+void uring_server_set_enabled(int enabled) { ENABLED = enabled; }
+
+int uring_server_enabled(void) { return ENABLED; }
+
+static int uring_enter(uring_t *ring, unsigned to_submit, unsigned min_complete) {
+  return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Maps the rings of a new io_uring, returning -1 if the kernel lacks it or
+ * any feature the server needs. */
+static int uring_setup(uring_t *ring) {
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  struct io_uring_buf_reg reg;
+  size_t sq_size, cq_size, probe_size;
+  char *sq, *cq;
+  int supported;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  if ((ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0)
+    return -1;
+
+  /* SEND_ZC arrived in the same release as multishot recv, so use it to
+   * detect kernels older than 6.0. */
+  probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  if ((probe = calloc(1, probe_size)) == NULL)
+    goto fail;
+  supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+              probe->last_op >= IORING_OP_SEND_ZC &&
+              (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if (!supported || !(params.features & IORING_FEAT_SINGLE_MMAP))
+    goto fail;
+
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > sq_size)
+    sq_size = cq_size;
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  cq = sq;
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  /* Provided buffers that multishot recvs pick from. */
+  ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buf_ring == MAP_FAILED ||
+      (ring->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE)) == NULL)
+    goto fail;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BGID;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    goto fail;
+  for (unsigned bid = 0; bid < URING_BUFFERS; bid++) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[bid];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (uint16_t)bid;
+  }
+  __atomic_store_n(&ring->buf_ring->tail, URING_BUFFERS, __ATOMIC_RELEASE);
+  return 0;
+
+fail:
+  /* The mappings are left behind, as the process falls back for good. */
+  close(ring->fd);
+  return -1;
+}
+
+/* Hands a provided buffer back to the kernel once its data has been copied. */
+static void uring_return_buffer(uring_t *ring, unsigned bid) {
+  uint16_t tail = ring->buf_ring->tail;
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (URING_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = (uint16_t)bid;
+  __atomic_store_n(&ring->buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring, conn_t *conn, int type) {
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+  if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+      ring->sq_entries) {
+    /* The submission queue is full: hand it to the kernel first. */
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    uring_enter(ring, ring->to_submit, 0);
+    ring->to_submit = 0;
+  }
+  idx = ring->sq_local_tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t)conn | (unsigned)type;
+  ring->sq_array[idx] = idx;
+  ring->sq_local_tail++;
+  ring->to_submit++;
+  if (conn)
+    conn->inflight++;
+  return sqe;
+}
+
+static void submit_accept(uring_t *ring, int listenfd) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, NULL, EV_ACCEPT);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void submit_recv(uring_t *ring, conn_t *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, conn, EV_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+}
+
+static void submit_wake_read(uring_t *ring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, NULL, EV_WAKE);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = WAKE_FD;
+  sqe->addr = (uint64_t)(uintptr_t)&WAKE_VALUE;
+  sqe->len = sizeof(WAKE_VALUE);
+  sqe->off = (uint64_t)-1;
+}
+
+static void submit_close(uring_t *ring, conn_t *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, conn, EV_CLOSE);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = conn->fd;
+  conn->closing = 1;
+}
+
+/* Sends the rest of `conn`'s response. If the client has already finished
+ * and nothing else is queued, the close is linked behind the send. */
+static void submit_send(uring_t *ring, conn_t *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, conn, EV_SEND);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(conn->out.wb_buf + conn->sent);
+  sqe->len = (uint32_t)(conn->out.wb_len - conn->sent);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  conn->sending = 1;
+  if (conn->eof && conn->lines == NULL) {
+    /* A short send fails the link, which cancels the close. */
+    sqe->flags = IOSQE_IO_LINK;
+    submit_close(ring, conn);
+  }
+}
+
+/* Moves `conn` along once it has no line with a worker and no send in
+ * flight: its next line goes to a worker, or it is closed if it is done. */
+static void advance(uring_t *ring, conn_t *conn) {
+  if (conn->busy || conn->sending || conn->closing)
+    return;
+  if (conn->lines != NULL) {
+    conn->current = conn->lines;
+    if ((conn->lines = conn->lines->next) == NULL)
+      conn->lines_tail = NULL;
+    conn->busy = 1;
+    request_lane_t lane = request_lane(conn->current->data);
+    pthread_mutex_lock(&JOBS_LOCK);
+    conn->next_job = NULL;
+    if (JOBS_TAIL[lane])
+      JOBS_TAIL[lane]->next_job = conn;
+    else
+      JOBS[lane] = conn;
+    JOBS_TAIL[lane] = conn;
+    QUEUED_JOBS++;
+    pthread_cond_signal(&JOBS_READY);
+    pthread_mutex_unlock(&JOBS_LOCK);
+  } else if (conn->eof) {
+    submit_close(ring, conn);
+  }
+}
+
+static void queue_line(conn_t *conn, const char *data, size_t len) {
+  line_t *line = slab_alloc(&LINE_SLAB);
+  if (line == NULL)
+    return;
+  memcpy(line->data, data, len);
+  line->data[len] = '\0';
+  line->len = (ssize_t)len;
+  line->queued_at = metrics_now_ns();
+  line->next = NULL;
+  if (conn->lines_tail)
+    conn->lines_tail->next = line;
+  else
+    conn->lines = line;
+  conn->lines_tail = line;
+}
+
+/* Splits received bytes into lines as `rio_readlineb` would, including
+ * cutting lines that do not fit in MAXLINE. */
+static void receive(conn_t *conn, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    conn->partial[conn->partial_len++] = data[i];
+    if (data[i] == '\n' || conn->partial_len == MAXLINE - 1) {
+      queue_line(conn, conn->partial, conn->partial_len);
+      conn->partial_len = 0;
+    }
+  }
+}
+
+static void finish_conn(conn_t *conn) {
+  line_t *line;
+  while ((line = conn->lines) != NULL) {
+    conn->lines = line->next;
+    slab_free(&LINE_SLAB, line);
+  }
+  wbuf_free(&conn->out);
+  slab_free(&CONN_SLAB, conn);
+}
+
+static void handle_cqe(uring_t *ring, int listenfd, struct io_uring_cqe *cqe) {
+  conn_t *conn = (conn_t *)(uintptr_t)(cqe->user_data & ~EV_MASK);
+  int type = (int)(cqe->user_data & EV_MASK), more = cqe->flags & IORING_CQE_F_MORE;
+
+  if (conn && !more)
+    conn->inflight--;
+
+  switch (type) {
+  case EV_ACCEPT:
+    if (cqe->res >= 0 && (conn = slab_alloc(&CONN_SLAB)) != NULL) {
+      memset(conn, 0, sizeof(*conn));
+      conn->fd = cqe->res;
+      conn->id = ++NEXT_CONN_ID;
+      wbuf_init(&conn->out, -1);
+      submit_recv(ring, conn);
+    } else if (cqe->res >= 0) {
+      close(cqe->res);
+    } else {
+      LOG_WARN("accept failed: %s", strerror(-cqe->res));
+    }
+    if (!more)
+      submit_accept(ring, listenfd);
+    return;
+
+  case EV_WAKE:
+    /* Workers have finished lines: send their responses. */
+    pthread_mutex_lock(&JOBS_LOCK);
+    conn_t *done = DONE;
+    DONE = NULL;
+    pthread_mutex_unlock(&JOBS_LOCK);
+    while (done) {
+      conn = done;
+      done = done->next_job;
+      conn->busy = 0;
+      slab_free(&LINE_SLAB, conn->current);
+      conn->current = NULL;
+      if (conn->out.wb_len > 0)
+        submit_send(ring, conn);
+      else
+        advance(ring, conn);
+    }
+    submit_wake_read(ring);
+    return;
+
+  case EV_RECV:
+    if (cqe->res > 0) {
+      unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      receive(conn, ring->buffers + (size_t)bid * URING_BUFFER_SIZE, (size_t)cqe->res);
+      uring_return_buffer(ring, bid);
+    } else if (cqe->res == -ENOBUFS) {
+      /* Every buffer was in use; they have been returned since. */
+    } else {
+      conn->eof = 1;
+      if (conn->partial_len > 0) {
+        queue_line(conn, conn->partial, conn->partial_len);
+        conn->partial_len = 0;
+      }
+    }
+    if (!more && !conn->eof)
+      submit_recv(ring, conn);
+    advance(ring, conn);
+    break;
+
+  case EV_SEND:
+    conn->sending = 0;
+    if (cqe->res < 0) {
+      /* The client is gone: drop its remaining work. */
+      conn->eof = 1;
+      conn->out.wb_len = 0;
+      conn->sent = 0;
+      while (conn->lines) {
+        line_t *line = conn->lines;
+        conn->lines = line->next;
+        slab_free(&LINE_SLAB, line);
+      }
+      conn->lines_tail = NULL;
+      shutdown(conn->fd, SHUT_RDWR);
+    } else if ((conn->sent += (size_t)cqe->res) < conn->out.wb_len) {
+      if (!conn->closing) {
+        submit_send(ring, conn);
+        return;
+      }
+      /* Wait for the linked close to be cancelled, then send the rest. */
+      return;
+    } else {
+      conn->out.wb_len = 0;
+      conn->sent = 0;
+    }
+    advance(ring, conn);
+    break;
+
+  case EV_CLOSE:
+    if (cqe->res == -ECANCELED) {
+      /* A short send broke the link: send the rest, then close again. */
+      conn->closing = 0;
+      if (conn->sent < conn->out.wb_len)
+        submit_send(ring, conn);
+      else
+        advance(ring, conn);
+      return;
+    }
+    break;
+  }
+
+  if (conn->closing && conn->inflight == 0)
+    finish_conn(conn);
+}
+
+/* Takes the next job from the most urgent lane, unless a less urgent one
+ * has been passed over `LANE_PASS_LIMIT` times. Requires `JOBS_LOCK`. */
+static conn_t *take_job(void) {
+  int lane = 0, last = NUM_LANES - 1;
+  while (JOBS[lane] == NULL)
+    lane++;
+  while (JOBS[last] == NULL)
+    last--;
+  if (lane == last) {
+    PASSED_OVER = 0;
+  } else if (++PASSED_OVER > LANE_PASS_LIMIT) {
+    lane = last;
+    PASSED_OVER = 0;
+  }
+  conn_t *conn = JOBS[lane];
+  if ((JOBS[lane] = conn->next_job) == NULL)
+    JOBS_TAIL[lane] = NULL;
+  QUEUED_JOBS--;
+  return conn;
+}
+
+static void *uring_worker(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&JOBS_LOCK);
+    while (QUEUED_JOBS == 0)
+      pthread_cond_wait(&JOBS_READY, &JOBS_LOCK);
+    conn_t *conn = take_job();
+    pthread_mutex_unlock(&JOBS_LOCK);
+
+    HANDLER(conn->current->data, conn->current->len, &conn->out,
+            conn->current->queued_at, metrics_now_ns(), conn->id);
+
+    pthread_mutex_lock(&JOBS_LOCK);
+    conn->next_job = DONE;
+    DONE = conn;
+    pthread_mutex_unlock(&JOBS_LOCK);
+    uint64_t one = 1;
+    if (write(WAKE_FD, &one, sizeof(one)) < 0)
+      LOG_ERROR("cannot wake the ring thread: %s", strerror(errno));
+  }
+  return NULL;
+}
+
+int uring_server_run(int listenfd, int num_workers, uring_line_handler_t handler) {
+  uring_t ring;
+  pthread_t thread;
+
+  if (uring_setup(&ring) < 0) {
+    fprintf(stderr, "io_uring is unavailable, using blocking I/O\n");
+    return -1;
+  }
+  if ((WAKE_FD = eventfd(0, EFD_CLOEXEC)) < 0) {
+    perror("eventfd");
+    close(ring.fd);
+    return -1;
+  }
+  HANDLER = handler;
+  for (int i = 0; i < num_workers; i++) {
+    if (pthread_create(&thread, NULL, uring_worker, NULL) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+
+  submit_accept(&ring, listenfd);
+  submit_wake_read(&ring);
+  while (1) {
+    unsigned head, tail;
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    if (uring_enter(&ring, ring.to_submit, 1) < 0 && errno != EINTR) {
+      perror("io_uring_enter");
+      exit(1);
+    }
+    ring.to_submit = 0;
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+      /* Free the slot before handling, which may submit more work. */
+      __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+      handle_cqe(&ring, listenfd, &cqe);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef URING_SERVER_HEADER
+#define URING_SERVER_HEADER
+
+#include <stdint.h>
+#include "network_utils.h"
+
+/** An io_uring backend for the line-based server of the airport nodes, used
+ *  instead of one blocking thread per connection.
+ *
+ *  A single ring thread owns every connection. It accepts with one multishot
+ *  accept, receives with multishot recvs into a ring of provided buffers and
+ *  splits the data into request lines. Complete lines are handed one at a
+ *  time per connection to a pool of worker threads, low-fuel SCHEDULEs
+ *  first (see `request_lane`). A worker buffers the whole response to its
+ *  line, which the ring thread then sends with a single send, linked to the
+ *  close once the client has finished. Per request this costs no syscalls
+ *  beyond the batched `io_uring_enter` calls of the ring thread.
+ *
+ *  The ring is driven through the raw system calls, so no liburing is needed.
+ *  It requires Linux 6.0 or later; on older kernels, or where io_uring is
+ *  disabled, `uring_server_run` fails and callers keep their blocking loop.
+ */
+
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 512 /* must be a power of two */
+#define URING_BUFFER_SIZE 4096
+
+/** Handles one request line of `len` bytes, writing its response to `out`.
+ *  `queued_at` and `dequeued_at` bound the time the line waited for a worker,
+ *  as returned by `metrics_now_ns`. `conn_id` identifies the connection the
+ *  line came on; connections are numbered from 1 as they are accepted.
+ */
+typedef void (*uring_line_handler_t)(char *line, ssize_t len, wbuf_t *out,
+                                     uint64_t queued_at, uint64_t dequeued_at,
+                                     uint64_t conn_id);
+
+/** @brief Selects the io_uring backend for servers started afterwards. The
+ *         controller passes it on to the nodes it spawns with `-u`. */
+void uring_server_set_enabled(int enabled);
+
+/** @brief Returns 1 if the io_uring backend has been selected. */
+int uring_server_enabled(void);
+
+/** @brief Serves connections accepted on `listenfd`, passing each request line
+ *         to `handler` on one of `num_workers` threads.
+ *
+ *  @returns -1 without serving anything if io_uring is unavailable, in which
+ *           case the caller should fall back to its blocking loop. Otherwise
+ *           it does not return.
+ */
+int uring_server_run(int listenfd, int num_workers, uring_line_handler_t handler);
+
+#endif
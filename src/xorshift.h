@@ -0,0 +1,25 @@
+#ifndef XORSHIFT_HEADER
+#define XORSHIFT_HEADER
+
+#include <stdint.h>
+
+/** The xorshift64 generator the benchmarks draw their requests from. Each
+ *  thread keeps its own state, so no draw is shared between threads.
+ */
+
+/** @brief Returns the initial state of the `stream`th thread's generator,
+ *         spread over the state space by the golden ratio so no two threads
+ *         draw the same sequence. Never zero for `stream` >= 0. */
+static inline uint64_t xorshift_seed(int stream) {
+  return UINT64_C(0x9e3779b97f4a7c15) * ((uint64_t)stream + 1);
+}
+
+/** @brief Advances the generator state `rng` and returns its next value. */
+static inline uint64_t xorshift_next(uint64_t *rng) {
+  *rng ^= *rng << 13;
+  *rng ^= *rng >> 7;
+  *rng ^= *rng << 17;
+  return *rng;
+}
+
+#endif